@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "anim.h"
 #include "flic.h"
+#include "arena.h"
+#include "spx.h"
 #include "globals.h"
 #ifdef WITH_GIF_SUPPORT
 #include "gif_lib.h"
@@ -9,6 +12,9 @@
 
 #define FRAME_REALLOC_COUNT 2
 
+// Upper limit for arena chunks. Larger animations use several chunks.
+#define ARENA_MAX_CHUNK_SIZE	(256 * 1024 * 1024)
+
 int anim_addFrame(animation_t *anim, sprite_t *frame)
 {
 	// Check if there is space first. Initially, allocated_frames is zero,
@@ -28,6 +34,50 @@ int anim_addFrame(animation_t *anim, sprite_t *frame)
 	return 0;
 }
 
+int anim_reserveFrames(animation_t *anim, int count, int w, int h)
+{
+	size_t frame_size, chunk_size;
+	sprite_t **frames;
+
+	if (count < 1)
+		return 0;
+
+	if (anim->num_frames + count > anim->allocated_frames) {
+		frames = realloc(anim->frames, (anim->num_frames + count) * sizeof(anim->frames));
+		if (!frames) {
+			perror("Cound not allocate space for frames\n");
+			return -1;
+		}
+		anim->frames = frames;
+		anim->allocated_frames = anim->num_frames + count;
+	}
+
+	if (!anim->arena) {
+		// struct + pixels, with room for alignment
+		frame_size = sizeof(sprite_t) + w * h + 32;
+		chunk_size = frame_size * count;
+		if (chunk_size > ARENA_MAX_CHUNK_SIZE) {
+			chunk_size = ARENA_MAX_CHUNK_SIZE;
+		}
+
+		anim->arena = arena_create(chunk_size);
+		if (!anim->arena) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+sprite_t *anim_allocFrame(animation_t *anim, uint16_t w, uint16_t h, uint16_t palsize, uint8_t flags)
+{
+	if (anim->arena) {
+		return allocSpriteInArena(anim->arena, w, h, palsize, flags);
+	}
+
+	return allocSprite(w, h, palsize, flags);
+}
+
 animation_t *anim_create(void)
 {
 	animation_t *anim;
@@ -46,6 +96,7 @@ static int anim_addFramesFromGIF(animation_t *anim, const char *filename)
 	GifFileType *gf;
 	GifColorType *color;
 	sprite_t *sprite = NULL;
+	palette_t *palette = NULL;
 	int err = 0;
 	int i,j;
 	int y;
@@ -73,13 +124,27 @@ static int anim_addFramesFromGIF(animation_t *anim, const char *filename)
 	anim->w = gf->SWidth;
 	anim->h = gf->SHeight;
 
+	// All frames use the global colormap and share a single palette
+	palette = palette_new();
+	if (!palette) {
+		goto error;
+	}
+	color = gf->SColorMap->Colors;
+	for (i=0; i<gf->SColorMap->ColorCount; i++,color++) {
+		palette_setColor(palette, i, color->Red, color->Green, color->Blue);
+	}
+
+	if (anim_reserveFrames(anim, gf->ImageCount, gf->SWidth, gf->SHeight)) {
+		goto error;
+	}
+
 	disposal = DISPOSE_BACKGROUND;
 
 	for (j=0; j<gf->ImageCount; j++) {
 //		printf("GIF frame %d:\n", j+1);
 
 		// Create sprite with same size as GIF
-		sprite = allocSprite(gf->SWidth, gf->SHeight, gf->SColorMap->ColorCount, 0);
+		sprite = anim_allocFrame(anim, gf->SWidth, gf->SHeight, gf->SColorMap->ColorCount, 0);
 		if (!sprite) {
 			fprintf(stderr, "failed to allocate sprite\n");
 			goto error;
@@ -129,11 +194,7 @@ static int anim_addFramesFromGIF(animation_t *anim, const char *filename)
 			}
 		}
 
-		// Copy colormap
-		color = gf->SColorMap->Colors;
-		for (i=0; i<gf->SColorMap->ColorCount; i++,color++) {
-			palette_setColor(&sprite->palette, i, color->Red, color->Green, color->Blue);
-		}
+		sprite_applyPalette(sprite, palette);
 
 		// Copy image
 		for (i=0,y = gf->SavedImages[j].ImageDesc.Top; y < gf->SavedImages[j].ImageDesc.Top + gf->SavedImages[0].ImageDesc.Height; y++,i++) {
@@ -152,6 +213,8 @@ static int anim_addFramesFromGIF(animation_t *anim, const char *filename)
 		fprintf(stderr, "Warning: Could not close gif: %s\n", GifErrorString(err));
 	}
 
+	palette_unref(palette);
+
 	return 0;
 
 error:
@@ -163,46 +226,130 @@ error:
 	if (sprite) {
 		freeSprite(sprite);
 	}
+	palette_unref(palette);
 
 	return -1;
 }
 #endif // WITH_GIF_SUPPORT
 
+/* Call func once for each distinct palette used by the frames, on a new copy
+ * of that palette. Frames which shared a palette share the modified copy. */
+int anim_transformPalettes(animation_t *anim, int (*func)(palette_t *pal, void *ctx), void *ctx)
+{
+	palette_t **orig, **modified;
+	int i, j, n = 0, ret = 0;
+
+	orig = calloc(anim->num_frames, sizeof(palette_t *));
+	modified = calloc(anim->num_frames, sizeof(palette_t *));
+	if (!orig || !modified) {
+		perror("calloc");
+		free(orig);
+		free(modified);
+		return -1;
+	}
+
+	for (i=0; i<anim->num_frames; i++) {
+		for (j=0; j<n; j++) {
+			if (orig[j] == anim->frames[i]->palette)
+				break;
+		}
+
+		if (j == n) {
+			// First frame using this palette. Keep a reference so it cannot be freed
+			// (and its address reused) while the remaining frames are processed.
+			orig[n] = palette_ref(anim->frames[i]->palette);
+			modified[n] = palette_new();
+			if (!orig[n] || !modified[n]) {
+				palette_unref(orig[n]);
+				palette_unref(modified[n]);
+				ret = -1;
+				break;
+			}
+			palette_copy(modified[n], orig[n]);
+			n++;
+
+			if (func(modified[j], ctx)) {
+				ret = -1;
+				break;
+			}
+		}
+
+		sprite_applyPalette(anim->frames[i], modified[j]);
+	}
+
+	for (j=0; j<n; j++) {
+		palette_unref(orig[j]);
+		palette_unref(modified[j]);
+	}
+	free(orig);
+	free(modified);
+
+	return ret;
+}
+
 int anim_addAllFramesToFlic(const animation_t *anim, FlicFile *output)
 {
 	sprite_t *screen;
-	uint8_t t;
-	int i, j;
-	uint8_t *src, *dst;
+	uint8_t **pixels;
+	palette_t **palettes;
+	uint8_t *composed = NULL;
+	int size, i, num_keyed = 0, retcode;
 
 	if (anim->num_frames < 1)
 		return 0; // nothing do do
 
+	size = anim->frames[0]->w * anim->frames[0]->h;
 	screen = duplicateSprite(anim->frames[0]);
+	pixels = calloc(anim->num_frames, sizeof(uint8_t *));
+	palettes = calloc(anim->num_frames, sizeof(palette_t *));
+	if (!screen || !pixels || !palettes) {
+		retcode = -1;
+		goto done;
+	}
 
+	// Frames with transparency are drawn over the previous ones. Keep a
+	// copy of each result, the frames are encoded all at once.
 	for (i=0; i<anim->num_frames; i++) {
 		if (anim->frames[i]->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR) {
-			t = anim->frames[i]->transparent_color;
-			src = anim->frames[i]->pixels;
-			dst = screen->pixels;
-			for (j=0; j<screen->w*screen->h; j++) {
-				if (*src != t) {
-					*dst = *src;
-				}
-				src++;
-				dst++;
-			}
-			flic_appendFrame(output, screen->pixels, &screen->palette);
+			num_keyed++;
+		}
+	}
+	if (num_keyed) {
+		composed = malloc((size_t)num_keyed * size);
+		if (!composed) {
+			perror("malloc");
+			retcode = -1;
+			goto done;
+		}
+	}
 
+	for (num_keyed=0, i=0; i<anim->num_frames; i++) {
+		if (anim->frames[i]->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR) {
+			// Frames are only composited once, so the keyed row blitter
+			// is used rather than compiling spans.
+			sprite_copyRect(anim->frames[i], NULL, screen, NULL);
+			pixels[i] = composed + (size_t)num_keyed * size;
+			memcpy(pixels[i], screen->pixels, size);
+			palettes[i] = screen->palette;
+			num_keyed++;
 		}
 		else {
-			flic_appendFrame(output, anim->frames[i]->pixels, &anim->frames[i]->palette);
+			pixels[i] = anim->frames[i]->pixels;
+			palettes[i] = anim->frames[i]->palette;
 		}
 	}
 
-	freeSprite(screen);
+	retcode = flic_appendFrames(output, pixels, palettes, anim->num_frames, 0);
 
-	return 0;
+done:
+	free(composed);
+	free(pixels);
+	free(palettes);
+	if (screen) {
+		freeSprite(screen);
+	}
+
+	return retcode;
 }
 
 int anim_addFramesFromFlic(animation_t *anim, const char *filename)
@@ -226,12 +373,22 @@ int anim_addFramesFromFlic(animation_t *anim, const char *filename)
 	anim->w = flic->header.width;
 	anim->h = flic->header.height;
 
+	if (anim_reserveFrames(anim, flic->header.frames, anim->w, anim->h)) {
+		flic_close(flic);
+		return -1;
+	}
+
 	while (0 == flic_readOneFrame(flic, 0)) {
-		sprite = flic_spriteFromFrame(flic);
+		sprite = anim_allocFrame(anim, anim->w, anim->h, 256, 0);
 		if (!sprite) {
 			flic_close(flic);
 			return -1;
 		}
+		if (flic_frameToSprite(flic, sprite)) {
+			freeSprite(sprite);
+			flic_close(flic);
+			return -1;
+		}
 
 		anim_addFrame(anim, sprite);
 	}
@@ -241,6 +398,58 @@ int anim_addFramesFromFlic(animation_t *anim, const char *filename)
 	return 0;
 }
 
+int anim_addFramesFromSPX(animation_t *anim, const char *filename)
+{
+	spx_file_t *spx;
+	sprite_t *sprite;
+	int i;
+
+	if (!isSpxFile(filename)) {
+		return -1;
+	}
+
+	spx = spx_open(filename);
+	if (!spx) {
+		return -1;
+	}
+
+	if (anim->delay == 0) {
+		anim->delay = spx->delay;
+	}
+
+	anim->w = spx->w;
+	anim->h = spx->h;
+
+	// Frames point into the mapped file, nothing to copy.
+	for (i=0; i<spx->num_frames; i++) {
+		sprite = spx_getFrame(spx, i);
+		if (!sprite) {
+			spx_close(spx);
+			return -1;
+		}
+		anim_addFrame(anim, sprite);
+	}
+
+	spx_close(spx);
+
+	return 0;
+}
+
+int anim_addAllFramesToSPX(const animation_t *anim, spx_writer_t *output)
+{
+	int i;
+
+	// Frames are stored as they are (with their own transparency) rather
+	// than composited as for FLIC files.
+	for (i=0; i<anim->num_frames; i++) {
+		if (spx_appendFrame(output, anim->frames[i])) {
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
 animation_t *anim_load(const char *filename)
 {
 	animation_t *anim;
@@ -250,6 +459,10 @@ animation_t *anim_load(const char *filename)
 		return NULL;
 	}
 
+	if (0 == anim_addFramesFromSPX(anim, filename)) {
+		return anim;
+	}
+
 	if (0 == anim_addFramesFromFlic(anim, filename)) {
 		return anim;
 	}
@@ -266,18 +479,36 @@ animation_t *anim_load(const char *filename)
 	return NULL;
 }
 
+void *anim_prefetchLoad(const char *filename, size_t *size)
+{
+	animation_t *anim = anim_load(filename);
+
+	if (anim) {
+		*size = (size_t)anim->num_frames * anim->w * anim->h;
+	}
+
+	return anim;
+}
+
+void anim_prefetchRelease(void *anim)
+{
+	anim_free(anim);
+}
+
 void anim_free(animation_t *anim)
 {
 	int i;
 
 	if (anim) {
 		if (anim->frames) {
+			// For arena frames this only drops palette references
 			for (i=0; i<anim->num_frames; i++) {
 				freeSprite(anim->frames[i]);
 			}
 
 			free(anim->frames);
 		}
+		arena_free(anim->arena);
 		free(anim);
 	}
 }
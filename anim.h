@@ -3,6 +3,7 @@
 
 #include "sprite.h"
 #include "flic.h"
+#include "spx.h"
 
 typedef struct animation {
 	int w,h;
@@ -10,17 +11,37 @@ typedef struct animation {
 	sprite_t **frames;
 	int allocated_frames;
 	int delay; // time between frames in ms
+	struct arena *arena; // frame storage, when created by anim_reserveFrames
 } animation_t;
 
 animation_t *anim_create(void);
 animation_t *anim_load(const char *filename);
 void anim_free(animation_t *anim);
 
+// anim_load and anim_free for use with prefetch_create / prefetch_free
+void *anim_prefetchLoad(const char *filename, size_t *size);
+void anim_prefetchRelease(void *anim);
+
 // This is add and forget. i.e. This just adds the sprite pointer to an array.
 // do not call freeSprite. freeSprite will be called by anim_free.
 int anim_addFrame(animation_t *anim, sprite_t *frame);
 
+// Prepare for 'count' more frames of w x h pixels. Frames obtained from
+// anim_allocFrame are then taken from one contiguous slab (arena) instead
+// of being individually allocated.
+int anim_reserveFrames(animation_t *anim, int count, int w, int h);
+// Allocate a frame for this animation (from the arena if there is one).
+// Still needs to be added using anim_addFrame.
+sprite_t *anim_allocFrame(animation_t *anim, uint16_t w, uint16_t h, uint16_t palsize, uint8_t flags);
+
 int anim_addFramesFromFlic(animation_t *anim, const char *filename);
 int anim_addAllFramesToFlic(const animation_t *anim, FlicFile *output);
 
+// Uncompressed, memory-mapped container (see spx.h)
+int anim_addFramesFromSPX(animation_t *anim, const char *filename);
+int anim_addAllFramesToSPX(const animation_t *anim, spx_writer_t *output);
+
+// Modify palettes once per distinct palette rather than once per frame
+int anim_transformPalettes(animation_t *anim, int (*func)(palette_t *pal, void *ctx), void *ctx);
+
 #endif // _anim_h__
@@ -0,0 +1,89 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include "arena.h"
+
+#define ARENA_ALIGN	16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	uint8_t *data;
+};
+
+static struct arena_chunk *arena_newChunk(size_t size)
+{
+	struct arena_chunk *c;
+
+	c = malloc(sizeof(struct arena_chunk));
+	if (!c) {
+		perror("Could not allocate arena chunk");
+		return NULL;
+	}
+
+	// calloc gives zero-filled pages cheaply for large chunks
+	c->data = calloc(1, size);
+	if (!c->data) {
+		perror("Could not allocate arena chunk data");
+		free(c);
+		return NULL;
+	}
+
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+
+	return c;
+}
+
+struct arena *arena_create(size_t chunk_size)
+{
+	struct arena *a;
+
+	a = calloc(1, sizeof(struct arena));
+	if (!a) {
+		perror("Could not allocate arena");
+		return NULL;
+	}
+
+	a->chunk_size = chunk_size;
+
+	return a;
+}
+
+void arena_free(struct arena *a)
+{
+	struct arena_chunk *c, *next;
+
+	if (a) {
+		for (c = a->chunks; c; c = next) {
+			next = c->next;
+			free(c->data);
+			free(c);
+		}
+		free(a);
+	}
+}
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *c = a->chunks;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	if (!c || (c->size - c->used < size)) {
+		c = arena_newChunk(size > a->chunk_size ? size : a->chunk_size);
+		if (!c) {
+			return NULL;
+		}
+		c->next = a->chunks;
+		a->chunks = c;
+	}
+
+	p = c->data + c->used;
+	c->used += size;
+
+	return p;
+}
@@ -0,0 +1,27 @@
+#ifndef _arena_h__
+#define _arena_h__
+
+#include <stddef.h>
+
+/* Arena (bump) allocator
+ *
+ * Memory is taken from large chunks and is only released all at once
+ * by arena_free. Used to keep many objects with the same lifetime (e.g.
+ * animation frames) contiguous.
+ */
+
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *chunks; // most recent first
+	size_t chunk_size;
+};
+
+struct arena *arena_create(size_t chunk_size);
+void arena_free(struct arena *a);
+
+// Returns zeroed memory, aligned for any type. Grows the arena
+// with a new chunk when the current one is full.
+void *arena_alloc(struct arena *a, size_t size);
+
+#endif // _arena_h__
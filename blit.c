@@ -0,0 +1,228 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "blit.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+void blit_rowOpaque(uint8_t *dst, const uint8_t *src, int count)
+{
+	// memmove since source and destination may be the same sprite
+	memmove(dst, src, count);
+}
+
+void blit_rowKeyed(uint8_t *dst, const uint8_t *src, int count, uint8_t key)
+{
+	int i = 0;
+
+#ifdef __SSE2__
+	__m128i k = _mm_set1_epi8(key);
+	__m128i s, d, m;
+
+	// 16 pixels at a time: Keep the destination where the source
+	// equals the key, take the source everywhere else.
+	for (; i + 16 <= count; i += 16) {
+		s = _mm_loadu_si128((const __m128i *)(src + i));
+		d = _mm_loadu_si128((const __m128i *)(dst + i));
+		m = _mm_cmpeq_epi8(s, k);
+		d = _mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s));
+		_mm_storeu_si128((__m128i *)(dst + i), d);
+	}
+#endif
+
+	for (; i < count; i++) {
+		if (src[i] != key) {
+			dst[i] = src[i];
+		}
+	}
+}
+
+void blit_rowMasked(uint8_t *dst, const uint8_t *src, const uint32_t *mask, int bit, int count)
+{
+	int i, j, n;
+	uint32_t bits;
+
+#ifdef __SSE2__
+	const __m128i sel = _mm_set_epi8(-128,64,32,16,8,4,2,1,-128,64,32,16,8,4,2,1);
+	__m128i s, d, m;
+#endif
+
+	// Up to 32 pixels at a time (one mask word)
+	for (i=0; i<count; i+=n) {
+		n = count - i;
+		if (n > 32) {
+			n = 32;
+		}
+
+		bits = blit_maskBits(mask, bit + i, n);
+		if (bits == 0) {
+			// all opaque
+			memmove(dst + i, src + i, n);
+			continue;
+		}
+		if (bits == (n == 32 ? 0xffffffff : (1u << n) - 1)) {
+			// all transparent
+			continue;
+		}
+
+		j = 0;
+#ifdef __SSE2__
+		// 16 pixels at a time: Spread the mask bits over bytes, then take the
+		// source where the bit is clear and keep the destination elsewhere.
+		for (; j + 16 <= n; j += 16) {
+			m = _mm_set_epi64x(((bits >> (j + 8)) & 0xff) * 0x0101010101010101ULL,
+								((bits >> j) & 0xff) * 0x0101010101010101ULL);
+			m = _mm_cmpeq_epi8(_mm_and_si128(m, sel), sel);
+			s = _mm_loadu_si128((const __m128i *)(src + i + j));
+			d = _mm_loadu_si128((const __m128i *)(dst + i + j));
+			d = _mm_or_si128(_mm_and_si128(m, d), _mm_andnot_si128(m, s));
+			_mm_storeu_si128((__m128i *)(dst + i + j), d);
+		}
+#endif
+		for (; j < n; j++) {
+			if (!(bits & (1u << j))) {
+				dst[i + j] = src[i + j];
+			}
+		}
+	}
+}
+
+void blit_rowFill(uint8_t *dst, uint8_t color, int count)
+{
+	memset(dst, color, count);
+}
+
+static int isOpaque(const sprite_view_t *src, const uint8_t *row, const uint32_t *maskrow, int x)
+{
+	if (src->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR) {
+		return row[x] != src->transparent_color;
+	}
+	if ((src->flags & SPRITE_FLAG_OPAQUE) || !maskrow) {
+		return 1;
+	}
+	return !blit_maskBits(maskrow, src->mask_x + x, 1);
+}
+
+blit_spans_t *blit_compileSpans(const sprite_view_t *src)
+{
+	blit_spans_t *spans;
+	const uint8_t *row;
+	const uint32_t *maskrow = NULL;
+	int x, y, start, last, n = 0, alloc = 0;
+	blit_span_t *tmp;
+
+	if (src->wrap_w) {
+		fprintf(stderr, "Wrapped views not supported\n");
+		return NULL;
+	}
+
+	spans = calloc(1, sizeof(blit_spans_t));
+	if (!spans) {
+		perror("calloc");
+		return NULL;
+	}
+
+	spans->w = src->w;
+	spans->h = src->h;
+	spans->pixels = src->pixels;
+	spans->pitch = src->pitch;
+	spans->row_first = malloc(sizeof(int) * (src->h + 1));
+	if (!spans->row_first) {
+		perror("malloc");
+		goto error;
+	}
+
+	for (y=0; y<src->h; y++) {
+		row = src->pixels + y * src->pitch;
+		if (src->mask) {
+			maskrow = src->mask + y * src->mask_pitch;
+		}
+
+		spans->row_first[y] = n;
+		last = 0;
+
+		for (x=0; x<src->w; ) {
+			// find the start of the next run
+			while ((x < src->w) && !isOpaque(src, row, maskrow, x)) {
+				x++;
+			}
+			if (x >= src->w) {
+				break;
+			}
+			start = x;
+			while ((x < src->w) && (x - start < 0xffff) && isOpaque(src, row, maskrow, x)) {
+				x++;
+			}
+
+			if (n >= alloc) {
+				alloc += 256;
+				tmp = realloc(spans->spans, sizeof(blit_span_t) * alloc);
+				if (!tmp) {
+					perror("realloc");
+					goto error;
+				}
+				spans->spans = tmp;
+			}
+
+			spans->spans[n].skip = start - last;
+			spans->spans[n].run = x - start;
+			last = x;
+			n++;
+		}
+	}
+	spans->row_first[src->h] = n;
+
+	return spans;
+
+error:
+	blit_freeSpans(spans);
+	return NULL;
+}
+
+void blit_freeSpans(blit_spans_t *spans)
+{
+	if (spans) {
+		free(spans->row_first);
+		free(spans->spans);
+		free(spans);
+	}
+}
+
+void blit_spans(const blit_spans_t *spans, sprite_t *dst, int x, int y)
+{
+	int Y, i, sx, a, b;
+	const uint8_t *srcrow;
+	uint8_t *dstrow;
+	const blit_span_t *sp;
+
+	for (Y=0; Y<spans->h; Y++) {
+		if ((y + Y) < 0) {
+			continue;
+		}
+		if ((y + Y) >= dst->h) {
+			break;
+		}
+
+		srcrow = spans->pixels + Y * spans->pitch;
+		dstrow = dst->pixels + (y + Y) * dst->w;
+
+		sx = 0;
+		for (i=spans->row_first[Y]; i<spans->row_first[Y+1]; i++) {
+			sp = &spans->spans[i];
+			sx += sp->skip;
+
+			// clip the run to the destination
+			a = sx;
+			b = sx + sp->run;
+			if (x + a < 0) { a = -x; }
+			if (x + b > dst->w) { b = dst->w - x; }
+			if (a < b) {
+				memcpy(dstrow + x + a, srcrow + a, b - a);
+			}
+
+			sx += sp->run;
+		}
+	}
+}
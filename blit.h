@@ -0,0 +1,70 @@
+#ifndef _blit_h__
+#define _blit_h__
+
+#include <stdint.h>
+#include "sprite.h"
+
+/* Row-span kernels used by the sprite blitting functions.
+ *
+ * All of those operate on 'count' pixels of a single row which must already
+ * be clipped to both the source and the destination surfaces.
+ */
+
+// Copy all pixels
+void blit_rowOpaque(uint8_t *dst, const uint8_t *src, int count);
+
+// Copy pixels which are not equal to 'key' (transparent color)
+void blit_rowKeyed(uint8_t *dst, const uint8_t *src, int count, uint8_t key);
+
+// Copy pixels for which the corresponding mask bit is clear. The mask bit
+// for src[0] is bit 'bit' of the mask row (see SPRITE_MASK_PITCH).
+void blit_rowMasked(uint8_t *dst, const uint8_t *src, const uint32_t *mask, int bit, int count);
+
+// Set all pixels to 'color'
+void blit_rowFill(uint8_t *dst, uint8_t color, int count);
+
+// Get 'count' (1 to 32) mask bits starting at bit 'bit' of a mask row. The
+// first pixel is the least significant bit of the result.
+static inline uint32_t blit_maskBits(const uint32_t *row, int bit, int count)
+{
+	int shift = bit & 31;
+	uint32_t v;
+
+	row += bit >> 5;
+	v = row[0] >> shift;
+	if (shift && (shift + count > 32)) {
+		v |= row[1] << (32 - shift);
+	}
+	if (count < 32) {
+		v &= (1u << count) - 1;
+	}
+	return v;
+}
+
+/* Span list: Precompiled form of a sprite where each row is a list
+ * of (skip, run) pairs describing the opaque pixels. Blitting it only
+ * copies runs and never looks at the transparent pixels.
+ *
+ * The span list refers to the pixels of the view it was compiled from. It
+ * must be recompiled if the source pixels or transparency change.
+ */
+typedef struct blit_span {
+	uint16_t skip; // transparent pixels before the run
+	uint16_t run; // opaque pixels to copy
+} blit_span_t;
+
+typedef struct blit_spans {
+	int w, h;
+	const uint8_t *pixels;
+	int pitch;
+	int *row_first; // Index of the first span of each row, plus one entry for the end
+	blit_span_t *spans;
+} blit_spans_t;
+
+blit_spans_t *blit_compileSpans(const sprite_view_t *src);
+void blit_freeSpans(blit_spans_t *spans);
+
+// Draw at x,y in dst. Clipped to the destination.
+void blit_spans(const blit_spans_t *spans, sprite_t *dst, int x, int y);
+
+#endif // _blit_h__
@@ -314,6 +314,7 @@ enum {
 	OPT_SAVEPAL,
 	OPT_DITHER,
 	OPT_ALGO,
+	OPT_PNGOPTS,
 };
 
 static struct option long_options[] = {
@@ -334,6 +335,7 @@ static struct option long_options[] = {
 	{ "savepal",	required_argument, 0, OPT_SAVEPAL },
 	{ "dither",		no_argument, 0, OPT_DITHER },
 	{ "algo",		required_argument, 0, OPT_ALGO },
+	{ "pngopts",	required_argument, 0, OPT_PNGOPTS },
 	{ }
 };
 
@@ -354,6 +356,7 @@ void printHelp(void)
 	printf(" -in file           Load image\n");
 	printf(" -reload            Reload image (uses previous -in filename)\n");
 	printf(" -out file          Write image\n");
+	printf(" -pngopts opts      PNG compression settings for -out. Eg: fast, small, 6,rle\n");
 	printf(" -quantize bits     Quantize (per component. Eg 6 for VGA).\n");
 	printf("                    min 1, max 8 (no effect)\n");
 	printf(" -gain val          Multiply pixels by value (float)\n");
@@ -447,6 +450,12 @@ int main(int argc, char **argv)
 				}
 				break;
 
+			case OPT_PNGOPTS:
+				if (pngopts_parse(&g_png_saveopts, optarg)) {
+					return -1;
+				}
+				break;
+
 			case OPT_OUT:
 				if (!image_in) {
 					fprintf(stderr ,"No image loaded\n");
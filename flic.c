@@ -4,6 +4,10 @@
 #include "flic.h"
 #include "globals.h"
 #include "growbuf.h"
+#include "threadpool.h"
+
+// stdio buffer for writing, so frames reach the file in large writes
+#define FLIC_WRITE_BUFSIZE	(1024 * 1024)
 
 static uint32_t getLE32(const uint8_t *src, int *off)
 {
@@ -151,20 +155,74 @@ uint32_t writeFlicChunkHeader(FILE *fptr, const struct FlicChunkHeader *src)
 	return 6;
 }
 
-void growbuf_syncChunkHeaderSize(struct growbuf *buf)
+/* Frame chunk encoders write to a chunkbuf. Without a growbuf, bytes are
+ * only counted: the size of each candidate chunk type is found this way,
+ * and only the smallest one is built. */
+struct chunkbuf {
+	struct growbuf *gb; // NULL to only count. Must be empty initially.
+	int count;
+	int limit; // when counting, give up once this size is reached (0: no limit)
+};
+
+// Encoders check this once per line and return -1 if true
+static inline int chunkbuf_overLimit(const struct chunkbuf *cb)
+{
+	return !cb->gb && cb->limit && cb->count >= cb->limit;
+}
+
+static inline void chunkbuf_add8(struct chunkbuf *cb, uint8_t val)
+{
+	if (cb->gb) {
+		growbuf_add8(cb->gb, val);
+	}
+	cb->count++;
+}
+
+static inline void chunkbuf_add16le(struct chunkbuf *cb, uint16_t val)
+{
+	if (cb->gb) {
+		growbuf_add16le(cb->gb, val);
+	}
+	cb->count += 2;
+}
+
+static inline void chunkbuf_append(struct chunkbuf *cb, const uint8_t *data, int size)
+{
+	if (cb->gb) {
+		growbuf_append(cb->gb, data, size);
+	}
+	if (size > 0) {
+		cb->count += size;
+	}
+}
+
+// Update bytes written earlier (offset from the chunk start)
+static void chunkbuf_set8(struct chunkbuf *cb, int offset, uint8_t val)
 {
-	if (buf->count > 4) {
-		buf->data[0] = buf->count;
-		buf->data[1] = buf->count >> 8;
-		buf->data[2] = buf->count >> 16;
-		buf->data[3] = buf->count >> 24;
+	if (cb->gb) {
+		cb->gb->data[offset] = val;
 	}
 }
 
-void growbuf_writeFlicChunkHeader(struct growbuf *buf, const struct FlicChunkHeader *src)
+static void chunkbuf_set16le(struct chunkbuf *cb, int offset, uint16_t val)
 {
-	growbuf_add32le(buf, src->size);
-	growbuf_add16le(buf, src->type);
+	chunkbuf_set8(cb, offset, val);
+	chunkbuf_set8(cb, offset + 1, val >> 8);
+}
+
+static void chunkbuf_addHeader(struct chunkbuf *cb, const struct FlicChunkHeader *src)
+{
+	if (cb->gb) {
+		growbuf_add32le(cb->gb, src->size);
+		growbuf_add16le(cb->gb, src->type);
+	}
+	cb->count += 6;
+}
+
+static void chunkbuf_syncHeaderSize(struct chunkbuf *cb)
+{
+	chunkbuf_set16le(cb, 0, cb->count);
+	chunkbuf_set16le(cb, 2, cb->count >> 16);
 }
 
 uint32_t writeFlicChunk(FILE *fptr, uint16_t type, uint8_t *data, uint32_t size)
@@ -175,27 +233,87 @@ uint32_t writeFlicChunk(FILE *fptr, uint16_t type, uint8_t *data, uint32_t size)
 	return 6 + size;
 }
 
-static int write_chunk_color64_full(FILE *fptr, palette_t *pal)
+// True if the decoder's 6 to 8 bit conversion gives back c
+static int color_is_6bit(uint8_t c)
 {
-	uint8_t buf[2048];
-	int pos = 0;
-	int i;
+	return ((c * 63 + 127) / 255) * 255 / 63 == c;
+}
 
-	// Packet count (LE16) : 1
-	buf[pos] = 1; pos++;
-	buf[pos] = 0; pos++;
+// Header, packet count, and at most 256 colors in 128 packets
+#define COLOR_CHUNK_MAX	(6 + 2 + 128 * 2 + 256 * 3)
 
-	buf[pos] = 0; pos++; // skip
-	buf[pos] = 0; pos++; // change (0 means 256)
+/* Palette chunk holding the entries of pal which differ from prev (all
+ * 256 entries if prev is NULL). Packets skip unchanged entries and replace
+ * runs of changed ones. When the 6-bit values are exact, a COLOR_64 chunk
+ * is built, otherwise COLOR_256. Returns the chunk size (header included),
+ * or 0 if nothing changed. */
+static int build_chunk_color(uint8_t dst[COLOR_CHUNK_MAX], const palette_t *prev, const palette_t *pal)
+{
+	uint8_t *buf = dst + 6; // payload
+	int pos = 2;
+	int packets = 0;
+	int i, start, last = 0;
+	int is_6bit = 1;
+	const palent_t *c;
+
+	// Entries which need not be sent
+#define UNCHANGED(i)	(prev && !memcmp(&prev->colors[i], &pal->colors[i], 3))
 
 	for (i=0; i<256; i++) {
-		buf[pos] = pal->colors[i].r; pos++;
-		buf[pos] = pal->colors[i].g; pos++;
-		buf[pos] = pal->colors[i].b; pos++;
-//		printf("%d:[%d,%d,%d], ", i, pal->colors[i].r, pal->colors[i].g, pal->colors[i].b);
+		if (UNCHANGED(i)) {
+			continue;
+		}
+		c = &pal->colors[i];
+		if (!color_is_6bit(c->r) || !color_is_6bit(c->g) || !color_is_6bit(c->b)) {
+			is_6bit = 0;
+			break;
+		}
 	}
-printf("Palette chunk payload size: %d\n", pos);
-	return writeFlicChunk(fptr, CHK_COLOR_256, buf, pos);
+
+	for (i=0; i<256; ) {
+		if (UNCHANGED(i)) {
+			i++;
+			continue;
+		}
+
+		for (start = i; i<256 && !UNCHANGED(i); i++) {
+			c = &pal->colors[i];
+			if (is_6bit) {
+				buf[pos + 2 + (i - start) * 3] = (c->r * 63 + 127) / 255;
+				buf[pos + 3 + (i - start) * 3] = (c->g * 63 + 127) / 255;
+				buf[pos + 4 + (i - start) * 3] = (c->b * 63 + 127) / 255;
+			} else {
+				buf[pos + 2 + (i - start) * 3] = c->r;
+				buf[pos + 3 + (i - start) * 3] = c->g;
+				buf[pos + 4 + (i - start) * 3] = c->b;
+			}
+		}
+
+		buf[pos] = start - last; // skip
+		buf[pos + 1] = i - start; // change (0 means 256)
+		pos += 2 + (i - start) * 3;
+		last = i;
+		packets++;
+	}
+#undef UNCHANGED
+
+	if (!packets) {
+		return 0;
+	}
+
+	// Packet count (LE16)
+	buf[0] = packets;
+	buf[1] = packets >> 8;
+
+	// Chunk header
+	dst[0] = pos + 6;
+	dst[1] = (pos + 6) >> 8;
+	dst[2] = 0;
+	dst[3] = 0;
+	dst[4] = is_6bit ? CHK_COLOR_64 : CHK_COLOR_256;
+	dst[5] = 0;
+
+	return pos + 6;
 }
 
 #if 0
@@ -217,13 +335,13 @@ static int write_chunk_copy(FlicFile *ff, const uint8_t *pixels)
 #endif
 
 // Starting at X,Y, count how many changed pixels there are.
-static int count_changed_length(FlicFile *ff, const uint8_t *pixels, int x, int y)
+static int count_changed_length(const FlicFile *ff, const uint8_t *prev, const uint8_t *pixels, int x, int y)
 {
 	int X;
 	int stride = 0;
 
 	for (X=x; X<ff->header.width; X++) {
-		if (pixels[y * ff->pitch + X] == ff->pixels[y * ff->pitch + X]) {
+		if (pixels[y * ff->pitch + X] == prev[y * ff->pitch + X]) {
 			return stride;
 		}
 		stride++;
@@ -233,7 +351,7 @@ static int count_changed_length(FlicFile *ff, const uint8_t *pixels, int x, int
 }
 
 // Starting at X,Y, count how many consecutive times the same value appears in 'pixels'
-static int count_rle(FlicFile *ff, const uint8_t *pixels, int x, int y)
+static int count_rle(const FlicFile *ff, const uint8_t *pixels, int x, int y)
 {
 	int X;
 	int stride = 1;
@@ -251,13 +369,13 @@ static int count_rle(FlicFile *ff, const uint8_t *pixels, int x, int y)
 
 
 // Starting at X,Y, count how many unchanged pixels there are.
-static int count_unchanged_length(FlicFile *ff, const uint8_t *pixels, int x, int y)
+static int count_unchanged_length(const FlicFile *ff, const uint8_t *prev, const uint8_t *pixels, int x, int y)
 {
 	int X;
 	int stride = 0;
 
 	for (X=x; X<ff->header.width; X++) {
-		if (pixels[y * ff->pitch + X] != ff->pixels[y * ff->pitch + X]) {
+		if (pixels[y * ff->pitch + X] != prev[y * ff->pitch + X]) {
 			return stride;
 		}
 		stride++;
@@ -266,31 +384,24 @@ static int count_unchanged_length(FlicFile *ff, const uint8_t *pixels, int x, in
 	return stride;
 }
 
-static struct growbuf *build_chunk_copy(FlicFile *ff, const uint8_t *pixels)
+static int encode_chunk_copy(const FlicFile *ff, const uint8_t *prev, const uint8_t *pixels, struct chunkbuf *cb)
 {
-	struct growbuf *buf;
 	struct FlicChunkHeader hd = {
 		.type = CHK_FLI_COPY,
 		.size = 6,
 	};
 
-	buf = growbuf_alloc(65536);
-	if (!buf) {
-		return NULL;
-	}
-
 	hd.size += ff->pixels_allocsize;
 
 	// Reserve space for header now - will be updated at the end
-	growbuf_writeFlicChunkHeader(buf, &hd);
-	growbuf_append(buf, pixels, ff->pixels_allocsize);
+	chunkbuf_addHeader(cb, &hd);
+	chunkbuf_append(cb, pixels, ff->pixels_allocsize);
 
-	return buf;
+	return 0;
 }
 
-static struct growbuf *build_chunk_brun(FlicFile *ff, const uint8_t *pixels)
+static int encode_chunk_brun(const FlicFile *ff, const uint8_t *prev, const uint8_t *pixels, struct chunkbuf *cb)
 {
-	struct growbuf *buf;
 	int y;
 	int cur_x;
 	int pcount_offset;
@@ -303,20 +414,18 @@ static struct growbuf *build_chunk_brun(FlicFile *ff, const uint8_t *pixels)
 		.size = 6,
 	};
 
-	buf = growbuf_alloc(65536);
-	if (!buf) {
-		return NULL;
-	}
-
 	// Reserve space for header now - will be updated at the end
-	growbuf_writeFlicChunkHeader(buf, &hd);
+	chunkbuf_addHeader(cb, &hd);
 
 	for (y=0; y<ff->header.height; y++) {
+		if (chunkbuf_overLimit(cb)) {
+			return -1;
+		}
 
 		// Write a packet count of 0 for now
 		pcount = 0;
-		pcount_offset = buf->count; // save the offset to update it later
-		growbuf_add8(buf, 0);
+		pcount_offset = cb->count; // save the offset to update it later
+		chunkbuf_add8(cb, 0);
 
 		// Packet format:
 		// [i8:rle/lit] -> LIT if negative, RLE count if >=0
@@ -336,30 +445,30 @@ static struct growbuf *build_chunk_brun(FlicFile *ff, const uint8_t *pixels)
 				if (lit_len > 0) {
 					while(lit_len > 127) {
 //						printf("lit127 |");
-						growbuf_add8(buf, -127);		// Packet field 2
-						growbuf_append(buf, pixels + y * ff->pitch + lit_start, 127);
+						chunkbuf_add8(cb, -127);		// Packet field 2
+						chunkbuf_append(cb, pixels + y * ff->pitch + lit_start, 127);
 						lit_start += 127;
 						lit_len -= 127;
 						pcount++;
 					}
 //					printf("lit %d |", lit_len);
-					growbuf_add8(buf, -lit_len);		// Packet field 2
-					growbuf_append(buf, pixels + y * ff->pitch + lit_start, lit_len);
+					chunkbuf_add8(cb, -lit_len);		// Packet field 2
+					chunkbuf_append(cb, pixels + y * ff->pitch + lit_start, lit_len);
 					lit_start = -1;
 					lit_len = 0;
 				}
 
 				while (rle > 127) {
 //					printf("Rle127 |");
-					growbuf_add8(buf, 127);
-					growbuf_add8(buf, pixels[y*ff->pitch+cur_x]);
+					chunkbuf_add8(cb, 127);
+					chunkbuf_add8(cb, pixels[y*ff->pitch+cur_x]);
 					pcount++;
 					cur_x += 127;
 					rle -= 127;
 				}
 //				printf("RLE %d |", rle);
-				growbuf_add8(buf, rle);
-				growbuf_add8(buf, pixels[y*ff->pitch+cur_x]);
+				chunkbuf_add8(cb, rle);
+				chunkbuf_add8(cb, pixels[y*ff->pitch+cur_x]);
 				pcount++;
 				cur_x += rle;
 			}
@@ -380,34 +489,33 @@ static struct growbuf *build_chunk_brun(FlicFile *ff, const uint8_t *pixels)
 //			printf("Final lit -");
 
 			while(lit_len > 127) {
-				growbuf_add8(buf, -127);		// Packet field 2
-				growbuf_append(buf, pixels + y * ff->pitch + lit_start, 127);
+				chunkbuf_add8(cb, -127);		// Packet field 2
+				chunkbuf_append(cb, pixels + y * ff->pitch + lit_start, 127);
 				lit_start += 127;
 				lit_len -= 127;
 				pcount++;
 //				printf("lit127 |");
 			}
 //			printf("lit %d |", lit_len);
-			growbuf_add8(buf, -lit_len);		// Packet field 2
-			growbuf_append(buf, pixels + y * ff->pitch + lit_start, lit_len);
+			chunkbuf_add8(cb, -lit_len);		// Packet field 2
+			chunkbuf_append(cb, pixels + y * ff->pitch + lit_start, lit_len);
 			lit_start = -1;
 		}
 
 		// Update packet count
-		buf->data[pcount_offset] = pcount;
+		chunkbuf_set8(cb, pcount_offset, pcount);
 //		printf("Pcount=%d\n", pcount);
 	}
 
 	// Update the size field in the chunk header
-	growbuf_syncChunkHeaderSize(buf);
+	chunkbuf_syncHeaderSize(cb);
 
-	return buf;
+	return 0;
 }
 
 
-static struct growbuf *build_chunk_delta_fli(FlicFile *ff, const uint8_t *pixels)
+static int encode_chunk_delta_fli(const FlicFile *ff, const uint8_t *prev, const uint8_t *pixels, struct chunkbuf *cb)
 {
-	struct growbuf *buf;
 	int y;
 	int first_different_line = -1, last_different_line = -1;
 	int lines_in_chunk;
@@ -425,7 +533,7 @@ static struct growbuf *build_chunk_delta_fli(FlicFile *ff, const uint8_t *pixels
 
 	for (y=0; y<ff->header.height; y++) {
 		if (memcmp(pixels + y * ff->pitch,
-					ff->pixels + y * ff->pitch,
+					prev + y * ff->pitch,
 					ff->header.width))
 		{
 			if (first_different_line < 0) {
@@ -437,31 +545,29 @@ static struct growbuf *build_chunk_delta_fli(FlicFile *ff, const uint8_t *pixels
 
 	// all identical - frame should be skipped
 	if (first_different_line == -1) {
-		return NULL;
-	}
-
-	buf = growbuf_alloc(65536);
-	if (!buf) {
-		return NULL;
+		return -1;
 	}
 
 	// Reserve space for header now - will be updated at the end
-	growbuf_writeFlicChunkHeader(buf, &hd);
+	chunkbuf_addHeader(cb, &hd);
 
 	lines_in_chunk = last_different_line-first_different_line+1;
 
 //	printf("[deltafli] Lines %d-%d different [total %d lines]\n",
 //		first_different_line, last_different_line, lines_in_chunk);
 
-	growbuf_add16le(buf, first_different_line);
-	growbuf_add16le(buf, lines_in_chunk);
+	chunkbuf_add16le(cb, first_different_line);
+	chunkbuf_add16le(cb, lines_in_chunk);
 
 	for (y=first_different_line; y<first_different_line+lines_in_chunk; y++) {
+		if (chunkbuf_overLimit(cb)) {
+			return -1;
+		}
 
 		// Find the first different pixel in the line
 		first_different_x = -1;
 		for (x=0; x<ff->header.width; x++) {
-			if (pixels[y*ff->pitch+x] != ff->pixels[y*ff->pitch+x]) {
+			if (pixels[y*ff->pitch+x] != prev[y*ff->pitch+x]) {
 				first_different_x = x;
 				break;
 			}
@@ -469,8 +575,8 @@ static struct growbuf *build_chunk_delta_fli(FlicFile *ff, const uint8_t *pixels
 
 		// Write a packet count of 0 for now
 		pcount = 0;
-		pcount_offset = buf->count; // save the offset to update it later
-		growbuf_add8(buf, 0);
+		pcount_offset = cb->count; // save the offset to update it later
+		chunkbuf_add8(cb, 0);
 
 		// Lines that are identical have a packet count of 0, just continue
 		if (first_different_x == -1) {
@@ -486,95 +592,259 @@ static struct growbuf *build_chunk_delta_fli(FlicFile *ff, const uint8_t *pixels
 		while (cur_x < ff->header.width) {
 //			printf(" (%d) ", cur_x);
 
-			stride = count_unchanged_length(ff, pixels, cur_x, y);
+			stride = count_unchanged_length(ff, prev, pixels, cur_x, y);
 //			printf("skip %d | ", stride);
 			cur_x += stride;
 
 			while (stride > 255) {
-				growbuf_add8(buf, 255); // Skip 255 columns
-				growbuf_add8(buf, 0); // No LIT/RLE
+				chunkbuf_add8(cb, 255); // Skip 255 columns
+				chunkbuf_add8(cb, 0); // No LIT/RLE
 				pcount++;
 				stride -= 255;
 			}
 
-			growbuf_add8(buf, stride);		// Packet field 1
+			chunkbuf_add8(cb, stride);		// Packet field 1
 
 			// TODO : Detect fills (RLE)
 			//
 //			printf(" {%d} ", cur_x);
-			stride = count_changed_length(ff, pixels, cur_x, y);
+			stride = count_changed_length(ff, prev, pixels, cur_x, y);
 //			rle = count_rle(ff, pixels, cur_x, y);
 
 			while (stride > 127) {
-				growbuf_add8(buf, 127);
+				chunkbuf_add8(cb, 127);
 				// Copy literal data
-				growbuf_append(buf, pixels + y * ff->pitch + cur_x, 127);
+				chunkbuf_append(cb, pixels + y * ff->pitch + cur_x, 127);
 				cur_x += 127;
 				stride -= 127;
 				pcount++;
 
 				// Prepare next packet
-				growbuf_add8(buf, 0); // skip of 0
+				chunkbuf_add8(cb, 0); // skip of 0
 			}
 
-			growbuf_add8(buf, stride);		// Packet field 2
-			growbuf_append(buf, pixels + y * ff->pitch + cur_x, stride);
+			chunkbuf_add8(cb, stride);		// Packet field 2
+			chunkbuf_append(cb, pixels + y * ff->pitch + cur_x, stride);
 			cur_x += stride;
 			pcount++;
 
-			buf->data[pcount_offset] = pcount;
+			chunkbuf_set8(cb, pcount_offset, pcount);
 		}
 //		printf(" -- packet cound: %d\n", pcount);
 
 	}
 
 	// Update the size field in the chunk header
-	growbuf_syncChunkHeaderSize(buf);
+	chunkbuf_syncHeaderSize(cb);
 
-	return buf;
+	return 0;
 }
 
-#define FIRST_FRAME	1
+// Word (pixel pair) helpers for DELTA_FLC. x is in words.
+static inline int word_same(const uint8_t *a, const uint8_t *b, int x)
+{
+	return a[x*2] == b[x*2] && a[x*2+1] == b[x*2+1];
+}
 
-static struct growbuf *build_best_frame_chunk(FlicFile *ff, const uint8_t *pixels, int is_first)
+// Starting at word x, count how many consecutive times the same word appears in 'row'
+static int count_rle_words(const uint8_t *row, int x, int num_words)
 {
-	struct growbuf *tmp, *best = NULL;
-	struct growbuf *versions[8];
-	int n = 0, i;
+	int X;
 
-	// Encode potential chunk types for given frame.
-	if ((tmp = build_chunk_copy(ff, pixels))) {
-		versions[n] = tmp; n++;
-	}
-	if ((tmp = build_chunk_brun(ff, pixels))) {
-		versions[n] = tmp; n++;
+	for (X=x+1; X<num_words; X++) {
+		if (!word_same(row, row + (X - x) * 2, x)) {
+			break;
+		}
 	}
 
-	// Delta compression not possible for first frame...
-	if (!is_first) {
-		if ((tmp = build_chunk_delta_fli(ff, pixels))) {
-			versions[n] = tmp; n++;
+	return X - x;
+}
+
+/* Word-oriented delta compression
+ *
+ * Each encoded line starts with opcodes: lines to skip (0xC000, negative
+ * count), the last pixel of odd width lines (0x8000) and finally the
+ * packet count. Packets skip columns (bytes) and then copy or repeat
+ * words. Unchanged lines at the end of the frame are not encoded.
+ */
+static int encode_chunk_delta_flc(const FlicFile *ff, const uint8_t *prev, const uint8_t *pixels, struct chunkbuf *cb)
+{
+	const uint8_t *cur_row, *prev_row;
+	int width = ff->header.width;
+	int num_words = width / 2;
+	int y, x, end, n;
+	int last_different_line = -1;
+	int skip_lines = 0;
+	int num_lines = 0, lines_offset;
+	int pcount, pcount_offset;
+	int skip, rle;
+	struct FlicChunkHeader hd = {
+		.type = CHK_DELTA_FLC,
+		.size = 6,
+	};
+
+	for (y=0; y<ff->header.height; y++) {
+		if (memcmp(pixels + y * ff->pitch, prev + y * ff->pitch, width)) {
+			last_different_line = y;
 		}
 	}
 
-	// Now pick the best (smallest) variation
-	for (i=0; i<n; i++) {
-		if (!best) {
-			best = versions[i];
-		} else {
-			if (versions[i]->count < best->count) {
-				best = versions[i];
+	// all identical - frame should be skipped
+	if (last_different_line == -1) {
+		return -1;
+	}
+
+	// Reserve space for header now - will be updated at the end
+	chunkbuf_addHeader(cb, &hd);
+
+	// Number of encoded lines, updated at the end
+	lines_offset = cb->count;
+	chunkbuf_add16le(cb, 0);
+
+	for (y=0; y<=last_different_line; y++) {
+		if (chunkbuf_overLimit(cb)) {
+			return -1;
+		}
+
+		cur_row = pixels + y * ff->pitch;
+		prev_row = prev + y * ff->pitch;
+
+		if (!memcmp(cur_row, prev_row, width)) {
+			skip_lines++;
+			continue;
+		}
+
+		while (skip_lines > 0) {
+			n = skip_lines > 0x4000 ? 0x4000 : skip_lines;
+			chunkbuf_add16le(cb, -n);
+			skip_lines -= n;
+		}
+
+		if ((width & 1) && (cur_row[width-1] != prev_row[width-1])) {
+			chunkbuf_add16le(cb, 0x8000 | cur_row[width-1]);
+		}
+
+		// Write a packet count of 0 for now
+		pcount = 0;
+		pcount_offset = cb->count;
+		chunkbuf_add16le(cb, 0);
+
+		// Packet format:
+		// [u8:skip]    -> Columns to skip
+		// [i8:rle/lit] -> RLE word count if negative, LIT word count if > 0. (can be 0)
+		x = 0;
+		while (x < num_words) {
+			for (skip = 0; x < num_words && word_same(cur_row, prev_row, x); x++) {
+				skip++;
+			}
+			if (x == num_words) {
+				break;
 			}
+
+			// Skip packets, keeping x even
+			while (skip > 127) {
+				chunkbuf_add8(cb, 254);
+				chunkbuf_add8(cb, 0);
+				pcount++;
+				skip -= 127;
+			}
+			chunkbuf_add8(cb, skip * 2);
+
+			// A repeated word takes 2 bytes instead of 2 per word
+			rle = count_rle_words(cur_row, x, num_words);
+			if (rle > 1) {
+				if (rle > 127) {
+					rle = 127;
+				}
+				chunkbuf_add8(cb, -rle);
+				chunkbuf_append(cb, cur_row + x * 2, 2);
+				x += rle;
+				pcount++;
+				continue;
+			}
+
+			// Literal words, up to a run worth a packet of its own. A
+			// single unchanged word costs the same as a new packet,
+			// keep it to have fewer packets.
+			for (end = x + 1; end < num_words && end - x < 127; end++) {
+				if (word_same(cur_row, prev_row, end) &&
+					((end + 1 == num_words) || word_same(cur_row, prev_row, end + 1))) {
+					break;
+				}
+				if (count_rle_words(cur_row, end, num_words) > 2) {
+					break;
+				}
+			}
+
+			chunkbuf_add8(cb, end - x);
+			chunkbuf_append(cb, cur_row + x * 2, (end - x) * 2);
+			x = end;
+			pcount++;
+		}
+
+		// The count is a word, but some decoders only read its low byte
+		if (pcount > 255) {
+			return -1;
+		}
+
+		chunkbuf_set16le(cb, pcount_offset, pcount);
+		num_lines++;
+	}
+
+	chunkbuf_set16le(cb, lines_offset, num_lines);
+
+	// Update the size field in the chunk header
+	chunkbuf_syncHeaderSize(cb);
+
+	return 0;
+}
+
+#define FIRST_FRAME	1
+
+static struct growbuf *build_best_frame_chunk(const FlicFile *ff, const uint8_t *prev, const uint8_t *pixels, int is_first)
+{
+	static int (*const encoders[])(const FlicFile *ff, const uint8_t *prev, const uint8_t *pixels, struct chunkbuf *cb) = {
+		encode_chunk_copy,
+		encode_chunk_brun,
+		// Delta compression not possible for first frame...
+		encode_chunk_delta_fli,
+		encode_chunk_delta_flc,
+	};
+	int num_encoders = is_first ? 2 : 4;
+	struct chunkbuf cb;
+	int best = -1, best_size = 0;
+	int i;
+
+	// Count the size of each chunk type for this frame, keep the
+	// smallest (the first one in case of a tie). Counting stops as
+	// soon as a chunk type cannot be smaller than the best so far.
+	for (i=0; i<num_encoders; i++) {
+		cb.gb = NULL;
+		cb.count = 0;
+		cb.limit = best_size;
+		if (encoders[i](ff, prev, pixels, &cb)) {
+			continue;
+		}
+		if (best < 0 || cb.count < best_size) {
+			best = i;
+			best_size = cb.count;
 		}
 	}
 
-	// Free non-selected variations
-	for (i=0; i<n; i++) {
-		if (best != versions[i])
-			growbuf_free(versions[i]);
+	if (best < 0) {
+		return NULL;
+	}
+
+	// Now build it
+	cb.gb = growbuf_alloc(best_size);
+	cb.count = 0;
+	cb.limit = 0;
+	if (!cb.gb) {
+		return NULL;
 	}
+	encoders[best](ff, prev, pixels, &cb);
 
-	return best;
+	return cb.gb;
 }
 
 int readFrameHeader(FILE *fptr, struct FlicFrameHeader *dst)
@@ -708,6 +978,21 @@ static int flic_findFrame2(FlicFile *ff)
 	return 0;
 }
 
+// Update the file header after the last frame
+static void flic_finishFileHeader(FlicFile *ff)
+{
+	if (!ff->header_written) {
+		// no frames, or nothing needed to be planned
+		writeFlicHeader(ff->fptr, &ff->header);
+	} else if (ff->seekable) {
+		fseek(ff->fptr, 0, SEEK_SET);
+		writeFlicHeader(ff->fptr, &ff->header);
+	} else if (ff->header.frames != ff->planned_frames + 1) {
+		fprintf(stderr, "Warning: %d frames written, but the header says %d\n",
+				ff->header.frames, ff->planned_frames + 1);
+	}
+}
+
 void flic_close(FlicFile *ff)
 {
 	if (ff) {
@@ -720,12 +1005,25 @@ void flic_close(FlicFile *ff)
 			flic_appendFrame(ff, ff->pixels_frame1, &ff->palette_frame1);
 		}
 
+		// in encoding context, finalize the file header
+		if (ff->writebuf) {
+			flic_finishFileHeader(ff);
+		}
+
 		if (ff->fptr) {
-			fclose(ff->fptr);
+			if (fclose(ff->fptr)) {
+				perror("Could not close flic");
+			}
+		}
+		if (ff->encode_pool) {
+			threadpool_free(ff->encode_pool);
 		}
+		free(ff->writebuf);
+		free(ff->pixels_frame1);
 		if (ff->pixels) {
 			free(ff->pixels);
 		}
+		palette_unref(ff->shared_palette);
 		memset(ff, 0, sizeof(FlicFile));
 		free(ff);
 	}
@@ -794,7 +1092,8 @@ FlicFile *flic_open(const char *filename)
 			printf("FLIC file detected\n");
 		}
 
-		if ((ff->header.oframe1 > ff->header.size) || (ff->header.oframe2 > ff->header.size)) {
+		// Size is 0 when the file was streamed
+		if (ff->header.size && ((ff->header.oframe1 > ff->header.size) || (ff->header.oframe2 > ff->header.size))) {
 			fprintf(stderr, "Warning: Frame offsets out of range\n");
 			if (flic_findFrame1(ff)) {
 				fprintf(stderr, "Could not find the first frame chunk\n");
@@ -1057,7 +1356,8 @@ static int handle_delta_flc(FlicFile *ff, struct FlicChunkHeader *header)
 	uint16_t y,x;
 	uint16_t lines;
 	int ln, p;
-	uint8_t pcount, skip;
+	uint16_t pcount;
+	uint8_t skip;
 	int8_t ptype;
 	uint8_t tmp[ff->header.width];
 	int16_t op;
@@ -1381,13 +1681,25 @@ FlicFile *flic_create(const char *filename, int w, int h)
 		return NULL;
 	}
 
-	ff->fptr = fopen(filename, "w+");
+	ff->fptr = fopen(filename, "wb");
 	if (!ff->fptr) {
 		perror(filename);
 		free(ff);
 		return NULL;
 	}
 
+	ff->writebuf = malloc(FLIC_WRITE_BUFSIZE);
+	if (!ff->writebuf) {
+		perror("Could not allocate write buffer for FLIC");
+		fclose(ff->fptr);
+		free(ff);
+		return NULL;
+	}
+	setvbuf(ff->fptr, (char*)ff->writebuf, _IOFBF, FLIC_WRITE_BUFSIZE);
+
+	// Pipes cannot seek back to update the file header
+	ff->seekable = fseek(ff->fptr, 0, SEEK_CUR) == 0;
+
 	ff->header.size = 128; // file header
 	ff->header.type = FLC_MAGIC;
 	ff->header.width = w;
@@ -1400,124 +1712,259 @@ FlicFile *flic_create(const char *filename, int w, int h)
 	ff->pixels = calloc(1, ff->pixels_allocsize);
 	if (!ff->pixels) {
 		perror("Could not allocate pixel buffer for FLIC");
+		fclose(ff->fptr);
+		free(ff->writebuf);
 		free(ff);
 		return NULL;
 	}
 
-	writeFlicHeader(ff->fptr, &ff->header);
+	return ff;
+}
 
-	printf("Main header size %ld\n", ftell(ff->fptr));
+int flic_setFrameCount(FlicFile *ff, int frames)
+{
+	if (ff->header_written) {
+		fprintf(stderr, "Frame count must be set before the first frame\n");
+		return -1;
+	}
 
-	return ff;
+	ff->planned_frames = frames;
+
+	return 0;
 }
 
-int flic_appendFrame(FlicFile *ff, uint8_t *pixels, palette_t *palette)
+/* Write the file header before the first frame. When the output cannot
+ * seek, this is the final header: the frame count is the planned one
+ * (plus the ring frame) and the size is left unknown (0). */
+static int flic_writeFileHeader(FlicFile *ff)
+{
+	struct FlicHeader header = ff->header;
+
+	if (!ff->seekable) {
+		if (!ff->planned_frames) {
+			fprintf(stderr, "Output is not seekable and the frame count is unknown\n");
+			return -1;
+		}
+		header.frames = ff->planned_frames + 1;
+		header.size = 0;
+	}
+
+	writeFlicHeader(ff->fptr, &header);
+	ff->header_written = 1;
+
+	return 0;
+}
+
+/* Write a frame made of the pixel chunk built for it (NULL if the pixels
+ * did not change) and a palette chunk if needed. The frame is assembled
+ * first, so it is written in one go without seeking back. */
+static int flic_writeFrame(FlicFile *ff, const uint8_t *pixels, palette_t *palette, const struct growbuf *chunk)
 {
 	struct FlicFrameHeader frameHeader = {
 		.type = FRAME_HEADER_TYPE,
-		.size = 6,
+		.size = 16,
 	};
-	long headeroff, endoff;
-	struct growbuf *chunk = NULL;
+	uint8_t colors[COLOR_CHUNK_MAX];
+	int colors_size = 0;
 
-	if (fseek(ff->fptr, 0, SEEK_END)) {
-		perror("could not seek");
+	if (!ff->header_written && flic_writeFileHeader(ff)) {
 		return -1;
 	}
 
-	// write a temporary frame header
-	headeroff = ftell(ff->fptr);
+	// If palette changed, or if this is the first frame, we need to emit a palette chunk.
+	// A shared palette we hold a reference to cannot have changed.
+	// After the first (complete) palette, only changed entries are written.
+	if (ff->header.frames == 0 || ((palette != ff->shared_palette) && !palettes_match(&ff->palette, palette))) {
+		colors_size = build_chunk_color(colors, ff->header.frames ? &ff->palette : NULL, palette);
+		if (colors_size) {
+			frameHeader.chunks++;
+			frameHeader.size += colors_size;
+		}
+		// update copy of palette for future comparison
+		palette_copy(&ff->palette, palette);
+	}
+	if ((palette != ff->shared_palette) && (palette->refcount > 0)) {
+		palette_unref(ff->shared_palette);
+		ff->shared_palette = palette_ref(palette);
+	}
+
+	if (chunk) {
+		frameHeader.size += chunk->count;
+		frameHeader.chunks++;
+	}
+
 	writeFrameHeader(ff->fptr, &frameHeader);
+	if (colors_size) {
+		fwrite(colors, colors_size, 1, ff->fptr);
+	}
+	if (chunk) {
+		growbuf_writeToFPTR(chunk, ff->fptr);
 
-	// output frame subchunks...
+		// update the "last image" for future comparison
+		memcpy(ff->pixels, pixels, ff->pixels_allocsize);
+	}
+	if (ferror(ff->fptr)) {
+		perror("Could not write frame");
+		return -1;
+	}
 
-	// If palette changed, or if this is the first frame, we need to emit a palette chunk
-	if (!palettes_match(&ff->palette, palette) || ff->header.frames == 0) {
-		frameHeader.chunks++;
-		// lazy complete palette chunk - no compression
-		frameHeader.size += write_chunk_color64_full(ff->fptr, palette);
-		// update copy of palette for future comparison
-		memcpy(&ff->palette, palette, sizeof(palette_t));
+	// make a copy of the first frame, for encoding the ring frame later
+	if (ff->header.frames == 0) {
+		palette_copy(&ff->palette_frame1, &ff->palette);
+		ff->pixels_frame1 = calloc(1, ff->pixels_allocsize);
+		if (!ff->pixels_frame1) {
+			perror("Could not allocate frame 1 copy");
+			return -1;
+		}
+		memcpy(ff->pixels_frame1, ff->pixels, ff->pixels_allocsize);
 	}
 
+	ff->header.frames++;
+	ff->header.size += frameHeader.size;
+
+	return 0;
+}
+
+int flic_appendFrame(FlicFile *ff, uint8_t *pixels, palette_t *palette)
+{
+	struct growbuf *chunk = NULL;
+	int ret;
+
 	// Output a BRUN or COPY chunk on the first frame as we are starting from nothing.
 	// TODO: BLACK
-	if (ff->header.frames == 0) {
-		chunk = build_best_frame_chunk(ff, pixels, FIRST_FRAME);
+	// Otherwise, if a difference was detected, output the most efficient chunk type
+	if (ff->header.frames == 0 || memcmp(ff->pixels, pixels, ff->pixels_allocsize)) {
+		chunk = build_best_frame_chunk(ff, ff->pixels, pixels, ff->header.frames == 0);
 		if (!chunk)
 			return -1;
+	}
 
-		growbuf_writeToFPTR(chunk, ff->fptr);
-		frameHeader.size += chunk->count;
-		frameHeader.chunks++;
-
-		// update the "last image" for future comparison
-		memcpy(ff->pixels, pixels, ff->pixels_allocsize);
+	ret = flic_writeFrame(ff, pixels, palette, chunk);
+	growbuf_free(chunk);
 
-		growbuf_free(chunk);
-	} else {
-		// Otherwise, if a difference was detected, output the most efficient chunk type
-		if (memcmp(ff->pixels, pixels, ff->pixels_allocsize) || ff->header.frames == 0) {
+	return ret;
+}
 
-			chunk = build_best_frame_chunk(ff, pixels, !FIRST_FRAME);
-			if (!chunk)
-				return -1;
+struct frame_job {
+	const FlicFile *ff;
+	const uint8_t *prev, *pixels;
+	int is_first;
+	struct growbuf *chunk;
+	int result;
+	int done;
 
-			growbuf_writeToFPTR(chunk, ff->fptr);
-			frameHeader.size += chunk->count;
-			frameHeader.chunks++;
+	pthread_mutex_t *lock;
+	pthread_cond_t *done_cond;
+};
 
-			// update the "last image" for future comparison
-			memcpy(ff->pixels, pixels, ff->pixels_allocsize);
+// Runs in a worker thread. Only reads ff (geometry), not its state.
+static void encodeFrameJob(void *arg)
+{
+	struct frame_job *job = arg;
 
-			growbuf_free(chunk);
+	if (job->is_first || memcmp(job->prev, job->pixels, job->ff->pixels_allocsize)) {
+		job->chunk = build_best_frame_chunk(job->ff, job->prev, job->pixels, job->is_first);
+		if (!job->chunk) {
+			job->result = -1;
 		}
 	}
 
-	// make a copy of the first frame, for encoding the ring frame later
-	if (ff->header.frames == 0) {
-		memcpy(&ff->palette_frame1, &ff->palette, sizeof(palette_t));
-		ff->pixels_frame1 = calloc(1, ff->pixels_allocsize);
-		memcpy(ff->pixels_frame1, ff->pixels, ff->pixels_allocsize);
-		if (!ff->pixels_frame1) {
-			perror("Could not allocate frame 1 copy");
+	pthread_mutex_lock(job->lock);
+	job->done = 1;
+	pthread_cond_broadcast(job->done_cond);
+	pthread_mutex_unlock(job->lock);
+}
+
+int flic_appendFrames(FlicFile *ff, uint8_t *const *pixels, palette_t *const *palettes, int count, int threads)
+{
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+	struct frame_job *jobs;
+	int i, retcode = 0;
+
+	if (count < 1) {
+		return 0;
+	}
+
+	jobs = calloc(count, sizeof(struct frame_job));
+	if (!jobs) {
+		perror("calloc");
+		return -1;
+	}
+
+	// The workers are kept for the next calls, unless the thread count changes
+	if (threads < 1) {
+		threads = threadpool_numCPUs();
+	}
+	if (ff->encode_pool && ff->encode_pool->num_threads != threads) {
+		threadpool_free(ff->encode_pool);
+		ff->encode_pool = NULL;
+	}
+	if (!ff->encode_pool) {
+		ff->encode_pool = threadpool_create(threads);
+		if (!ff->encode_pool) {
+			free(jobs);
 			return -1;
 		}
 	}
 
-	// note end position after writing frame subchunks
-	endoff = ftell(ff->fptr);
+	// A frame chunk only depends on the frame and the one before it. The
+	// first one is compared to the last frame written.
+	for (i=0; i<count; i++) {
+		jobs[i].ff = ff;
+		jobs[i].prev = i > 0 ? pixels[i-1] : ff->pixels;
+		jobs[i].pixels = pixels[i];
+		jobs[i].is_first = (i == 0) && (ff->header.frames == 0);
+		jobs[i].lock = &lock;
+		jobs[i].done_cond = &done_cond;
+		if (threadpool_add(ff->encode_pool, encodeFrameJob, &jobs[i])) {
+			encodeFrameJob(&jobs[i]);
+		}
+	}
 
-	// check how many bytes were written, write the updated frame header
-	frameHeader.size = endoff - headeroff;
-	fseek(ff->fptr, headeroff, SEEK_SET);
-//	printf("Write frame header at %ld\n", headeroff);
-//	printf("size: %ld\n", endoff - headeroff);
-	writeFrameHeader(ff->fptr, &frameHeader);
+	// Write the frames in order as they become ready
+	for (i=0; i<count; i++) {
+		pthread_mutex_lock(&lock);
+		while (!jobs[i].done) {
+			pthread_cond_wait(&done_cond, &lock);
+		}
+		pthread_mutex_unlock(&lock);
 
-	// update file header
-	ff->header.frames++;
-	ff->header.size += frameHeader.size;
-	fseek(ff->fptr, 0, SEEK_SET);
-	writeFlicHeader(ff->fptr, &ff->header);
+		if (!retcode) {
+			if (jobs[i].result || flic_writeFrame(ff, pixels[i], palettes[i], jobs[i].chunk)) {
+				retcode = -1;
+			}
+		}
+		growbuf_free(jobs[i].chunk);
+	}
 
+	free(jobs);
 
-	return 0;
+	return retcode;
 }
 
-int flic_frameToSprite(const FlicFile *ff, sprite_t *s)
+int flic_frameToSprite(FlicFile *ff, sprite_t *s)
 {
 	if ((ff->header.width != s->w) || (ff->header.height != s->h)) {
 		fprintf(stderr, "Error: flic_frameToSprite size mismatch\n");
 		return -1;
 	}
 	memcpy(s->pixels, ff->pixels, ff->pixels_allocsize);
-	memcpy(&s->palette, &ff->palette, sizeof(palette_t));
+
+	// Consecutive frames usually have the same palette. Let their sprites share it.
+	if (!ff->shared_palette || !palettes_match(ff->shared_palette, &ff->palette)) {
+		palette_unref(ff->shared_palette);
+		ff->shared_palette = palette_ref(&ff->palette);
+		if (!ff->shared_palette) {
+			return -1;
+		}
+	}
+	sprite_applyPalette(s, ff->shared_palette);
 
 	return 0;
 }
 
-sprite_t *flic_spriteFromFrame(const FlicFile *ff)
+sprite_t *flic_spriteFromFrame(FlicFile *ff)
 {
 	sprite_t *s;
 
@@ -6,6 +6,8 @@
 #include "palette.h"
 #include "sprite.h"
 
+struct threadpool;
+
 #define FLC_MAGIC	0xAF12
 #define FLI_MAGIC	0xAF11
 
@@ -83,6 +85,22 @@ typedef struct _FlicFile {
 	// used when encoding a ring frame
 	palette_t palette_frame1;
 	uint8_t *pixels_frame1;
+
+	// Shared copy of 'palette' handed out to sprites when decoding, or last
+	// shared palette received by flic_appendFrame when encoding.
+	palette_t *shared_palette;
+
+	// Encoding: frames go through a large stdio buffer. The file header is
+	// written before the first frame, and rewritten with the final size and
+	// frame count by flic_close. When the output cannot seek (pipe), it
+	// is written only once, from the count given to flic_setFrameCount.
+	uint8_t *writebuf;
+	int seekable;
+	int header_written;
+	int planned_frames;
+
+	// Workers of flic_appendFrames, created on first use
+	struct threadpool *encode_pool;
 } FlicFile;
 
 int isFlicFile(const char *filename);
@@ -95,12 +113,21 @@ int flic_readOneFrame(FlicFile *ff, int loop);
 void printFlicInfo(FlicFile *ff);
 
 FlicFile *flic_create(const char *filename, int w, int h);
+/* Number of frames which will be appended, not counting the ring frame
+ * added by flic_close. Required before the first frame when the output is
+ * not seekable. */
+int flic_setFrameCount(FlicFile *ff, int frames);
 int flic_appendFrame(FlicFile *ff, uint8_t *pixels, palette_t *palette);
+/* Same as calling flic_appendFrame for each frame, but the frame chunks are
+ * built in parallel (threads: 0 for one per CPU). The pixels and palettes
+ * must not change until this returns. The worker threads are kept until
+ * flic_close. */
+int flic_appendFrames(FlicFile *ff, uint8_t *const *pixels, palette_t *const *palettes, int count, int threads);
 
 // Update a sprite from the current flic image. Size must be identical.
-int flic_frameToSprite(const FlicFile *ff, sprite_t *s);
+int flic_frameToSprite(FlicFile *ff, sprite_t *s);
 
 // Allocate a new sprite containing a copy of the current flic image
-sprite_t *flic_spriteFromFrame(const FlicFile *ff);
+sprite_t *flic_spriteFromFrame(FlicFile *ff);
 
 #endif
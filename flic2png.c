@@ -1,11 +1,15 @@
 #include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
 #include <getopt.h>
 #include "sprite.h"
 #include "flic.h"
 
 int g_verbose = 0;
 
+// Frames are decoded sequentially, then saved in batches of this size.
+#define SAVE_BATCH	32
+
 static void printHelp()
 {
 	printf("Usage: ./flic2png [options] file.[fli,flc]\n");
@@ -16,6 +20,8 @@ static void printHelp()
 	printf(" -h                Print usage information\n");
 	printf(" -v                Enable verbose output\n");
 	printf(" -o basename       Base filename\n");
+	printf(" -c pngopts        PNG compression settings. Eg: fast, small, 6,rle (see pngopts.h)\n");
+	printf(" -j threads        Number of threads for PNG encoding (default: one per CPU)\n");
 	printf("\n");
 	printf("Files will be named in the format basename_XXXXX.png where basename is\n");
 	printf("what was given using the -o option.\n");
@@ -34,8 +40,7 @@ sprite_t *spriteFromFlicFrame(FlicFile *ff)
 	if (!s)
 		return NULL;
 
-	memcpy(s->pixels, ff->pixels, ff->pixels_allocsize);
-	memcpy(&s->palette, &ff->palette, sizeof(palette_t));
+	flic_frameToSprite(ff, s);
 
 	return s;
 }
@@ -45,16 +50,33 @@ int main(int argc, char **argv)
 	int opt;
 	const char *infilename;
 	const char *base = NULL;
-	char tmpname[256];
+	char names[SAVE_BATCH][256];
+	const char *filenames[SAVE_BATCH];
+	sprite_t *sprites[SAVE_BATCH];
 	FlicFile *flic;
-	int f;
+	int f, i, n = 0, done;
+	int threads = 0;
+	int res = 0;
+	char *e;
 
-	while ((opt = getopt(argc, argv, "hvo:")) != -1) {
+	while ((opt = getopt(argc, argv, "hvo:c:j:")) != -1) {
 		switch (opt) {
 			case '?': return -1;
 			case 'h': printHelp(); return 0;
 			case 'v': g_verbose = 1; break;
 			case 'o': base = optarg; break;
+			case 'c':
+				if (pngopts_parse(&g_png_saveopts, optarg)) {
+					return -1;
+				}
+				break;
+			case 'j':
+				threads = strtol(optarg, &e, 0);
+				if ((e == optarg) || (threads < 0)) {
+					fprintf(stderr, "Invalid thread count\n");
+					return -1;
+				}
+				break;
 		}
 	}
 
@@ -79,21 +101,38 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
+	for (i=0; i<SAVE_BATCH; i++) {
+		filenames[i] = names[i];
+	}
+
 	f = 0;
-	while (0 == flic_readOneFrame(flic, 0)) {
-		f++;
-
-		sprite_t *s = spriteFromFlicFrame(flic);
-		if (s) {
-			snprintf(tmpname, sizeof(tmpname), "%s_%05d.png", base, f);
-			sprite_savePNG(tmpname, s, 0);
-			freeSprite(s);
+	do {
+		done = flic_readOneFrame(flic, 0);
+		if (!done) {
+			f++;
+
+			sprite_t *s = spriteFromFlicFrame(flic);
+			if (s) {
+				snprintf(names[n], sizeof(names[n]), "%s_%05d.png", base, f);
+				sprites[n] = s;
+				n++;
+			}
 		}
-	}
+
+		if ((n == SAVE_BATCH) || (done && n)) {
+			if (sprite_savePNGBatch(n, filenames, sprites, &g_png_saveopts, threads)) {
+				res = -1;
+			}
+			for (i=0; i<n; i++) {
+				freeSprite(sprites[i]);
+			}
+			n = 0;
+		}
+	} while (!done);
 
 
 	flic_close(flic);
 
-	return 0;
+	return res;
 }
 
@@ -24,6 +24,7 @@
 #include "sprite_transform.h"
 #include "flic.h"
 #include "anim.h"
+#include "prefetch.h"
 
 #define DEFAULT_PNG_DELAY	24
 #define DEFAULT_OUTFILE	"out.flc"
@@ -46,13 +47,16 @@ enum {
 	OPT_GAIN,
 	OPT_GAMMA,
 	OPT_RESIZE,
+	OPT_RESIZE_AREA,
 	OPT_CANVAS,
+	OPT_RAW_OUT = 256, // not a filter (below FIRST_OP)
 };
 
 static struct option long_options[] = {
 	{ "help",             no_argument,        0, 'h' },
 	{ "verbose",          no_argument,        0, 'v' },
 	{ "out",              required_argument,  0, 'o' },
+	{ "raw-out",          required_argument,  0, OPT_RAW_OUT },
 
 	{ "denoise_spix",     no_argument,        0, OPT_DENOISE_SPIX },
 	{ "denoise_temporal1",no_argument,        0, OPT_DENOISE_TEMPORAL1 },
@@ -60,6 +64,7 @@ static struct option long_options[] = {
 	{ "gain",             required_argument,  0, OPT_GAIN },
 	{ "gamma",            required_argument,  0, OPT_GAMMA },
 	{ "resize",           required_argument,  0, OPT_RESIZE },
+	{ "resize_area",      required_argument,  0, OPT_RESIZE_AREA },
 	{ "canvas",           required_argument,  0, OPT_CANVAS },
 
 	{ },
@@ -75,8 +80,11 @@ static void printHelp()
 	printf(" -h                       Print usage information\n");
 	printf(" -v                       Enable verbose output\n");
 	printf(" -o,--out=file            Set output file (default: %s)\n", DEFAULT_OUTFILE);
+	printf(" --raw-out=file.spx       Write an uncompressed SPX file instead of a FLC\n");
 	printf("\nFilter options:\n");
 	printf(" --resize WxH             Resize video size. Eg: 160x120\n");
+	printf(" --resize_area WxH        Resize video size, averaging the colors of the\n");
+	printf("                          pixels. Better than --resize for downscaling.\n");
 	printf(" --canvas WxH             Resize canvas, animation centered.\n");
 	printf(" --gamma value            Apply gamma to palette. Eg: 1.6\n");
 	printf(" --gain value             Apply gain to palette. Eg: 2.3\n");
@@ -99,7 +107,10 @@ int main(int argc, char **argv)
 	const char *infilename;
 	const char *outfilename = DEFAULT_OUTFILE;
 	FlicFile *outflic = NULL;
+	const char *rawfilename = NULL;
+	spx_writer_t *rawout = NULL;
 	animation_t *anim = NULL;
+	struct prefetch *pf;
 	int w = 0, h = 0;
 	int delay = 0;
 	int i;
@@ -121,6 +132,7 @@ int main(int argc, char **argv)
 			case 'h': printHelp(); return 0;
 			case 'v': g_verbose = 1; break;
 			case 'o': outfilename = optarg; break;
+			case OPT_RAW_OUT: rawfilename = optarg; break;
 		}
 	}
 
@@ -139,11 +151,17 @@ int main(int argc, char **argv)
 		outflic->header.speed = delay;
 	}
 
+	// Load the next files while filtering the current one
+	pf = prefetch_create(argc - optind, argv + optind, anim_prefetchLoad, 0, PREFETCH_DEFAULT_BUDGET);
+	if (!pf) {
+		return -1;
+	}
+
 	/* Append all frames/images from arg list */
 	for (;optind < argc; optind++) {
 		infilename = argv[optind];
 
-		anim = anim_load(infilename);
+		anim = prefetch_next(pf);
 		if (!anim) {
 			fprintf(stderr, "Error: Unsupported input file: %s\n", infilename);
 			return -1;
@@ -160,6 +178,22 @@ int main(int argc, char **argv)
 		w = anim->frames[0]->w;
 		h = anim->frames[0]->h;
 
+		if (rawfilename) {
+			if (!rawout) {
+				rawout = spx_create(rawfilename, w, h);
+				if (!rawout) {
+					return -1;
+				}
+				spx_setDelay(rawout, anim->delay);
+			}
+
+			if (anim_addAllFramesToSPX(anim, rawout)) {
+				return -1;
+			}
+			anim_free(anim);
+			continue;
+		}
+
 		/* Now that the size of the source material is known, create the output */
 		if (!outflic) {
 			outflic = flic_create(outfilename,w,h);
@@ -173,10 +207,21 @@ int main(int argc, char **argv)
 			outflic->header.speed = anim->delay;
 		}
 
+		// With a single input, the frame count is known in advance (required
+		// to write to a pipe)
+		if ((optind == argc - 1) && (outflic->header.frames == 0)) {
+			flic_setFrameCount(outflic, anim->num_frames);
+		}
+
 		anim_addAllFramesToFlic(anim, outflic);
 		anim_free(anim);
 	}
 
+	prefetch_free(pf, anim_prefetchRelease);
+
+	if (rawout) {
+		return spx_finish(rawout);
+	}
 
 	flic_close(outflic);
 
@@ -274,69 +319,111 @@ static void apply_denoise_tempral1(animation_t *anim)
 	}
 }
 
+static int quantize_cb(palette_t *pal, void *ctx)
+{
+	return palette_quantize(pal, *(int*)ctx);
+}
+
+static int gain_cb(palette_t *pal, void *ctx)
+{
+	return palette_gain(pal, *(double*)ctx);
+}
+
+static int gamma_cb(palette_t *pal, void *ctx)
+{
+	return palette_gamma(pal, *(double*)ctx);
+}
+
 static void apply_quantize_palette(animation_t *anim, int bits_per_component)
 {
 	int i;
-	palette_t newpal;
+	palette_t newpal = { };
+	palette_t *srcpal = NULL, *dstpal = NULL;
+	palremap_lut_t remap_lut;
 
 	printf("Quantizing palette...\n");
 
-	for (i=0; i<anim->num_frames; i++) {
-		palette_quantize(&anim->frames[i]->palette, bits_per_component);
+	anim_transformPalettes(anim, quantize_cb, &bits_per_component);
 
-		memcpy(&newpal, &anim->frames[i]->palette, sizeof(palette_t));
-		palette_dropDuplicateColors(&newpal);
+	for (i=0; i<anim->num_frames; i++) {
+		// Consecutive frames normally share their palette. Only
+		// build the reduced palette and remap table when it changes.
+		if (anim->frames[i]->palette != srcpal) {
+			palette_unref(srcpal);
+			palette_unref(dstpal);
+			srcpal = palette_ref(anim->frames[i]->palette);
+
+			palette_copy(&newpal, srcpal);
+			palette_dropDuplicateColors(&newpal);
+			dstpal = palette_ref(&newpal);
+
+			if (!srcpal || !dstpal || palette_generateRemap(srcpal, dstpal, &remap_lut) < 0) {
+				break;
+			}
+		}
 
-		sprite_remapPalette(anim->frames[i], &newpal);
+		sprite_applyPalette(anim->frames[i], dstpal);
+		sprite_remapPixels(anim->frames[i], &remap_lut);
 	}
 
-
+	palette_unref(srcpal);
+	palette_unref(dstpal);
 }
 
 static void apply_gain(animation_t *anim, double gain)
 {
-	int i;
-
 	printf("Applying gain...\n");
 
-	for (i=0; i<anim->num_frames; i++) {
-		palette_gain(&anim->frames[i]->palette, gain);
-	}
+	anim_transformPalettes(anim, gain_cb, &gain);
 }
 
 static void apply_gamma(animation_t *anim, double gamma)
 {
-	int i;
-
 	printf("Applying gamma...\n");
 
-	for (i=0; i<anim->num_frames; i++) {
-		palette_gamma(&anim->frames[i]->palette, gamma);
-	}
+	anim_transformPalettes(anim, gamma_cb, &gamma);
 }
 
-static void apply_resize(animation_t *anim, int w, int h)
+static void apply_resize(animation_t *anim, int w, int h, int area)
 {
 	int i;
 	sprite_t *orig, *replacement;
+	palblend_t *pb = NULL;
 
 	printf("Resizing frames to %dx%d...\n",w,h);
 
+	// Shared by all frames, so colors mixed in a frame need not be searched again
+	if (area) {
+		pb = palblend_create();
+		if (!pb) {
+			return;
+		}
+	}
+
 	for (i=0; i<anim->num_frames; i++) {
 		orig = anim->frames[i];
 
 		replacement = allocSprite(w, h, 256, SPRITE_FLAG_OPAQUE);
 		if (!replacement) {
 			fprintf(stderr, "could not allocate scaled frame\n");
-			return;
+			break;
 		}
 		sprite_copyPalette(orig, replacement);
 
-		sprite_scaleNearWH(orig, replacement, w, h);
+		if (pb) {
+			if (sprite_scaleArea(orig, replacement, pb)) {
+				freeSprite(replacement);
+				break;
+			}
+		} else {
+			sprite_scaleNearWH(orig, replacement, w, h);
+		}
 		anim->frames[i] = replacement;
 
 		freeSprite(orig);
 	}
+
+	palblend_free(pb);
 }
 
 static void apply_canvas(animation_t *anim, int w, int h)
@@ -426,6 +513,7 @@ static int applyFilter(animation_t *anim, int filter, const char *filterarg)
 			break;
 
 		case OPT_RESIZE:
+		case OPT_RESIZE_AREA:
 			i = sscanf(filterarg, "%dx%d", &w, &h);
 			if (i != 2) {
 				fprintf(stderr, "Invalid size\n");
@@ -435,7 +523,7 @@ static int applyFilter(animation_t *anim, int filter, const char *filterarg)
 				fprintf(stderr, "Invalid size\n");
 				return -2;
 			}
-			apply_resize(anim, w, h);
+			apply_resize(anim, w, h, filter == OPT_RESIZE_AREA);
 			break;
 
 		case OPT_CANVAS:
@@ -25,8 +25,7 @@ sprite_t *spriteFromFlicFrame(FlicFile *ff)
 	if (!s)
 		return NULL;
 
-	memcpy(s->pixels, ff->pixels, ff->pixels_allocsize);
-	memcpy(&s->palette, &ff->palette, sizeof(palette_t));
+	flic_frameToSprite(ff, s);
 
 	return s;
 }
@@ -5,6 +5,7 @@
 #include "sprite.h"
 #include "flic.h"
 #include "anim.h"
+#include "prefetch.h"
 
 #define DEFAULT_PNG_DELAY	24
 #define DEFAULT_OUTFILE	"out.flc"
@@ -22,6 +23,7 @@ static void printHelp()
 	printf(" -v                Enable verbose output\n");
 	printf(" -o outfile        Set output file (default: %s)\n", DEFAULT_OUTFILE);
 	printf(" -d delay_ms       Delay between frames in ms. Default: auto\n");
+	printf(" -r file.spx       Write an uncompressed SPX file instead of a FLC\n");
 }
 
 sprite_t *spriteFromFlicFrame(FlicFile *ff)
@@ -32,12 +34,53 @@ sprite_t *spriteFromFlicFrame(FlicFile *ff)
 	if (!s)
 		return NULL;
 
-	memcpy(s->pixels, ff->pixels, ff->pixels_allocsize);
-	memcpy(&s->palette, &ff->palette, sizeof(palette_t));
+	flic_frameToSprite(ff, s);
 
 	return s;
 }
 
+struct input {
+	sprite_t *img;
+	animation_t *anim;
+};
+
+// Runs ahead in a worker thread (see prefetch.h). Flic files are read
+// frame by frame while merging, so they are only opened in main().
+static void *loadInput(const char *filename, size_t *size)
+{
+	struct input *in;
+
+	in = calloc(1, sizeof(struct input));
+	if (!in) {
+		perror("calloc");
+		return NULL;
+	}
+
+	if (isFlicFile(filename)) {
+		return in;
+	}
+
+	if ((in->img = sprite_loadPNG(filename, 0, 0))) {
+		*size = in->img->w * in->img->h;
+	} else if ((in->anim = anim_load(filename))) {
+		*size = (size_t)in->anim->num_frames * in->anim->w * in->anim->h;
+	} else {
+		free(in);
+		return NULL;
+	}
+
+	return in;
+}
+
+static void releaseInput(void *arg)
+{
+	struct input *in = arg;
+
+	freeSprite(in->img);
+	anim_free(in->anim);
+	free(in);
+}
+
 int main(int argc, char **argv)
 {
 	int opt;
@@ -46,17 +89,22 @@ int main(int argc, char **argv)
 	const char *outfilename = DEFAULT_OUTFILE;
 	FlicFile *outflic = NULL;
 	FlicFile *flic = NULL;
+	const char *rawfilename = NULL;
+	spx_writer_t *rawout = NULL;
 	sprite_t *img = NULL;
 	animation_t *anim = NULL;
+	struct prefetch *pf;
+	struct input *in;
 	int w = 0, h = 0;
 	int delay = 0;
 
-	while ((opt = getopt(argc, argv, "hvo:")) != -1) {
+	while ((opt = getopt(argc, argv, "hvo:r:")) != -1) {
 		switch (opt) {
 			case '?': return -1;
 			case 'h': printHelp(); return 0;
 			case 'v': g_verbose = 1; break;
 			case 'o': outfilename = optarg; break;
+			case 'r': rawfilename = optarg; break;
 			case 'd':
 					delay = strtol(optarg, &e, 0);
 					if ((e == optarg)||(delay<0)) {
@@ -74,12 +122,17 @@ int main(int argc, char **argv)
 
 	/* If a size was specified, create the output context now, otherwise
 	 * wait after loading the first image/frame. */
-	if ((w!=0)&&(h!=0)) {
+	if ((w!=0)&&(h!=0)&&!rawfilename) {
 		outflic = flic_create(outfilename,w,h);
 		if (!outflic) {
 			return -1;
 		}
-		outflic->header.speed = delay;
+	}
+
+	// Decode the next files while merging the current one
+	pf = prefetch_create(argc - optind, argv + optind, loadInput, 0, PREFETCH_DEFAULT_BUDGET);
+	if (!pf) {
+		return -1;
 	}
 
 	/* Append all frames/images from arg list */
@@ -88,8 +141,22 @@ int main(int argc, char **argv)
 //		printf("Reading %s...\n", infilename);
 
 		/* Load a new file*/
+		in = prefetch_next(pf);
+		if (!in) {
+			fprintf(stderr, "Error: Unsupported input file: %s\n", infilename);
+			return -1;
+		}
+		img = in->img;
+		anim = in->anim;
+		free(in);
 
-		if (isFlicFile(infilename)) {
+		if (img) {
+			w = img->w;
+			h = img->h;
+		} else if (anim) {
+			w = anim->w;
+			h = anim->h;
+		} else {
 			flic = flic_open(infilename);
 			if (!flic) {
 				fprintf(stderr, "Error in flic file or unsupported flic file\n");
@@ -98,59 +165,74 @@ int main(int argc, char **argv)
 			printFlicInfo(flic);
 			w = flic->header.width;
 			h = flic->header.height;
-		} else if ((img = sprite_loadPNG(infilename, 0, 0))) {
-//			printf("Not a FLC/FLI file.\n");
-			img = sprite_loadPNG(infilename, 0, 0);
-			w = img->w;
-			h = img->h;
-		} else if ((anim = anim_load(infilename))) {
-			w = anim->w;
-			h = anim->h;
-		} else {
-			fprintf(stderr, "Error: Unsupported input file: %s\n", infilename);
-			return -1;
 		}
 
 		/* Now that the size of the source material is known, create the output */
-		if (!outflic) {
-			outflic = flic_create(outfilename,w,h);
-			if (!outflic) {
-				return -1;
+		if (rawfilename) {
+			if (!rawout) {
+				rawout = spx_create(rawfilename, w, h);
+				if (!rawout) {
+					return -1;
+				}
 			}
+		} else {
+			if (!outflic) {
+				outflic = flic_create(outfilename,w,h);
+				if (!outflic) {
+					return -1;
+				}
 
-		}
+			}
 
-		if ((w != outflic->header.width) || (h != outflic->header.height)) {
-			fprintf(stderr, "Error: Source material must all be of the same size\n");
-			return -1;
+			if ((w != outflic->header.width) || (h != outflic->header.height)) {
+				fprintf(stderr, "Error: Source material must all be of the same size\n");
+				return -1;
+			}
 		}
 
 		/* Operate */
 		if (flic) {
-			if (outflic->header.speed == 0) {
-				outflic->header.speed = flic->header.speed;
+			if (delay == 0) {
+				delay = flic->header.speed;
 			}
 			while (flic->cur_frame != flic->header.frames) {
 				printf("  Reading frame %d\n", flic->cur_frame+1);
 				flic_readOneFrame(flic, 0);
-				if (flic_appendFrame(outflic, flic->pixels, &flic->palette)) {
+				if (rawout) {
+					img = spriteFromFlicFrame(flic);
+					if (!img || spx_appendFrame(rawout, img)) {
+						return -1;
+					}
+					freeSprite(img);
+					img = NULL;
+				} else if (flic_appendFrame(outflic, flic->pixels, &flic->palette)) {
 					return -1;
 				}
 			}
 		}
 		if (img) {
-			if (outflic->header.speed == 0) {
-				outflic->header.speed = DEFAULT_PNG_DELAY;
+			if (delay == 0) {
+				delay = DEFAULT_PNG_DELAY;
 			}
-			if (flic_appendFrame(outflic, img->pixels, &img->palette)) {
+			if (rawout) {
+				if (spx_appendFrame(rawout, img)) {
+					return -1;
+				}
+			} else if (flic_appendFrame(outflic, img->pixels, img->palette)) {
 				return -1;
 			}
 		}
 		if (anim) {
-			if (outflic->header.speed == 0) {
-				outflic->header.speed = anim->delay;
+			if (delay == 0) {
+				delay = anim->delay;
+			}
+			if (rawout) {
+				if (anim_addAllFramesToSPX(anim, rawout)) {
+					return -1;
+				}
+			} else {
+				anim_addAllFramesToFlic(anim, outflic);
 			}
-			anim_addAllFramesToFlic(anim, outflic);
 		}
 
 
@@ -169,7 +251,14 @@ int main(int argc, char **argv)
 		}
 	}
 
+	prefetch_free(pf, releaseInput);
+
+	if (rawout) {
+		spx_setDelay(rawout, delay);
+		return spx_finish(rawout);
+	}
 
+	outflic->header.speed = delay;
 	flic_close(outflic);
 
 	return 0;
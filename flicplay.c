@@ -28,10 +28,10 @@ void sprite_to_SDL(sprite_t *spr, SDL_Surface *surface)
 	Uint8 *p;
 	SDL_Color colors[256];
 
-	for (y=0; y<spr->palette.count; y++) {
-		colors[y].r = spr->palette.colors[y].r;
-		colors[y].g = spr->palette.colors[y].g;
-		colors[y].b = spr->palette.colors[y].b;
+	for (y=0; y<spr->palette->count; y++) {
+		colors[y].r = spr->palette->colors[y].r;
+		colors[y].g = spr->palette->colors[y].g;
+		colors[y].b = spr->palette->colors[y].b;
 //		printf("%d,%d,%d\n", colors[y].r, colors[y].g, colors[y].b);
 	}
 
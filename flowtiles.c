@@ -7,6 +7,7 @@
 
 #include "swpxlt.h"
 #include "sprite_transform.h"
+#include "prefetch.h"
 
 #define MAX_SOURCE_IMAGES	256
 #define DEFAULT_TILE_SIZE	8
@@ -14,6 +15,21 @@
 
 int g_verbose;
 
+static void *loadSource(const char *filename, size_t *size)
+{
+	sprite_t *spr = sprite_load(filename, 0, 0);
+
+	if (spr) {
+		*size = spr->w * spr->h;
+	}
+
+	return spr;
+}
+
+static void releaseSource(void *spr)
+{
+	freeSprite(spr);
+}
 
 static void printHelp()
 {
@@ -47,6 +63,7 @@ int main(int argc, char **argv)
 	int total_input_tiles;
 	int target_w, target_h;
 	int outcol, outrow;
+	struct prefetch *pf = NULL;
 
 	while ((opt = getopt(argc, argv, "hvo:s:w:")) != -1) {
 		switch (opt) {
@@ -83,6 +100,12 @@ int main(int argc, char **argv)
 
 	memset(source_images, 0, sizeof(source_images));
 
+	// Decode the next images while the current one is checked
+	pf = prefetch_create(source_images_count, argv + optind, loadSource, 0, PREFETCH_DEFAULT_BUDGET);
+	if (!pf) {
+		return 1;
+	}
+
 	total_input_tiles = 0;
 	for (i=0; i<source_images_count; i++) {
 		if (g_verbose) {
@@ -90,7 +113,7 @@ int main(int argc, char **argv)
 		}
 
 		// Load the image
-		source_images[i] = sprite_loadPNG(argv[optind+i], 0, 0);
+		source_images[i] = prefetch_next(pf);
 		if (!source_images[i]) {
 			fprintf(stderr, "Could not load %s\n", argv[optind+i]);
 			retval = 1;
@@ -121,7 +144,7 @@ int main(int argc, char **argv)
 	}
 
 	target_image = allocSprite(target_w, target_h,
-					source_images[0]->palette.count,
+					source_images[0]->palette->count,
 					source_images[0]->flags );
 	if (!target_image) {
 		fprintf(stderr, "Could not create target image\n");
@@ -165,10 +188,12 @@ int main(int argc, char **argv)
 		}
 	}
 
-	sprite_savePNG(dstfn, target_image, 0);
+	sprite_save(dstfn, target_image, 0);
 	retval = 0;
 
 error:
+	prefetch_free(pf, releaseSource);
+
 	// Free all images
 	for (i=0; i<MAX_SOURCE_IMAGES; i++) {
 		if (source_images[i]) {
@@ -17,6 +17,7 @@ enum {
 	OPT_SAVETILES,
 	OPT_SAVEMAP,
 	OPT_SAVEPAL,
+	OPT_BIGMAP,
 };
 
 static void printHelp()
@@ -35,6 +36,8 @@ static void printHelp()
 	printf(" -savetiles tiles.bin    Save the final tiles (for SMS VDP)\n");
 	printf(" -savemap image.map      Save the final tilemap (for SMS VDP)\n");
 	printf(" -savepal palette.bin    Save the final palette\n");
+	printf(" -bigmap                 Keep the image in a temporary file instead of\n");
+	printf("                         memory, for huge maps. (PNG input only)\n");
 }
 
 static struct option long_options[] = {
@@ -46,6 +49,7 @@ static struct option long_options[] = {
 	{ "savetiles", required_argument, 0, OPT_SAVETILES },
 	{ "savemap",   required_argument, 0, OPT_SAVEMAP },
 	{ "savepal",   required_argument, 0, OPT_SAVEPAL },
+	{ "bigmap",    no_argument,       0, OPT_BIGMAP },
 	{ },
 };
 
@@ -55,6 +59,9 @@ int main(int argc, char **argv)
 	char *e;
 	const char *infilename;
 	sprite_t *img = NULL;
+	tiledmap_t *bigimg = NULL;
+	int bigmap = 0;
+	int w, h;
 	tilecatalog_t *catalog = NULL;
 	int maxtiles = -1;
 	const char *savecat_filename = NULL;
@@ -62,7 +69,7 @@ int main(int argc, char **argv)
 	const char *savetiles_filename = NULL;
 	const char *savemap_filename = NULL;
 	const char *savepal_filename = NULL;
-	palette_t palette;
+	palette_t palette = { };
 	tilemap_t *map = NULL;
 
 	while ((opt = getopt_long_only(argc, argv, "hv", long_options, NULL)) != -1) {
@@ -92,6 +99,9 @@ int main(int argc, char **argv)
 			case OPT_SAVEPAL:
 				savepal_filename = optarg;
 				break;
+			case OPT_BIGMAP:
+				bigmap = 1;
+				break;
 		}
 	}
 
@@ -108,29 +118,45 @@ int main(int argc, char **argv)
 	infilename = argv[optind];
 	printf("Processing %s...\n", infilename);
 
-	img = sprite_load(infilename, 0, SPRITE_LOADFLAG_DROP_TRANSPARENT);
-	if (!img) {
-		fprintf(stderr, "could not load %s\n", infilename);
-		return -1;
+	if (bigmap) {
+		bigimg = tiledmap_loadPNG(infilename, SPRITE_LOADFLAG_DROP_TRANSPARENT);
+		if (!bigimg) {
+			fprintf(stderr, "could not load %s\n", infilename);
+			return -1;
+		}
+		palette_copy(&palette, bigimg->palette);
+		w = bigimg->w;
+		h = bigimg->h;
+	} else {
+		img = sprite_load(infilename, 0, SPRITE_LOADFLAG_DROP_TRANSPARENT);
+		if (!img) {
+			fprintf(stderr, "could not load %s\n", infilename);
+			return -1;
+		}
+		palette_copy(&palette, img->palette);
+		w = img->w;
+		h = img->h;
 	}
 
-	if (img->palette.count > 16) {
+	if (palette.count > 16) {
 		// TODO : Inspect pixels to check actual use
 		fprintf(stderr, "more than 16 colors\n");
 		return -1;
 	}
 
-	memcpy(&palette, &img->palette, sizeof(palette_t));
-
-	printf("Image is %d x %d\n", img->w, img->h);
+	printf("Image is %d x %d\n", w, h);
 
-	map = tilemap_allocate((img->w+7)/8, (img->h+7)/8);
+	map = tilemap_allocate((w+7)/8, (h+7)/8);
 	if (!map) {
 		return -1;
 	}
 
 	printf("Adding all tiles to catalog...\n");
-	tilecat_addAllFromSprite(catalog, img, map);
+	if (bigimg) {
+		tilecat_addAllFromTiledMap(catalog, bigimg, map);
+	} else {
+		tilecat_addAllFromSprite(catalog, img, map);
+	}
 	tilecat_printInfo(catalog);
 
 	printf("Tilemap unique tiles: %d\n", tilemap_countUniqueIDs(map));
@@ -142,21 +168,31 @@ int main(int argc, char **argv)
 	}
 
 	freeSprite(img);
+	tiledmap_free(bigimg);
 
 	// If tile reduction was some times may have been replaced and some
 	// may not be used anymore. Build a new visual (intput image) and use
 	// it to build new catalog and tilemap.
-	img = tilemap_toSprite(map, catalog, &palette);
-	if (!img) {
-		fprintf(stderr, "Could not build updated visual\n");
-		return -1;
+	if (bigmap) {
+		img = NULL;
+		bigimg = tilemap_toTiledMap(map, catalog, &palette);
+		if (!bigimg) {
+			fprintf(stderr, "Could not build updated visual\n");
+			return -1;
+		}
+	} else {
+		img = tilemap_toSprite(map, catalog, &palette);
+		if (!img) {
+			fprintf(stderr, "Could not build updated visual\n");
+			return -1;
+		}
 	}
 	// drop the old catalog and tilemap
 	tilemap_free(map);
 	tilecat_free(catalog);
 
 	// prepare the final tilemap
-	map = tilemap_allocate((img->w+7)/8, (img->h+7)/8);
+	map = tilemap_allocate((w+7)/8, (h+7)/8);
 	if (!map) {
 		fprintf(stderr, "Could not allocate final tilemap\n");
 		return -1;
@@ -168,7 +204,11 @@ int main(int argc, char **argv)
 		return -1;
 	}
 
-	tilecat_addAllFromSprite(catalog, img, map);
+	if (bigimg) {
+		tilecat_addAllFromTiledMap(catalog, bigimg, map);
+	} else {
+		tilecat_addAllFromSprite(catalog, img, map);
+	}
 	tilecat_printInfo(catalog);
 	tilemap_printInfo(map);
 
@@ -180,7 +220,11 @@ int main(int argc, char **argv)
 
 	if (saveimage_filename) {
 		printf("Saving resulting image: %s\n", saveimage_filename);
-		sprite_savePNG(saveimage_filename, img, 0);
+		if (bigimg) {
+			tiledmap_savePNG(saveimage_filename, bigimg);
+		} else {
+			sprite_save(saveimage_filename, img, 0);
+		}
 	}
 
 	if (savepal_filename) {
@@ -201,6 +245,7 @@ int main(int argc, char **argv)
 
 
 	freeSprite(img);
+	tiledmap_free(bigimg);
 	tilecat_free(catalog);
 
 	return 0;
@@ -0,0 +1,203 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "palblend.h"
+
+#define MIXCACHE_INITIAL_BITS	12
+
+static int mixcache_init(struct mixcache *mc, int bits)
+{
+	mc->keys = malloc(sizeof(uint32_t) << bits);
+	mc->values = malloc(sizeof(int16_t) << bits);
+	if (!mc->keys || !mc->values) {
+		perror("malloc");
+		free(mc->keys);
+		free(mc->values);
+		mc->keys = NULL;
+		mc->values = NULL;
+		return -1;
+	}
+
+	memset(mc->values, 0xff, sizeof(int16_t) << bits);
+	mc->bits = bits;
+	mc->used = 0;
+
+	return 0;
+}
+
+static void mixcache_clear(struct mixcache *mc)
+{
+	if (mc->values) {
+		memset(mc->values, 0xff, sizeof(int16_t) << mc->bits);
+	}
+	mc->used = 0;
+}
+
+static void mixcache_free(struct mixcache *mc)
+{
+	free(mc->keys);
+	free(mc->values);
+}
+
+static inline uint32_t mixcache_slot(const struct mixcache *mc, uint32_t key)
+{
+	return (key * 2654435761u) >> (32 - mc->bits);
+}
+
+// Returns -1 if key is not in the cache
+static inline int mixcache_get(const struct mixcache *mc, uint32_t key)
+{
+	uint32_t mask = (1 << mc->bits) - 1;
+	uint32_t i;
+
+	if (!mc->values) {
+		return -1;
+	}
+
+	for (i = mixcache_slot(mc, key); mc->values[i] >= 0; i = (i + 1) & mask) {
+		if (mc->keys[i] == key) {
+			return mc->values[i];
+		}
+	}
+
+	return -1;
+}
+
+static void mixcache_put(struct mixcache *mc, uint32_t key, int value)
+{
+	uint32_t mask;
+	uint32_t i;
+	struct mixcache bigger;
+
+	if (!mc->values) {
+		return;
+	}
+
+	// Keep the table at most half full
+	if ((mc->used + 1) * 2 > (1 << mc->bits)) {
+		if (mixcache_init(&bigger, mc->bits + 1)) {
+			return; // keep working, without caching more
+		}
+		for (i=0; i < (1u << mc->bits); i++) {
+			if (mc->values[i] >= 0) {
+				mixcache_put(&bigger, mc->keys[i], mc->values[i]);
+			}
+		}
+		mixcache_free(mc);
+		*mc = bigger;
+	}
+
+	mask = (1 << mc->bits) - 1;
+	for (i = mixcache_slot(mc, key); mc->values[i] >= 0; i = (i + 1) & mask) {
+	}
+	mc->keys[i] = key;
+	mc->values[i] = value;
+	mc->used++;
+}
+
+palblend_t *palblend_create(void)
+{
+	palblend_t *pb;
+
+	pb = calloc(1, sizeof(palblend_t));
+	if (!pb) {
+		perror("calloc");
+		return NULL;
+	}
+
+	memset(pb->pairs, 0xff, sizeof(pb->pairs));
+
+	if (mixcache_init(&pb->quads, MIXCACHE_INITIAL_BITS) ||
+		mixcache_init(&pb->colors, MIXCACHE_INITIAL_BITS)) {
+		palblend_free(pb);
+		return NULL;
+	}
+
+	return pb;
+}
+
+void palblend_free(palblend_t *pb)
+{
+	if (pb) {
+		mixcache_free(&pb->quads);
+		mixcache_free(&pb->colors);
+		free(pb);
+	}
+}
+
+void palblend_setPalette(palblend_t *pb, const palette_t *pal)
+{
+	if ((pb->pal.count == pal->count) &&
+		!memcmp(pb->pal.colors, pal->colors, sizeof(palent_t) * pal->count)) {
+		return;
+	}
+
+	palette_copy(&pb->pal, pal);
+	memset(pb->pairs, 0xff, sizeof(pb->pairs));
+	mixcache_clear(&pb->quads);
+	mixcache_clear(&pb->colors);
+}
+
+int palblend_matchRGB(palblend_t *pb, int r, int g, int b)
+{
+	uint32_t key = (r << 16) | (g << 8) | b;
+	int idx;
+
+	idx = mixcache_get(&pb->colors, key);
+	if (idx < 0) {
+		idx = palette_findBestMatch(&pb->pal, r, g, b, COLORMATCH_METHOD_DEFAULT);
+		mixcache_put(&pb->colors, key, idx);
+	}
+
+	return idx;
+}
+
+int palblend_mix2(palblend_t *pb, uint8_t a, uint8_t b)
+{
+	const palent_t *ca, *cb;
+	int16_t *slot;
+
+	// Same mix both ways
+	slot = &pb->pairs[a < b ? (a << 8) | b : (b << 8) | a];
+	if (*slot < 0) {
+		ca = &pb->pal.colors[a];
+		cb = &pb->pal.colors[b];
+		*slot = palblend_matchRGB(pb, (ca->r + cb->r + 1) / 2,
+										(ca->g + cb->g + 1) / 2,
+										(ca->b + cb->b + 1) / 2);
+	}
+
+	return *slot;
+}
+
+#define SORT2(x, y)	do { if (x > y) { uint8_t t = x; x = y; y = t; } } while (0)
+
+int palblend_mix4(palblend_t *pb, uint8_t a, uint8_t b, uint8_t c, uint8_t d)
+{
+	const palent_t *ca, *cb, *cc, *cd;
+	uint32_t key;
+	int idx;
+
+	// Same mix in any order
+	SORT2(a, b);
+	SORT2(c, d);
+	SORT2(a, c);
+	SORT2(b, d);
+	SORT2(b, c);
+	key = ((uint32_t)a << 24) | (b << 16) | (c << 8) | d;
+
+	idx = mixcache_get(&pb->quads, key);
+	if (idx < 0) {
+		ca = &pb->pal.colors[a];
+		cb = &pb->pal.colors[b];
+		cc = &pb->pal.colors[c];
+		cd = &pb->pal.colors[d];
+		idx = palblend_matchRGB(pb, (ca->r + cb->r + cc->r + cd->r + 2) / 4,
+									(ca->g + cb->g + cc->g + cd->g + 2) / 4,
+									(ca->b + cb->b + cc->b + cd->b + 2) / 4);
+		mixcache_put(&pb->quads, key, idx);
+	}
+
+	return idx;
+}
+#undef SORT2
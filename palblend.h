@@ -0,0 +1,48 @@
+#ifndef _palblend_h__
+#define _palblend_h__
+
+#include <stdint.h>
+#include "palette.h"
+
+/* Mixing palette colors
+ *
+ * The palette entry closest to a mix of colors is found by searching the
+ * whole palette, which is much too slow to do for every pixel of an
+ * animation. The results are cached, so each distinct mix is only searched
+ * once for as long as the palette does not change:
+ *
+ *  - Pairs of entries: A 256x256 table, filled as pairs are seen
+ *  - 2x2 blocks: Hashed by the 4 entries
+ *  - Anything else: Hashed by the average color
+ *
+ * Averages are rounded, and matched using palette_findBestMatch. Results are
+ * the same as doing this for every pixel: When the palette has duplicate
+ * colors, even a mix of identical entries gives the first one.
+ */
+
+struct mixcache {
+	uint32_t *keys;
+	int16_t *values; // -1 when empty
+	int bits; // size is 1 << bits
+	int used;
+};
+
+typedef struct palblend {
+	palette_t pal;
+	int16_t pairs[256*256]; // -1 when not computed yet
+	struct mixcache quads;
+	struct mixcache colors;
+} palblend_t;
+
+palblend_t *palblend_create(void);
+void palblend_free(palblend_t *pb);
+
+// Mix colors of pal from now on. The caches are kept if the colors are
+// the same as the previous palette.
+void palblend_setPalette(palblend_t *pb, const palette_t *pal);
+
+int palblend_matchRGB(palblend_t *pb, int r, int g, int b);
+int palblend_mix2(palblend_t *pb, uint8_t a, uint8_t b);
+int palblend_mix4(palblend_t *pb, uint8_t a, uint8_t b, uint8_t c, uint8_t d);
+
+#endif // _palblend_h__
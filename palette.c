@@ -117,7 +117,59 @@ void palette_addColorEnt(palette_t *pal, palent_t *entry)
 
 void palette_clear(palette_t * pal)
 {
-	memset(pal, 0, sizeof(palette_t));
+	pal->count = 0;
+	memset(pal->colors, 0, sizeof(pal->colors));
+}
+
+void palette_copy(palette_t *dst, const palette_t *src)
+{
+	if (dst == src)
+		return;
+
+	dst->count = src->count;
+	memcpy(dst->colors, src->colors, sizeof(dst->colors));
+}
+
+palette_t *palette_new(void)
+{
+	palette_t *pal;
+
+	pal = calloc(1, sizeof(palette_t));
+	if (!pal) {
+		perror("Could not allocate palette");
+		return NULL;
+	}
+	pal->refcount = 1;
+
+	return pal;
+}
+
+palette_t *palette_ref(const palette_t *pal)
+{
+	palette_t *p;
+
+	if (__atomic_load_n(&pal->refcount, __ATOMIC_RELAXED) > 0) {
+		p = (palette_t *)pal;
+		__atomic_add_fetch(&p->refcount, 1, __ATOMIC_RELAXED);
+		return p;
+	}
+
+	p = palette_new();
+	if (p) {
+		palette_copy(p, pal);
+	}
+
+	return p;
+}
+
+void palette_unref(palette_t *pal)
+{
+	if (!pal || __atomic_load_n(&pal->refcount, __ATOMIC_RELAXED) < 1)
+		return;
+
+	if (__atomic_sub_fetch(&pal->refcount, 1, __ATOMIC_ACQ_REL) == 0) {
+		free(pal);
+	}
 }
 
 int palette_loadGimpPalette(const char *filename, palette_t *dst)
@@ -365,7 +417,7 @@ int palette_loadFromImage(const char *filename, palette_t *dst)
 		return -1;
 	}
 
-	memcpy(dst, &spr->palette, sizeof(palette_t));
+	palette_copy(dst, spr->palette);
 	freeSprite(spr);
 
 	return 0;
@@ -413,7 +465,7 @@ int palette_loadAct(const char *filename, palette_t *dst)
 
 int palette_load(const char *filename, palette_t *dst)
 {
-	palette_t src;
+	palette_t src = { };
 	struct {
 		int (*load)(const char *filename, palette_t *dst);
 		const char *name;
@@ -433,7 +485,7 @@ int palette_load(const char *filename, palette_t *dst)
 			fprintf(stderr, "No such built-in palette");
 			return -1;
 		}
-		memcpy(dst, builtin, sizeof(palette_t));
+		palette_copy(dst, builtin);
 		return 0;
 	}
 
@@ -459,7 +511,7 @@ int palette_load(const char *filename, palette_t *dst)
 
 	}
 
-	memcpy(dst, &src, sizeof(palette_t));
+	palette_copy(dst, &src);
 
 	return 0;
 }
@@ -468,6 +520,10 @@ int palettes_match(const palette_t *pal1, const palette_t *pal2)
 {
 	int i;
 
+	// Shared palettes are often compared with themselves
+	if (pal1 == pal2)
+		return 1;
+
 	if (pal1->count != pal2->count)
 		return 0;
 
@@ -774,7 +830,7 @@ int palette_gamma(palette_t *pal, double gamma)
 int palette_dropDuplicateColors(palette_t *pal)
 {
 	int i;
-	palette_t newpal;
+	palette_t newpal = { };
 
 	newpal.count = 0;
 
@@ -784,7 +840,7 @@ int palette_dropDuplicateColors(palette_t *pal)
 		}
 	}
 
-	memcpy(pal, &newpal, sizeof(palette_t));
+	palette_copy(pal, &newpal);
 
 	return 0;
 }
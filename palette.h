@@ -11,6 +11,9 @@ typedef struct sprite_palette_entry {
 typedef struct palette {
 	int count;
 	palent_t colors[256];
+	// Number of owners of a heap allocated palette (see palette_ref). 0 for
+	// palettes living on the stack, in static storage or inside another structure.
+	int refcount;
 } palette_t;
 
 typedef struct palette_remap_lut {
@@ -47,6 +50,21 @@ void palette_addColorEnt(palette_t *pal, palent_t *entry);
 int palette_findColor(const palette_t *pal, int r, int g, int b);
 int palette_findColorEnt(const palette_t *pal, palent_t *entry);
 void palette_clear(palette_t * pal);
+// Copy colors and count. Unlike memcpy, this leaves dst->refcount alone.
+void palette_copy(palette_t *dst, const palette_t *src);
+
+/* Shared palettes
+ *
+ * A heap palette with more than one owner must be treated as read-only. To
+ * modify it, an owner makes a private copy first (see sprite_editPalette).
+ * Owners may be added and dropped from several threads.
+ */
+palette_t *palette_new(void);
+// Add an owner to pal and return it. If pal is not a heap palette (refcount 0),
+// a heap copy owned by the caller is returned instead. NULL on error.
+palette_t *palette_ref(const palette_t *pal);
+// Drop an owner. Does nothing for non-heap palettes.
+void palette_unref(palette_t *pal);
 
 int palette_compareColorsManhattan(const palette_t *pal, int color1, int color2);
 int palette_compareColorsEuclidian(const palette_t *pal, int color1, int color2);
@@ -113,7 +113,7 @@ int loadBuiltInPalette(const char *name, int mode, int offset, palette_t *dst)
 
 int loadAndProcessPalette(const char *filename, int mode, int offset, palette_t *dst)
 {
-	palette_t src;
+	palette_t src = { };
 
 
 	if (palette_load(filename, &src)) {
@@ -170,7 +170,7 @@ int main(int argc, char **argv)
 	FILE *out_fptr;
 	int printpal_colored = 0;
 
-	palette_t palette;
+	palette_t palette = { };
 
 	// Start with an empty palette
 	palette_clear(&palette);
@@ -290,7 +290,7 @@ int main(int argc, char **argv)
 			sprite_fillRect(palimage, x * 32, y * 32, 31, 31, i);
 		}
 
-		sprite_savePNG(output_filename, palimage, 0);
+		sprite_save(output_filename, palimage, 0);
 		freeSprite(palimage);
 	}
 	else
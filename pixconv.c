@@ -0,0 +1,188 @@
+#include <string.h>
+#include "pixconv.h"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+// Neighbour bytes a,b (a first) of each 16 bit lane become (a << shift) | b,
+// then the lanes of both vectors are narrowed back to bytes.
+static inline __m128i mergePairs(__m128i a, __m128i b, int shift)
+{
+	const __m128i low = _mm_set1_epi16(0x00ff);
+	__m128i count = _mm_cvtsi32_si128(shift);
+
+	a = _mm_and_si128(_mm_or_si128(_mm_sll_epi16(a, count), _mm_srli_epi16(a, 8)), low);
+	b = _mm_and_si128(_mm_or_si128(_mm_sll_epi16(b, count), _mm_srli_epi16(b, 8)), low);
+
+	return _mm_packus_epi16(a, b);
+}
+
+// So movemask returns the first pixel in the most significant bit
+static inline __m128i reverseBytes(__m128i v)
+{
+	v = _mm_shuffle_epi32(v, _MM_SHUFFLE(1,0,3,2));
+	v = _mm_shufflelo_epi16(v, _MM_SHUFFLE(0,1,2,3));
+	v = _mm_shufflehi_epi16(v, _MM_SHUFFLE(0,1,2,3));
+
+	return _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+}
+#endif
+
+static void packScalar(uint8_t *dst, const uint8_t *src, int count, int bpp)
+{
+	uint8_t pixmask = 0xff >> (8-bpp);
+	int pixels_per_byte = 8 / bpp;
+	int i, j;
+	uint8_t b;
+
+	for (i=0; i<count; i+=pixels_per_byte) {
+		for (b=0,j=0; j<pixels_per_byte; j++) {
+			b <<= bpp;
+			if (i+j < count) {
+				b |= src[i+j] & pixmask;
+			}
+		}
+		*dst = b;
+		dst++;
+	}
+}
+
+void pixconv_pack(uint8_t *dst, const uint8_t *src, int count, int bpp)
+{
+	int done = 0;
+
+	if (bpp == 8) {
+		memcpy(dst, src, count);
+		return;
+	}
+
+#ifdef __SSE2__
+	{
+		const __m128i pixmask = _mm_set1_epi8(0xff >> (8-bpp));
+		const __m128i zero = _mm_setzero_si128();
+		__m128i v0, v1, v;
+		int bits;
+		uint32_t tmp;
+
+		// 32 pixels at a time
+		for (; done + 32 <= count; done += 32) {
+			v0 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + done)), pixmask);
+			v1 = _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + done + 16)), pixmask);
+
+			// Merge neighbours until the bytes are full
+			v = mergePairs(v0, v1, bpp);
+			for (bits = bpp * 2; bits < 8; bits *= 2) {
+				v = mergePairs(v, zero, bits);
+			}
+
+			switch (bpp)
+			{
+				case 4: _mm_storeu_si128((__m128i*)dst, v); break;
+				case 2: _mm_storel_epi64((__m128i*)dst, v); break;
+				case 1:
+					tmp = _mm_cvtsi128_si32(v);
+					memcpy(dst, &tmp, 4);
+					break;
+			}
+			dst += 4 * bpp;
+		}
+	}
+#endif
+
+	packScalar(dst, src + done, count - done, bpp);
+}
+
+void pixconv_unpack(uint8_t *dst, const uint8_t *src, int count, int bpp)
+{
+	uint8_t pixmask = 0xff >> (8-bpp);
+	int pixels_per_byte = 8 / bpp;
+	int i;
+
+	if (bpp == 8) {
+		memcpy(dst, src, count);
+		return;
+	}
+
+	for (i=0; i<count; i++) {
+		dst[i] = (src[i / pixels_per_byte] >> (8 - bpp - (i % pixels_per_byte) * bpp)) & pixmask;
+	}
+}
+
+// Up to 8 pixels
+static void groupToPlanes(uint8_t *dst, const uint8_t *src, int count, int planes, int plane_stride)
+{
+	int p, i;
+	uint8_t b;
+
+	for (p=0; p<planes; p++) {
+		for (b=0,i=0; i<8; i++) {
+			b <<= 1;
+			if (i < count) {
+				b |= (src[i] >> p) & 1;
+			}
+		}
+		dst[p * plane_stride] = b;
+	}
+}
+
+void pixconv_toPlanes(uint8_t *dst, const uint8_t *src, int count, int planes, int plane_stride, int group_stride)
+{
+	int g = 0;
+
+#ifdef __SSE2__
+	{
+		__m128i v;
+		int p, bits;
+
+		// 16 pixels (2 groups) at a time: Shift the wanted bit to the
+		// top of each byte and collect them with movemask.
+		for (; (g + 2) * 8 <= count; g += 2) {
+			v = reverseBytes(_mm_loadu_si128((const __m128i*)(src + g * 8)));
+			for (p=0; p<planes; p++) {
+				bits = _mm_movemask_epi8(_mm_sll_epi16(v, _mm_cvtsi32_si128(7 - p)));
+				dst[p * plane_stride + g * group_stride] = bits >> 8;
+				dst[p * plane_stride + (g + 1) * group_stride] = bits;
+			}
+		}
+	}
+#endif
+
+	for (; g * 8 < count; g++) {
+		groupToPlanes(dst + g * group_stride, src + g * 8, count - g * 8, planes, plane_stride);
+	}
+}
+
+void pixconv_toModeX(uint8_t *dst, const uint8_t *src, int count)
+{
+	int plane_size = count / 4;
+	int i = 0, p;
+
+#ifdef __SSE2__
+	{
+		const __m128i low = _mm_set1_epi32(0xff);
+		__m128i v[4], a[4], shift;
+		int k;
+
+		// 64 pixels (16 per plane) at a time
+		for (; i + 16 <= plane_size; i += 16) {
+			for (k=0; k<4; k++) {
+				v[k] = _mm_loadu_si128((const __m128i*)(src + i * 4 + k * 16));
+			}
+			for (p=0; p<4; p++) {
+				shift = _mm_cvtsi32_si128(p * 8);
+				for (k=0; k<4; k++) {
+					a[k] = _mm_and_si128(_mm_srl_epi32(v[k], shift), low);
+				}
+				_mm_storeu_si128((__m128i*)(dst + p * plane_size + i),
+					_mm_packus_epi16(_mm_packs_epi32(a[0], a[1]), _mm_packs_epi32(a[2], a[3])));
+			}
+		}
+	}
+#endif
+
+	for (; i<plane_size; i++) {
+		for (p=0; p<4; p++) {
+			dst[p * plane_size + i] = src[i * 4 + p];
+		}
+	}
+}
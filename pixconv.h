@@ -0,0 +1,36 @@
+#ifndef _pixconv_h__
+#define _pixconv_h__
+
+#include <stdint.h>
+
+/* Conversions from 8bpp chunky pixels (one byte per pixel) to the
+ * layouts used by the various output formats.
+ *
+ * In all packed and planar formats, the first pixel is in the most
+ * significant bit(s) of the byte. When count does not fill the last
+ * byte, the remaining bits are zero. Bits of the source pixels above
+ * what the format holds are ignored.
+ */
+
+// Packed pixels: 1, 2, 4 or 8 bits per pixel (8 bits is a plain copy).
+// Writes (count * bpp + 7) / 8 bytes.
+void pixconv_pack(uint8_t *dst, const uint8_t *src, int count, int bpp);
+// The reverse. Writes count bytes.
+void pixconv_unpack(uint8_t *dst, const uint8_t *src, int count, int bpp);
+
+/* Bitplanes: one bit per pixel, 8 pixels per byte. Bit 'p' of the pixels
+ * in group 'g' (pixels g*8 to g*8+7) goes to
+ *
+ *     dst[p * plane_stride + g * group_stride]
+ *
+ * For instance, with 4 planes:
+ *  - SMS tiles rows (planes interleaved per byte): plane_stride 1, group_stride 4
+ *  - EGA/Amiga rows (one plane after the other): plane_stride count/8, group_stride 1
+ */
+void pixconv_toPlanes(uint8_t *dst, const uint8_t *src, int count, int planes, int plane_stride, int group_stride);
+
+// VGA mode X: every 4th pixel to one of 4 planes, one plane after the
+// other (count/4 bytes each). count must be a multiple of 4.
+void pixconv_toModeX(uint8_t *dst, const uint8_t *src, int count);
+
+#endif // _pixconv_h__
@@ -29,17 +29,21 @@ void generateGrayscalePalette(int n_colors, sprite_t *spr)
 {
 	int i;
 	int intensity;
+	palette_t *pal = sprite_editPalette(spr);
+
+	if (!pal)
+		return;
 
 	for (i=0; i<n_colors; i++) {
 
 		intensity = sin(i*M_PI/n_colors) * 255;
 
-		spr->palette.colors[i].r = intensity;
-		spr->palette.colors[i].g = intensity;
-		spr->palette.colors[i].b = intensity;
+		pal->colors[i].r = intensity;
+		pal->colors[i].g = intensity;
+		pal->colors[i].b = intensity;
 	}
 
-	spr->palette.count = n_colors;
+	pal->count = n_colors;
 }
 
 int applyMinMax(int value, int min, int max)
@@ -63,8 +67,8 @@ void drawConcentricPlasma(sprite_t *spr)
 			dy = y - spr->h/2 + 0.5;
 			d = sqrt(dx*dx+dy*dy) / divisor;
 
-			color = (int)d % spr->palette.count; // spr->palette.count / 2 + (spr->palette.count / 2) * sin(d / divisor);
-			color = applyMinMax(color, 0, spr->palette.count - 1);
+			color = (int)d % spr->palette->count; // spr->palette->count / 2 + (spr->palette->count / 2) * sin(d / divisor);
+			color = applyMinMax(color, 0, spr->palette->count - 1);
 
 			sprite_setPixel(spr, x, y, color);
 		}
@@ -137,7 +141,7 @@ int main(int argc, char **argv)
 
 //	printSprite(working_image);
 
-	sprite_savePNG(out_filename, working_image, 0);
+	sprite_save(out_filename, working_image, 0);
 	freeSprite(working_image);
 
 	return 0;
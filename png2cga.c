@@ -3,6 +3,7 @@
 #include <stdint.h>
 
 #include <png.h>
+#include "pixconv.h"
 
 int convertPNG(FILE *fptr_in, FILE *fptr_out);
 
@@ -144,16 +145,9 @@ int convertPNG(FILE *fptr_in, FILE *fptr_out)
 			break;
 		case 8:
 			for (y=0; y<h; y++) {
-				unsigned char row[w/4];
-				memset(row, 0, sizeof(row));
+				unsigned char row[(w+3)/4];
 
-				for (x=0; x<w; x++) {
-					unsigned char b;
-
-					b = row_pointers[y][x];
-
-					row[x/4] |= (b<<6)>>((x&3)<<1);
-				}
+				pixconv_pack(row, row_pointers[y], w, 2);
 
 				if (y &1) {
 					fseek(fptr_out, (w/4) * (y/2) + (h * (w/4)/2), SEEK_SET);
@@ -5,6 +5,7 @@
 #include <getopt.h>
 
 #include <png.h>
+#include "pixconv.h"
 
 int convertPNG(FILE *fptr_in, FILE *fptr_out, int append_palette, int value_offset, int black_trick, int for_mode_x, int bsave_header);
 
@@ -115,18 +116,6 @@ done:
 	return ret;
 }
 
-static void writePlanar4(const uint8_t *dat, int count, FILE *outfptr)
-{
-	int i,j;
-	int pc = count/4;
-
-	for (i=0; i<4; i++) {
-		for (j=0; j<pc; j++) {
-			fwrite(dat + i +  j * 4, 1, 1, outfptr);
-		}
-	}
-}
-
 int convertPNG(FILE *fptr_in, FILE *fptr_out, int append_palette, int value_offset, int black_trick, int for_mode_x, int bsave_header)
 {
 	png_structp png_ptr;
@@ -251,6 +240,7 @@ int convertPNG(FILE *fptr_in, FILE *fptr_out, int append_palette, int value_offs
 		for (y=0; y<h; y++) {
 			uint8_t tmp;
 			uint8_t rowbuf[w];
+			uint8_t planes[w];
 
 			for (x=0; x<w; x++) {
 				tmp = row_pointers[y][x];
@@ -269,7 +259,8 @@ int convertPNG(FILE *fptr_in, FILE *fptr_out, int append_palette, int value_offs
 				rowbuf[x] = tmp;
 			}
 
-			writePlanar4(rowbuf, w, fptr_out);
+			pixconv_toModeX(planes, rowbuf, w);
+			fwrite(planes, w, 1, fptr_out);
 		}
 	}
 
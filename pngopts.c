@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+#include <zlib.h>
+#include "pngopts.h"
+#include "util.h"
+
+png_saveopts_t g_png_saveopts = PNG_SAVEOPTS_DEFAULT;
+
+static const struct {
+	const char *name;
+	int filter;
+} filter_names[] = {
+	{ "none", PNG_FILTER_NONE },
+	{ "sub", PNG_FILTER_SUB },
+	{ "up", PNG_FILTER_UP },
+	{ "avg", PNG_FILTER_AVG },
+	{ "paeth", PNG_FILTER_PAETH },
+	{ "allfilters", PNG_ALL_FILTERS },
+};
+
+static const struct {
+	const char *name;
+	int strategy;
+} strategy_names[] = {
+	{ "rle", Z_RLE },
+	{ "huffman", Z_HUFFMAN_ONLY },
+	{ "filtered", Z_FILTERED },
+};
+
+static int parseItem(png_saveopts_t *opts, const char *item, int *filters)
+{
+	char *e;
+	int i, level;
+
+	if (0 == strcasecmp(item, "default")) {
+		opts->level = opts->filters = opts->strategy = -1;
+		return 0;
+	}
+	if (0 == strcasecmp(item, "fast")) {
+		opts->level = 1;
+		opts->filters = PNG_FILTER_NONE;
+		opts->strategy = -1;
+		return 0;
+	}
+	if (0 == strcasecmp(item, "small")) {
+		opts->level = 9;
+		opts->filters = PNG_ALL_FILTERS;
+		opts->strategy = -1;
+		return 0;
+	}
+
+	for (i=0; i<ARRAY_SIZE(filter_names); i++) {
+		if (0 == strcasecmp(item, filter_names[i].name)) {
+			*filters |= filter_names[i].filter;
+			return 0;
+		}
+	}
+
+	for (i=0; i<ARRAY_SIZE(strategy_names); i++) {
+		if (0 == strcasecmp(item, strategy_names[i].name)) {
+			opts->strategy = strategy_names[i].strategy;
+			return 0;
+		}
+	}
+
+	level = strtol(item, &e, 10);
+	if ((e != item) && (*e == 0) && (level >= 0) && (level <= 9)) {
+		opts->level = level;
+		return 0;
+	}
+
+	fprintf(stderr, "Invalid PNG option: %s\n", item);
+	return -1;
+}
+
+int pngopts_parse(png_saveopts_t *opts, const char *arg)
+{
+	char buf[128];
+	char *item, *saveptr;
+	int filters = 0;
+
+	if (strlen(arg) >= sizeof(buf)) {
+		fprintf(stderr, "PNG options too long\n");
+		return -1;
+	}
+	strcpy(buf, arg);
+
+	for (item = strtok_r(buf, ",", &saveptr); item; item = strtok_r(NULL, ",", &saveptr)) {
+		if (parseItem(opts, item, &filters)) {
+			return -1;
+		}
+	}
+
+	// Filters given by name replace those of presets
+	if (filters) {
+		opts->filters = filters;
+	}
+
+	return 0;
+}
+
+void pngopts_apply(png_structp png_ptr, const png_saveopts_t *opts)
+{
+	if (opts->level >= 0) {
+		png_set_compression_level(png_ptr, opts->level);
+	}
+	if (opts->filters >= 0) {
+		png_set_filter(png_ptr, PNG_FILTER_TYPE_BASE, opts->filters);
+	}
+	if (opts->strategy >= 0) {
+		png_set_compression_strategy(png_ptr, opts->strategy);
+	}
+}
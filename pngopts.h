@@ -0,0 +1,37 @@
+#ifndef _pngopts_h__
+#define _pngopts_h__
+
+/* PNG writing speed/size settings
+ *
+ * The default libpng settings compress well but slowly. When writing many
+ * files (e.g. one per animation frame), a lower zlib level and no row
+ * filtering are often many times faster for a small size increase.
+ */
+typedef struct png_saveopts {
+	int level; // zlib compression level (0-9), or -1 for the libpng default
+	int filters; // PNG_FILTER_* flags, or -1 for the libpng default
+	int strategy; // zlib strategy (Z_RLE, ...), or -1 for the libpng default
+} png_saveopts_t;
+
+#define PNG_SAVEOPTS_DEFAULT	{ -1, -1, -1 }
+
+// Used by sprite_savePNG and rgbi_savePNG*. Tools may change it.
+extern png_saveopts_t g_png_saveopts;
+
+/* Parse a comma separated list of settings. Later items override
+ * earlier ones.
+ *
+ *   fast, small, default    Presets
+ *   0 to 9                  zlib compression level
+ *   none, sub, up, avg,
+ *   paeth, allfilters       Row filters to try (may be combined)
+ *   rle, huffman, filtered  zlib strategy
+ *
+ * Eg: "fast", "6,rle", "9,allfilters"
+ */
+int pngopts_parse(png_saveopts_t *opts, const char *arg);
+
+struct png_struct_def;
+void pngopts_apply(struct png_struct_def *png_ptr, const png_saveopts_t *opts);
+
+#endif // _pngopts_h__
@@ -0,0 +1,178 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "prefetch.h"
+#include "threadpool.h"
+
+struct prefetch_item {
+	struct prefetch *pf;
+	const char *filename;
+	void *obj;
+	size_t size;
+	int done;
+};
+
+struct prefetch {
+	struct threadpool *pool;
+	prefetch_load_fn load;
+	int lookahead;
+	size_t budget;
+
+	int count;
+	struct prefetch_item *items;
+	int next_submit; // next item to give to the pool
+	int next_consume; // next item to return
+
+	pthread_mutex_t lock;
+	pthread_cond_t item_done;
+	size_t ready_size; // loaded, not yet returned
+};
+
+static void loadItem(void *arg)
+{
+	struct prefetch_item *item = arg;
+	struct prefetch *pf = item->pf;
+	size_t size = 0;
+	void *obj;
+
+	obj = pf->load(item->filename, &size);
+
+	pthread_mutex_lock(&pf->lock);
+	item->obj = obj;
+	item->size = size;
+	item->done = 1;
+	pf->ready_size += size;
+	pthread_cond_broadcast(&pf->item_done);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+// Queue more files, within the lookahead and memory limits
+static void submit(struct prefetch *pf)
+{
+	size_t ready;
+
+	while (pf->next_submit < pf->count) {
+		if (pf->next_submit - pf->next_consume >= pf->lookahead) {
+			break;
+		}
+
+		pthread_mutex_lock(&pf->lock);
+		ready = pf->ready_size;
+		pthread_mutex_unlock(&pf->lock);
+
+		// Never hold back the file the consumer needs next
+		if ((pf->next_submit > pf->next_consume) && (ready >= pf->budget)) {
+			break;
+		}
+
+		if (threadpool_add(pf->pool, loadItem, &pf->items[pf->next_submit])) {
+			break;
+		}
+		pf->next_submit++;
+	}
+}
+
+struct prefetch *prefetch_create(int count, char * const *filenames, prefetch_load_fn load, int lookahead, size_t budget)
+{
+	struct prefetch *pf;
+	int i;
+
+	if (lookahead <= 0) {
+		lookahead = threadpool_numCPUs();
+	}
+
+	pf = calloc(1, sizeof(struct prefetch));
+	if (!pf) {
+		perror("calloc");
+		return NULL;
+	}
+
+	pf->items = calloc(count, sizeof(struct prefetch_item));
+	if (!pf->items) {
+		perror("calloc");
+		free(pf);
+		return NULL;
+	}
+
+	pf->pool = threadpool_create(lookahead);
+	if (!pf->pool) {
+		free(pf->items);
+		free(pf);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->item_done, NULL);
+
+	pf->load = load;
+	pf->lookahead = lookahead;
+	pf->budget = budget;
+	pf->count = count;
+	for (i=0; i<count; i++) {
+		pf->items[i].pf = pf;
+		pf->items[i].filename = filenames[i];
+	}
+
+	submit(pf);
+
+	return pf;
+}
+
+void *prefetch_next(struct prefetch *pf)
+{
+	struct prefetch_item *item;
+	void *obj;
+
+	if (pf->next_consume >= pf->count) {
+		return NULL;
+	}
+
+	item = &pf->items[pf->next_consume];
+
+	// May have been held back by the budget
+	if (pf->next_submit == pf->next_consume) {
+		submit(pf);
+		if (pf->next_submit == pf->next_consume) {
+			// Could not queue it, load it here.
+			loadItem(item);
+			pf->next_submit++;
+		}
+	}
+
+	pthread_mutex_lock(&pf->lock);
+	while (!item->done) {
+		pthread_cond_wait(&pf->item_done, &pf->lock);
+	}
+	obj = item->obj;
+	item->obj = NULL;
+	pf->ready_size -= item->size;
+	pthread_mutex_unlock(&pf->lock);
+
+	pf->next_consume++;
+	submit(pf);
+
+	return obj;
+}
+
+void prefetch_free(struct prefetch *pf, void (*release)(void *obj))
+{
+	int i;
+
+	if (!pf) {
+		return;
+	}
+
+	// Let loads in progress complete
+	threadpool_free(pf->pool);
+
+	for (i=pf->next_consume; i<pf->next_submit; i++) {
+		if (pf->items[i].obj && release) {
+			release(pf->items[i].obj);
+		}
+	}
+
+	pthread_cond_destroy(&pf->item_done);
+	pthread_mutex_destroy(&pf->lock);
+	free(pf->items);
+	free(pf);
+}
@@ -0,0 +1,35 @@
+#ifndef _prefetch_h__
+#define _prefetch_h__
+
+#include <stddef.h>
+
+/* Background loading of input files
+ *
+ * For tools processing a list of files one after the other: The next
+ * files are loaded by worker threads while the current one is processed.
+ * Results are returned in list order.
+ *
+ * At most 'lookahead' files are loaded ahead of the consumer, and loading
+ * ahead stops while the results waiting to be consumed exceed 'budget'
+ * bytes. The next file needed by the consumer is always loaded.
+ */
+
+// Returns the loaded object (NULL on error) and sets *size to its
+// approximate memory usage. Called from worker threads.
+typedef void *(*prefetch_load_fn)(const char *filename, size_t *size);
+
+#define PREFETCH_DEFAULT_BUDGET	(256 * 1024 * 1024)
+
+struct prefetch;
+
+// lookahead 0 means one file per CPU
+struct prefetch *prefetch_create(int count, char * const *filenames, prefetch_load_fn load, int lookahead, size_t budget);
+
+// Next object in list order, waiting for it if necessary. Returns NULL
+// if loading failed or all files were returned. The caller owns the object.
+void *prefetch_next(struct prefetch *pf);
+
+// Objects loaded but never returned by prefetch_next are passed to release.
+void prefetch_free(struct prefetch *pf, void (*release)(void *obj));
+
+#endif // _prefetch_h__
@@ -7,6 +7,7 @@
 
 #include "swpxlt.h"
 #include "sprite_transform.h"
+#include "threadpool.h"
 
 int g_verbose;
 sprite_t *original_image = NULL, *target_image = NULL;
@@ -22,6 +23,8 @@ static void printHelp()
 	printf(" -f count     Frame count (including identity)\n");
 	printf(" -a           Auto-repair or add a black sprite contour\n");
 	printf(" -z           horiZontal (side to side) frame output, rather than vertical.\n");
+	printf(" -c pngopts   PNG compression settings. Eg: fast, small, 6,rle\n");
+	printf(" -j threads   Number of threads (default: one per CPU)\n");
 }
 
 int is_multiple_of_90(double angle)
@@ -34,6 +37,30 @@ int is_multiple_of_90(double angle)
 	return 0;
 }
 
+struct rotjob {
+	const sprite_t *upscaled; // shared by all jobs
+	sprite_t *frame;
+	double angle;
+	int autorepair;
+};
+
+static void rotateJob(void *arg)
+{
+	struct rotjob *job = arg;
+
+	// TODO : This should probably be configurable...
+	if (is_multiple_of_90(job->angle)) {
+		sprite_rotate(original_image, job->frame, job->angle);
+	} else {
+		// Nice2x, from the source upscaled once for all frames
+		sprite_rotateUpscaled(job->upscaled, job->frame, job->angle, NULL, 0, 0.5);
+	}
+
+	if (job->autorepair) {
+		sprite_autoBlackContour(job->frame);
+	}
+}
+
 int main(int argc, char **argv)
 {
 	int opt;
@@ -45,16 +72,30 @@ int main(int argc, char **argv)
 	int i;
 	double angle;
 	spriterect_t dstrect;
-	sprite_t *tmpsprite;
-	uint8_t rotalgo;
+	sprite_t *upscaled;
+	struct rotjob *jobs;
+	struct threadpool *pool;
+	int threads = 0;
 	int autorepair = 0;
 	int horizontal = 0;
 
-	while ((opt = getopt(argc, argv, "hvr:f:az")) != -1) {
+	while ((opt = getopt(argc, argv, "hvr:f:azc:j:")) != -1) {
 		switch (opt) {
 			case '?': return -1;
 			case 'h': printHelp(); return 0;
 			case 'v': g_verbose = 1; break;
+			case 'c':
+				if (pngopts_parse(&g_png_saveopts, optarg)) {
+					return -1;
+				}
+				break;
+			case 'j':
+				threads = strtol(optarg, &e, 0);
+				if ((e == optarg) || (threads < 0)) {
+					fprintf(stderr, "Invalid thread count\n");
+					return -1;
+				}
+				break;
 			case 'a': autorepair = 1; break;
 			case 'z': horizontal = 1; break;
 			case 'r':
@@ -90,7 +131,7 @@ int main(int argc, char **argv)
 		printf("Auto-repair border: %s\n", autorepair ? "Yes" : "No");
 	}
 
-	original_image = sprite_loadPNG(sourcefn, 0, 0);
+	original_image = sprite_load(sourcefn, 0, 0);
 	if (!original_image) {
 		return -1;
 	}
@@ -98,12 +139,12 @@ int main(int argc, char **argv)
 	if (horizontal) {
 		target_image = allocSprite(original_image->w * frame_count,
 		            original_image->h,
-					original_image->palette.count,
+					original_image->palette->count,
 					original_image->flags );
 	} else {
 		target_image = allocSprite(original_image->w,
 		            original_image->h * frame_count,
-					original_image->palette.count,
+					original_image->palette->count,
 					original_image->flags );
 	}
 	if (!target_image) {
@@ -118,33 +159,55 @@ int main(int argc, char **argv)
 		printf("Target dimensions: %d x %d\n", target_image->w, target_image->h);
 	}
 
-	angle = 0.0;
-	dstrect.x = 0;
-	dstrect.y = 0;
-	dstrect.w = original_image->w;
-	dstrect.h = original_image->h;
-	for (i=0; i<frame_count; i++) {
+	// The same for all angles
+	upscaled = createScaledSprite(original_image, SCALE_ALGO_2X, 2.0);
+	if (!upscaled) {
+		return -1;
+	}
 
-		// TODO : This should probably be configurable...
-		rotalgo = ROT_ALGO_NICE2X;
-		if (is_multiple_of_90(angle)) {
-			rotalgo = ROT_ALGO_NEAR;
-		}
+	jobs = calloc(frame_count, sizeof(struct rotjob));
+	if (!jobs) {
+		perror("calloc");
+		return -1;
+	}
 
+	pool = threadpool_create(threads);
+	if (!pool) {
+		return -1;
+	}
+
+	angle = 0.0;
+	for (i=0; i<frame_count; i++) {
 		if (g_verbose) {
-			printf("Angle... %.2f algo %d\n", angle, rotalgo);
+			printf("Angle... %.2f algo %d\n", angle, is_multiple_of_90(angle) ? ROT_ALGO_NEAR : ROT_ALGO_NICE2X);
 		}
 
-		tmpsprite = createRotatedSprite(original_image, rotalgo, angle);
-
-		if (autorepair) {
-			sprite_autoBlackContour(tmpsprite);
+		jobs[i].upscaled = upscaled;
+		jobs[i].angle = angle;
+		jobs[i].autorepair = autorepair;
+		jobs[i].frame = duplicateSprite(original_image);
+		if (!jobs[i].frame) {
+			fprintf(stderr, "Could not create frame\n");
+			return -1;
 		}
 
-		sprite_copyRect(tmpsprite, NULL, target_image, &dstrect);
-		freeSprite(tmpsprite);
+		if (threadpool_add(pool, rotateJob, &jobs[i])) {
+			rotateJob(&jobs[i]);
+		}
 
 		angle += rotate_step;
+	}
+
+	threadpool_free(pool);
+	freeSprite(upscaled);
+
+	dstrect.x = 0;
+	dstrect.y = 0;
+	dstrect.w = original_image->w;
+	dstrect.h = original_image->h;
+	for (i=0; i<frame_count; i++) {
+		sprite_copyRect(jobs[i].frame, NULL, target_image, &dstrect);
+		freeSprite(jobs[i].frame);
 
 		if (horizontal) {
 			dstrect.x += dstrect.w;
@@ -153,7 +216,9 @@ int main(int argc, char **argv)
 		}
 	}
 
-	sprite_savePNG(dstfn, target_image, 0);
+	free(jobs);
+
+	sprite_save(dstfn, target_image, 0);
 
 	if (original_image) {
 		freeSprite(original_image);
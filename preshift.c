@@ -28,6 +28,7 @@ static void printHelp()
 	printf(" -y inc       Y offset increment\n");
 	printf(" -z           horiZontal (side to side) frame output, rather than vertical.\n");
 	printf(" -m           Two dimensions mode (For each X loop, Y inc)\n");
+	printf(" -c pngopts   PNG compression settings. Eg: fast, small, 6,rle\n");
 }
 
 int totalSteps(int x_inc, int y_inc, int w, int h)
@@ -54,8 +55,7 @@ int main(int argc, char **argv)
 	char *e;
 	int i;
 	spriterect_t dstrect;
-	spriterect_t srcrect;
-	sprite_t *tmpsprite = NULL;
+	sprite_view_t srcview;
 	int horizontal = 0;
 	int x_inc = 1;
 	int y_inc = 0;
@@ -63,11 +63,16 @@ int main(int argc, char **argv)
 	int x, y;
 	int twodim_mode = 0;
 
-	while ((opt = getopt(argc, argv, "hvx:y:zm")) != -1) {
+	while ((opt = getopt(argc, argv, "hvx:y:zmc:")) != -1) {
 		switch (opt) {
 			case '?': return -1;
 			case 'h': printHelp(); return 0;
 			case 'v': g_verbose = 1; break;
+			case 'c':
+				if (pngopts_parse(&g_png_saveopts, optarg)) {
+					return -1;
+				}
+				break;
 			case 'x': x_inc = strtol(optarg, &e, 10); break;
 			case 'y': y_inc = strtol(optarg, &e, 10); break;
 			case 'z': horizontal = 1; break;
@@ -90,7 +95,7 @@ int main(int argc, char **argv)
 		printf("Layout: %s\n", horizontal ? "Horizontal" : "Vertical");
 	}
 
-	original_image = sprite_loadPNG(sourcefn, 0, 0);
+	original_image = sprite_load(sourcefn, 0, 0);
 	if (!original_image) {
 		return -1;
 	}
@@ -105,12 +110,12 @@ int main(int argc, char **argv)
 	if (horizontal) {
 		target_image = allocSprite(original_image->w * steps,
 		            original_image->h,
-					original_image->palette.count,
+					original_image->palette->count,
 					original_image->flags );
 	} else {
 		target_image = allocSprite(original_image->w,
 		            original_image->h * steps,
-					original_image->palette.count,
+					original_image->palette->count,
 					original_image->flags );
 	}
 	if (!target_image) {
@@ -126,29 +131,6 @@ int main(int argc, char **argv)
 		printf("Steps: %d\n", steps);
 	}
 
-	// Create a 3x3 mosaic of original image, to use as a source
-	tmpsprite = allocSprite(original_image->w * 3,
-		            original_image->h * 3,
-					original_image->palette.count,
-					original_image->flags );
-	if (!tmpsprite) {
-		fprintf(stderr, "Could not create temporary image\n");
-		return -1;
-	}
-	sprite_copyPalette(original_image, tmpsprite);
-
-	dstrect.w = original_image->w;
-	dstrect.h = original_image->h;
-	for (y=0; y<3; y++) {
-		for (x=0; x<3; x++) {
-			dstrect.x = x*original_image->w;
-			dstrect.y = y*original_image->h;
-			sprite_copyRect(original_image, NULL, tmpsprite, &dstrect);
-		}
-	}
-
-	srcrect.w = original_image->w;
-	srcrect.h = original_image->h;
 	dstrect.w = original_image->w;
 	dstrect.h = original_image->h;
 	x = 0;
@@ -162,10 +144,10 @@ int main(int argc, char **argv)
 			dstrect.y = i*original_image->w;
 		}
 
-		srcrect.x = original_image->w + x;
-		srcrect.y = original_image->h + y;
+		// The source wraps around the original image edges
+		sprite_getWrappedView(original_image, x, y, original_image->w, original_image->h, &srcview);
 
-		sprite_copyRect(tmpsprite, &srcrect, target_image, &dstrect);
+		sprite_copyRectFromView(&srcview, NULL, target_image, &dstrect);
 
 		if (twodim_mode) {
 			x += x_inc;
@@ -183,7 +165,7 @@ int main(int argc, char **argv)
 		}
 	}
 
-	sprite_savePNG(dstfn, target_image, 0);
+	sprite_save(dstfn, target_image, 0);
 
 	if (original_image) {
 		freeSprite(original_image);
@@ -6,6 +6,7 @@
 #include "globals.h"
 #include "palette.h"
 #include "util.h"
+#include "pngopts.h"
 
 pixel_t *getPixel(rgbimage_t *img, int x, int y)
 {
@@ -285,6 +286,7 @@ int rgbi_savePNG(const char *out_filename, rgbimage_t *img)
 	}
 
 	png_init_io(png_ptr, fptr);
+	pngopts_apply(png_ptr, &g_png_saveopts);
 
 	png_set_IHDR(png_ptr, info_ptr, w, h, 8, color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
@@ -357,6 +359,7 @@ int rgbi_savePNG_indexed(const char *out_filename, rgbimage_t *img, const palett
 	}
 
 	png_init_io(png_ptr, fptr);
+	pngopts_apply(png_ptr, &g_png_saveopts);
 
 	png_set_IHDR(png_ptr, info_ptr, w, h, 8, color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
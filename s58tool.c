@@ -5,6 +5,7 @@
 #include <stdint.h>
 #include "sprite.h"
 #include "globals.h"
+#include "pixconv.h"
 
 int g_verbose;
 
@@ -74,7 +75,7 @@ sprite_t *loadDat(const char *filename)
 	char *e;
 	int w = 416, h;
 	int rowbytes;
-	int x, y, c;
+	int y;
 	char hstr[6];
 	uint8_t header[32];
 	sprite_t *img;
@@ -145,19 +146,12 @@ sprite_t *loadDat(const char *filename)
 	}
 
 	// Color 0 white : Paper
-	palette_setColor(&img->palette, 0, 0xff, 0xff, 0xff);
+	palette_setColor(sprite_editPalette(img), 0, 0xff, 0xff, 0xff);
 	// Color 1 black : Thermal print
-	palette_setColor(&img->palette, 1, 0, 0, 0);
+	palette_setColor(sprite_editPalette(img), 1, 0, 0, 0);
 
 	for (y=0; y<h; y++) {
-		for(x=0; x<w; x++) {
-			if (buf[y*(w/8)+(x/8)] & (0x80 >> (x & 7))) {
-				c = 1;
-			} else {
-				c = 0;
-			}
-			sprite_setPixel(img, x, y, c);
-		}
+		pixconv_unpack(img->pixels + y * w, buf + y * rowbytes, w, 1);
 	}
 
 	free(buf);
@@ -170,9 +164,9 @@ int saveDat(const char *filename, sprite_t *img)
 {
 	FILE *fptr;
 	int rowsize;
-	uint8_t *rowbuf;
+	uint8_t *rowbuf, *linebuf;
 	int y, x;
-	struct palette outpal;
+	struct palette outpal = { };
 	int src_color, dst_color;
 	uint8_t r, g, b;
 	char header[33];
@@ -210,28 +204,30 @@ int saveDat(const char *filename, sprite_t *img)
 
 	rowsize = img->w / 8;
 	rowbuf = malloc(rowsize);
-	if (!rowbuf) {
+	linebuf = malloc(img->w);
+	if (!rowbuf || !linebuf) {
 		perror("could not allocate row buffer");
+		free(rowbuf);
+		free(linebuf);
 		fclose(fptr);
 		return -1;
 	}
 
 	for (y=0; y<img->h; y++) {
-		memset(rowbuf, 0, rowsize);
 		for (x=0; x<img->w; x++) {
 			src_color = sprite_getPixel(img, x, y);
-			r = img->palette.colors[src_color].r;
-			g = img->palette.colors[src_color].g;
-			b = img->palette.colors[src_color].b;
+			r = img->palette->colors[src_color].r;
+			g = img->palette->colors[src_color].g;
+			b = img->palette->colors[src_color].b;
 			dst_color = palette_findBestMatch(&outpal, r, g, b, 0);
-			if (dst_color) {
-				rowbuf[x/8] |= 0x80 >> (x & 7);
-			}
+			linebuf[x] = dst_color;
 		}
+		pixconv_pack(rowbuf, linebuf, img->w, 1);
 		fwrite(rowbuf, rowsize, 1, fptr);
 	}
 
 	free(rowbuf);
+	free(linebuf);
 	fclose(fptr);
 
 	return 0;
@@ -312,7 +308,7 @@ int main(int argc, char **argv)
 	switch(save_format)
 	{
 		case FORMAT_PNG:
-			res = sprite_savePNG(save_filename, img, 0);
+			res = sprite_save(save_filename, img, 0);
 			break;
 
 		case FORMAT_DAT:
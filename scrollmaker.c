@@ -4,6 +4,7 @@
 #include <stdlib.h>
 #include "sprite.h"
 #include "anim.h"
+#include "blit.h"
 #include "globals.h"
 
 int g_verbose = 0;
@@ -13,6 +14,9 @@ int g_verbose = 0;
 #define DEFAULT_OUTPUT_FILE	"scrollmaker.flc"
 #define DEFAULT_FRAME_RATE	60
 
+// Frames rendered before being encoded together (see flic_appendFrames)
+#define FLIC_BATCH_FRAMES	32
+
 #define DEFAULT_W	320
 #define DEFAULT_H	200
 
@@ -23,6 +27,7 @@ enum {
 	OPT_WIDTH,
 	OPT_HEIGHT,
 	OPT_BGCOLOR,
+	OPT_RAW_OUT,
 };
 
 static struct option long_options[] = {
@@ -35,6 +40,7 @@ static struct option long_options[] = {
 	{ "addlayer",	required_argument,	0,	OPT_ADD_LAYER },
 	{ "fps",		required_argument,	0,	OPT_FPS },
 	{ "bgcolor",	required_argument,	0,	OPT_BGCOLOR },
+	{ "raw-out",	required_argument,	0,	OPT_RAW_OUT },
 
 };
 
@@ -50,6 +56,7 @@ static void printHelp()
 	printf("   -width w                Output width\n");
 	printf("   -height h               Output height\n");
 	printf("   -o, -out filename.flc   Output file. Default: %s\n", DEFAULT_OUTPUT_FILE);
+	printf("   -raw-out filename.spx   Write an uncompressed SPX file instead of a FLC\n");
 	printf("   -fps value              Output frame rate\n");
 	printf("   -bgcolor idx            Background color (palette index)\n");
 
@@ -60,6 +67,7 @@ static void printHelp()
 
 struct layer {
 	sprite_t *sprite;
+	blit_spans_t *spans;
 	int initial_x, initial_y;
 	int cur_x, cur_y;
 	int speed;
@@ -116,7 +124,6 @@ void blitLayers(sprite_t *dst)
 {
 	int i;
 	struct layer *l = layers;
-	spriterect_t dstrect;
 	int x, y;
 
 	// TODO : It is assumed that layers are larger than the canvas right now...
@@ -137,9 +144,7 @@ void blitLayers(sprite_t *dst)
 				if (g_verbose) {
 					printf("  Draw at %d\n", x);
 				}
-				dstrect.x = x;
-				dstrect.y = y;
-				sprite_copyRect(l->sprite, NULL, dst, &dstrect);
+				blit_spans(l->spans, dst, x, y);
 			}
 		}
 
@@ -173,12 +178,20 @@ int main(int argc, char **argv)
 	char *e;
 	const char *outfilename = DEFAULT_OUTPUT_FILE;
 	FlicFile *outflic = NULL;
+	const char *rawfilename = NULL;
+	spx_writer_t *rawout = NULL;
 	sprite_t *img = NULL;
 	int w = DEFAULT_W, h = DEFAULT_H;
 	int fps = 30;
 	int next_layer_speed = 0;
 	int frameno = 0;
 	int bgcolor = 0;
+	sprite_view_t view;
+	uint8_t *batch = NULL;
+	uint8_t *batch_pixels[FLIC_BATCH_FRAMES];
+	palette_t *batch_palettes[FLIC_BATCH_FRAMES];
+	int batch_count = 0;
+	int i;
 
 	while ((opt = getopt_long_only(argc, argv, "hvo:w:h:", long_options, NULL)) != -1) {
 		switch (opt) {
@@ -186,6 +199,7 @@ int main(int argc, char **argv)
 			case 'h': printHelp(); return 0;
 			case 'v': g_verbose = 1; break;
 			case 'o': outfilename = optarg; break;
+			case OPT_RAW_OUT: rawfilename = optarg; break;
 			case OPT_FPS:
 					fps = strtol(optarg, &e, 0);
 					if ((e == optarg)||(fps<1)) {
@@ -227,6 +241,12 @@ int main(int argc, char **argv)
 						fprintf(stderr, "Error loading layer from %s\n", optarg);
 						return -1;
 					}
+					// Layers are drawn many times, compile them to spans once.
+					sprite_getView(layers[num_layers].sprite, NULL, &view);
+					layers[num_layers].spans = blit_compileSpans(&view);
+					if (!layers[num_layers].spans) {
+						return -1;
+					}
 					num_layers++;
 					break;
 			case OPT_BGCOLOR:
@@ -252,19 +272,40 @@ int main(int argc, char **argv)
 	}
 
 	// all layers are expected to share the same palette at the moment
-	sprite_applyPalette(img, &layers[0].sprite->palette);
+	sprite_applyPalette(img, layers[0].sprite->palette);
 
-	outflic = flic_create(outfilename, w, h);
-	if (!outflic) {
-		fprintf(stderr, "could not create output flic\n");
-		return -1;
-	}
-	if (fps > 0) {
-		outflic->header.speed = 1000 / fps;
+	if (rawfilename) {
+		rawout = spx_create(rawfilename, w, h);
+		if (!rawout) {
+			return -1;
+		}
+		spx_setDelay(rawout, 1000 / fps);
+		outfilename = rawfilename;
+	} else {
+		outflic = flic_create(outfilename, w, h);
+		if (!outflic) {
+			fprintf(stderr, "could not create output flic\n");
+			return -1;
+		}
+		if (fps > 0) {
+			outflic->header.speed = 1000 / fps;
+		}
 	}
 
 	resetLayerPositions();
 
+	if (outflic) {
+		batch = malloc(FLIC_BATCH_FRAMES * w * h);
+		if (!batch) {
+			perror("malloc");
+			return -1;
+		}
+		for (i=0; i<FLIC_BATCH_FRAMES; i++) {
+			batch_pixels[i] = batch + i * w * h;
+			batch_palettes[i] = img->palette;
+		}
+	}
+
 	frameno = 0;
 	do {
 //		printf("Frame %d\n", frameno);
@@ -273,23 +314,46 @@ int main(int argc, char **argv)
 
 		sprite_fill(img, bgcolor);
 		blitLayers(img);
-		if (flic_appendFrame(outflic, img->pixels, &img->palette)) {
-			fprintf(stderr, "error writing flic frame\n");
-			return -1;
+		frameno++;
+
+		if (rawout) {
+			if (spx_appendFrame(rawout, img)) {
+				return -1;
+			}
+			continue;
 		}
 
-		frameno++;
+		memcpy(batch_pixels[batch_count], img->pixels, w * h);
+		batch_count++;
+		if ((batch_count == FLIC_BATCH_FRAMES) || allLayersInInitialPosition()) {
+			if (flic_appendFrames(outflic, batch_pixels, batch_palettes, batch_count, 0)) {
+				fprintf(stderr, "error writing flic frame\n");
+				return -1;
+			}
+			batch_count = 0;
+		}
 
 	} while (!allLayersInInitialPosition());
 
 	printf("Animation loop completed\n");
 	printf("Total %d frames\n", frameno);
 
-	flic_close(outflic);
+	if (rawout) {
+		if (spx_finish(rawout)) {
+			return -1;
+		}
+	} else {
+		flic_close(outflic);
+	}
 	printf("Wrote %s\n", outfilename);
 
 	freeSprite(img);
+	free(batch);
 
+	for (i=0; i<num_layers; i++) {
+		blit_freeSpans(layers[i].spans);
+		freeSprite(layers[i].sprite);
+	}
 
 	return 0;
 }
@@ -146,7 +146,7 @@ static int encoder_diffFrames(encoder_t *enc, int frame1, int frame2)
 // - Tiles would need to be added to the catalog (tiles_to_add)
 // - Cells would not need updating (matching_cells)
 //
-int encoder_tryAddFrame(encoder_t *enc, sprite_t *img, int *tiles_to_add, int *matching_cells)
+int encoder_tryAddFrame(encoder_t *enc, const sprite_view_t *img, int *tiles_to_add, int *matching_cells)
 {
 	tilemap_t *map;
 	int missing, match;
@@ -156,7 +156,7 @@ int encoder_tryAddFrame(encoder_t *enc, sprite_t *img, int *tiles_to_add, int *m
 		return -1;
 	}
 
-	missing = tilemap_populateFromCatalog(map, img, enc->catalog);
+	missing = tilemap_populateFromCatalogView(map, img, enc->catalog);
 
 	if (tiles_to_add)  {
 		*tiles_to_add = missing;
@@ -188,7 +188,7 @@ int encoder_panOptimize(encoder_t *enc, sprite_t *img)
 	int matching[PANX_SEARCHWIDTH*2+1];
 	int idx, pan, i;
 	int bestadd = 0, bestmatch;
-	sprite_t *panimg;
+	sprite_view_t panview;
 	int searchwidth = PANX_SEARCHWIDTH;
 	int searchstart = -PANX_SEARCHWIDTH;
 
@@ -200,49 +200,43 @@ int encoder_panOptimize(encoder_t *enc, sprite_t *img)
 		searchstart = -16; // enc->last_best_pan;
 	}
 
-	panimg = duplicateSprite(img);
-	if (panimg) {
-		sprite_panX(panimg, searchstart);
-
-		for (idx = 0, pan = searchstart; pan <= searchwidth; pan++,idx++) {
-			encoder_tryAddFrame(enc, panimg, &toadd[idx], &matching[idx]);
-			pans[idx] = pan;
-//			printf(" [idx %d] Evaluating pan %d : (new tiles: %d, tilemap matches: %d)\n", idx, pan, toadd[idx], matching[idx]);
-			sprite_panX(panimg, 1);
-		}
-
-		freeSprite(panimg);
+	for (idx = 0, pan = searchstart; pan <= searchwidth; pan++,idx++) {
+		// Same pixels as sprite_panX(img, pan) would give, without copying
+		sprite_getWrappedView(img, -pan, 0, img->w, img->h, &panview);
+		encoder_tryAddFrame(enc, &panview, &toadd[idx], &matching[idx]);
+		pans[idx] = pan;
+//		printf(" [idx %d] Evaluating pan %d : (new tiles: %d, tilemap matches: %d)\n", idx, pan, toadd[idx], matching[idx]);
+	}
 
-		// 1. Find the lowest count of missing (to add) tiles
-		for (i=0; i<idx; i++) {
-			if (i==0) {
+	// 1. Find the lowest count of missing (to add) tiles
+	for (i=0; i<idx; i++) {
+		if (i==0) {
+			bestadd = toadd[i];
+		} else {
+			if (toadd[i] < bestadd) {
 				bestadd = toadd[i];
-			} else {
-				if (toadd[i] < bestadd) {
-					bestadd = toadd[i];
-				}
 			}
 		}
+	}
 
-		// 2. If there are multiple pan values which results
-		// in a same number of missing tiles, select the one
-		// needing the least pattern table updates
-		for (bestmatch=0,i=0; i<idx; i++) {
-			if (toadd[i] == bestadd) {
-				if (matching[i] > bestmatch) {
-					bestmatch = matching[i];
-					bestpan = pans[i];
-				}
+	// 2. If there are multiple pan values which results
+	// in a same number of missing tiles, select the one
+	// needing the least pattern table updates
+	for (bestmatch=0,i=0; i<idx; i++) {
+		if (toadd[i] == bestadd) {
+			if (matching[i] > bestmatch) {
+				bestmatch = matching[i];
+				bestpan = pans[i];
 			}
 		}
-
-		printf("Ideal pan value: %d (new tiles: %d, tilemmap matches: %d)\n", bestpan, bestadd, bestmatch);
-/*		if (bestadd > 200) {
-			fprintf(stderr, "Too many tiles to update\n");
-			exit(1);
-		}*/
 	}
 
+	printf("Ideal pan value: %d (new tiles: %d, tilemmap matches: %d)\n", bestpan, bestadd, bestmatch);
+/*	if (bestadd > 200) {
+		fprintf(stderr, "Too many tiles to update\n");
+		exit(1);
+	}*/
+
 	enc->last_best_pan = bestpan;
 
 	return bestpan;
@@ -536,6 +530,7 @@ static void encodeFrame(encoder_t *enc, int frame)
 	int i;
 	uint32_t tid;
 	uint16_t smstile;
+	palette_t *pal;
 
 	struct tileUseEntry *ent;
 	int usecount;
@@ -552,8 +547,12 @@ static void encodeFrame(encoder_t *enc, int frame)
 
 	if (frame == 0) {
 		if (enc->funcs->updatePalette) {
-			enc->frames[0].img->palette.count = 16;
-			enc->funcs->updatePalette(&enc->frames[0].img->palette, enc->ctx);
+			// The palette may be shared with other frames
+			pal = sprite_editPalette(enc->frames[0].img);
+			if (pal) {
+				pal->count = 16;
+				enc->funcs->updatePalette(pal, enc->ctx);
+			}
 		}
 	}
 
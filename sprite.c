@@ -4,12 +4,15 @@
 #include <png.h>
 #include "sprite.h"
 #include "globals.h"
+#include "blit.h"
+#include "spx.h"
+#include "pngopts.h"
+#include "threadpool.h"
+#include "pixconv.h"
 #ifdef WITH_GIF_SUPPORT
 #include "gif_lib.h"
 #endif
 
-static jmp_buf jmpbuf;
-
 sprite_t *allocSprite(uint16_t w, uint16_t h, uint16_t palsize, uint8_t flags)
 {
 	sprite_t *spr;
@@ -27,27 +30,56 @@ sprite_t *allocSprite(uint16_t w, uint16_t h, uint16_t palsize, uint8_t flags)
 		return NULL;
 	}
 
-	spr->mask = calloc(1, w*h);
-	if (!spr->mask) {
-		perror("Could not allocate mask");
+	spr->palette = palette_new();
+	if (!spr->palette) {
 		free(spr->pixels);
 		free(spr);
 		return NULL;
 	}
 
+	// The mask is allocated on first use (see sprite_setPixelMask)
+
 	spr->w = w;
 	spr->h = h;
-	spr->palette.count = palsize;
+	spr->palette->count = palsize;
 	spr->flags = flags;
 
 	return spr;
 }
 
+sprite_t *allocSpriteInArena(struct arena *arena, uint16_t w, uint16_t h, uint16_t palsize, uint8_t flags)
+{
+	sprite_t *spr;
+
+	spr = arena_alloc(arena, sizeof(sprite_t));
+	if (!spr) {
+		return NULL;
+	}
+
+	spr->pixels = arena_alloc(arena, w*h);
+	if (!spr->pixels) {
+		return NULL;
+	}
+
+	spr->palette = palette_new();
+	if (!spr->palette) {
+		return NULL;
+	}
+
+	spr->w = w;
+	spr->h = h;
+	spr->palette->count = palsize;
+	spr->flags = flags;
+	spr->storage = SPRITE_STORAGE_ARENA;
+
+	return spr;
+}
+
 sprite_t *duplicateSprite(const sprite_t *spr)
 {
 	sprite_t *s;
 
-	s = allocSprite(spr->w, spr->h, spr->palette.count, 0);
+	s = allocSprite(spr->w, spr->h, spr->palette->count, 0);
 	if (!s)
 		return NULL;
 
@@ -62,15 +94,16 @@ sprite_t *duplicateSprite(const sprite_t *spr)
 // Set the mask to 1 (transparent) for pixels of a particular color.
 void spriteUpdateTransparent(sprite_t *spr, uint8_t id)
 {
-	int i, size = spr->w * spr->h;
-	uint8_t *pixel = spr->pixels, *mask = spr->mask;
+	int x, y;
+	uint8_t *pixel = spr->pixels;
 
-	for (i=0; i<size; i++) {
-		if (*pixel == id) {
-			*mask = 0xff;
+	for (y=0; y<spr->h; y++) {
+		for (x=0; x<spr->w; x++) {
+			if (*pixel == id) {
+				sprite_setPixelMask(spr, x, y, 0xff);
+			}
+			pixel++;
 		}
-		pixel++;
-		mask++;
 	}
 }
 
@@ -85,15 +118,20 @@ int spriteDeleteColor(sprite_t *spr, uint8_t id)
 {
 	uint8_t *pix = spr->pixels;
 	int size = spr->w * spr->h, i;
+	palette_t *pal;
 
 	if (id > 0) {
 		fprintf(stderr, "Error: Removing non-zero color not implemented\n");
 		return -1;
 	} else {
-		memmove(spr->palette.colors,
-				spr->palette.colors + 1,
-				sizeof(palent_t) * (spr->palette.count - 1));
-		spr->palette.count--;
+		pal = sprite_editPalette(spr);
+		if (!pal) {
+			return -1;
+		}
+		memmove(pal->colors,
+				pal->colors + 1,
+				sizeof(palent_t) * (pal->count - 1));
+		pal->count--;
 	}
 
 	for (i=0; i<size; i++) {
@@ -109,9 +147,19 @@ int spriteDeleteColor(sprite_t *spr, uint8_t id)
 void freeSprite(sprite_t *spr)
 {
 	if (spr) {
-		if (spr->mask) {
+		if (spr->mask && !spx_mapContains(spr->map, spr->mask)) {
 			free(spr->mask);
 		}
+		palette_unref(spr->palette);
+		if (spr->storage == SPRITE_STORAGE_ARENA) {
+			// the rest goes away with the arena
+			return;
+		}
+		if (spr->storage == SPRITE_STORAGE_MAPPED) {
+			spx_unrefMap(spr->map);
+			free(spr);
+			return;
+		}
 		if (spr->pixels) {
 			free(spr->pixels);
 		}
@@ -121,24 +169,23 @@ void freeSprite(sprite_t *spr)
 
 void printSprite(sprite_t *spr)
 {
-	int i, y;
-	uint8_t *pix, *mask;
+	int i, y, mask;
+	uint8_t *pix;
 	printf("Sprite size: %d x %d\n", spr->w, spr->h);
-	printf("Palette colors: %d\n", spr->palette.count);
+	printf("Palette colors: %d\n", spr->palette->count);
 	printf("Palette: ");
-	palette_print(&spr->palette);
+	palette_print(spr->palette);
 
 	pix = spr->pixels;
-	mask = spr->mask;
 	for (y=0; y<spr->h; y++) {
 		for (i=0; i<spr->w; i++) {
-			if (*mask == 0xff) {
+			mask = sprite_getPixelMask(spr, i, y);
+			if (mask == 0xff) {
 				printf("...");
 			} else {
-				printf("%02x ", *pix & (0xff^*mask));
+				printf("%02x ", *pix & (0xff^mask));
 				//printf("*");
 			}
-			mask++;
 			pix++;
 		}
 		printf("\n");
@@ -150,10 +197,15 @@ static void writepng_error_handler(png_structp png_ptr, png_const_charp msg)
 	fprintf(stderr, "writepng libpng error: %s\n", msg);
 	fflush(stderr);
 
-	longjmp(jmpbuf, 1);
+	png_longjmp(png_ptr, 1);
 }
 
 int sprite_savePNG(const char *out_filename, sprite_t *spr, uint32_t flags)
+{
+	return sprite_savePNGOpts(out_filename, spr, flags, &g_png_saveopts);
+}
+
+int sprite_savePNGOpts(const char *out_filename, sprite_t *spr, uint32_t flags, const png_saveopts_t *opts)
 {
 	png_structp  png_ptr;
 	png_infop  info_ptr;
@@ -165,10 +217,10 @@ int sprite_savePNG(const char *out_filename, sprite_t *spr, uint32_t flags)
 	FILE *fptr;
 
 	// Copy sprite palette to png_color array
-	for (i=0; i<spr->palette.count; i++) {
-		palette[i].red = spr->palette.colors[i].r;
-		palette[i].green = spr->palette.colors[i].g;
-		palette[i].blue = spr->palette.colors[i].b;
+	for (i=0; i<spr->palette->count; i++) {
+		palette[i].red = spr->palette->colors[i].r;
+		palette[i].green = spr->palette->colors[i].g;
+		palette[i].blue = spr->palette->colors[i].b;
 	}
 
 	fptr = fopen(out_filename, "wb");
@@ -190,17 +242,20 @@ int sprite_savePNG(const char *out_filename, sprite_t *spr, uint32_t flags)
 		return 4;
 	}
 
-	if (setjmp(jmpbuf)) {
+	// png_jmpbuf rather than a static jmp_buf: sprites may be saved
+	// from several threads (see sprite_savePNGBatch)
+	if (setjmp(png_jmpbuf(png_ptr))) {
 		png_destroy_write_struct(&png_ptr, &info_ptr);
 		fclose(fptr);
 		return 2;
 	}
 
 	png_init_io(png_ptr, fptr);
+	pngopts_apply(png_ptr, opts);
 
 	png_set_IHDR(png_ptr, info_ptr, w, h, 8, color_type, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
-	png_set_PLTE(png_ptr, info_ptr, palette, spr->palette.count);
+	png_set_PLTE(png_ptr, info_ptr, palette, spr->palette->count);
 	if (spr->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR) {
 		png_byte trans = spr->transparent_color;
 		png_set_tRNS(png_ptr, info_ptr, &trans, 1, NULL);
@@ -226,6 +281,65 @@ int sprite_savePNG(const char *out_filename, sprite_t *spr, uint32_t flags)
 
 }
 
+struct savejob {
+	const char *filename;
+	sprite_t *sprite;
+	const png_saveopts_t *opts;
+	int result;
+};
+
+static void savePNGJob(void *arg)
+{
+	struct savejob *job = arg;
+
+	job->result = sprite_savePNGOpts(job->filename, job->sprite, 0, job->opts);
+}
+
+int sprite_savePNGBatch(int count, const char * const *filenames, sprite_t * const *sprites, const png_saveopts_t *opts, int threads)
+{
+	struct threadpool *pool;
+	struct savejob *jobs;
+	int i, res = 0;
+
+	if (count == 1) {
+		return sprite_savePNGOpts(filenames[0], sprites[0], 0, opts) ? -1 : 0;
+	}
+
+	jobs = calloc(count, sizeof(struct savejob));
+	if (!jobs) {
+		perror("calloc");
+		return -1;
+	}
+
+	pool = threadpool_create(threads);
+	if (!pool) {
+		free(jobs);
+		return -1;
+	}
+
+	for (i=0; i<count; i++) {
+		jobs[i].filename = filenames[i];
+		jobs[i].sprite = sprites[i];
+		jobs[i].opts = opts;
+		if (threadpool_add(pool, savePNGJob, &jobs[i])) {
+			jobs[i].result = -1;
+		}
+	}
+
+	threadpool_free(pool);
+
+	for (i=0; i<count; i++) {
+		if (jobs[i].result) {
+			fprintf(stderr, "Error writing %s\n", filenames[i]);
+			res = -1;
+		}
+	}
+
+	free(jobs);
+
+	return res;
+}
+
 sprite_t *sprite_loadPNG(const char *in_filename, int n_expected_colors, uint32_t flags)
 {
 	png_structp png_ptr;
@@ -325,9 +439,10 @@ sprite_t *sprite_loadPNG(const char *in_filename, int n_expected_colors, uint32_
 	// copy palette
 	for (i=0; i<num_palette; i++)
 	{
-		spr->palette.colors[i].r = palette[i].red;
-		spr->palette.colors[i].g = palette[i].green;
-		spr->palette.colors[i].b = palette[i].blue;
+		// freshly allocated, not shared yet
+		spr->palette->colors[i].r = palette[i].red;
+		spr->palette->colors[i].g = palette[i].green;
+		spr->palette->colors[i].b = palette[i].blue;
 	}
 
 	if (g_verbose) {
@@ -354,7 +469,7 @@ sprite_t *sprite_loadPNG(const char *in_filename, int n_expected_colors, uint32_
 				printf("Dropping transparent color(s)...\n");
 			}
 			// drop transparent colors from palette and pixel data
-			if ((n_expected_colors == 0) || ((n_expected_colors != 0) && (spr->palette.count != n_expected_colors))) {
+			if ((n_expected_colors == 0) || ((n_expected_colors != 0) && (spr->palette->count != n_expected_colors))) {
 				for (i=0; i<num_trans; i++) {
 					spriteDeleteColor(spr, trans[i]);
 				}
@@ -371,8 +486,8 @@ sprite_t *sprite_loadPNG(const char *in_filename, int n_expected_colors, uint32_
 	}
 
 	if (n_expected_colors != 0) {
-		if (spr->palette.count != n_expected_colors) {
-			fprintf(stderr, "Expected %d colors but found %d\n", n_expected_colors, spr->palette.count);
+		if (spr->palette->count != n_expected_colors) {
+			fprintf(stderr, "Expected %d colors but found %d\n", n_expected_colors, spr->palette->count);
 			goto error;
 		}
 	}
@@ -434,7 +549,7 @@ sprite_t *sprite_loadGIF(const char *in_filename, int n_expected_colors, uint32_
 	// Copy colormap
 	color = gf->SColorMap->Colors;
 	for (i=0; i<gf->SColorMap->ColorCount; i++,color++) {
-		palette_setColor(&sprite->palette, i, color->Red, color->Green, color->Blue);
+		palette_setColor(sprite->palette, i, color->Red, color->Green, color->Blue);
 	}
 
 	// Set background color
@@ -467,10 +582,67 @@ error:
 }
 #endif
 
+sprite_t *sprite_loadSPX(const char *in_filename, int n_expected_colors, uint32_t flags)
+{
+	spx_file_t *spx;
+	sprite_t *spr;
+
+	spx = spx_open(in_filename);
+	if (!spx) {
+		return NULL;
+	}
+
+	spr = spx_getFrame(spx, 0);
+	spx_close(spx);
+	if (!spr) {
+		return NULL;
+	}
+
+	if ((flags & SPRITE_LOADFLAG_DROP_TRANSPARENT) && (spr->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR)) {
+		// same as for PNG files with a transparent color
+		spriteUpdateTransparent(spr, spr->transparent_color);
+		if ((n_expected_colors == 0) || (spr->palette->count != n_expected_colors)) {
+			spriteDeleteColor(spr, spr->transparent_color);
+		}
+		spr->flags &= ~SPRITE_FLAG_USE_TRANSPARENT_COLOR;
+	}
+
+	if (n_expected_colors != 0) {
+		if (spr->palette->count != n_expected_colors) {
+			fprintf(stderr, "Expected %d colors but found %d\n", n_expected_colors, spr->palette->count);
+			freeSprite(spr);
+			return NULL;
+		}
+	}
+
+	return spr;
+}
+
+int sprite_saveSPX(const char *out_filename, const sprite_t *spr)
+{
+	spx_writer_t *wr;
+
+	wr = spx_create(out_filename, spr->w, spr->h);
+	if (!wr) {
+		return -1;
+	}
+
+	if (spx_appendFrame(wr, spr)) {
+		spx_finish(wr);
+		return -1;
+	}
+
+	return spx_finish(wr);
+}
+
 sprite_t *sprite_load(const char *in_filename, int n_expected_colors, uint32_t flags)
 {
 	sprite_t *spr;
 
+	if (isSpxFile(in_filename)) {
+		return sprite_loadSPX(in_filename, n_expected_colors, flags);
+	}
+
 	spr = sprite_loadPNG(in_filename, n_expected_colors, flags);
 	if (spr)
 		return spr;
@@ -484,6 +656,17 @@ sprite_t *sprite_load(const char *in_filename, int n_expected_colors, uint32_t f
 	return NULL;
 }
 
+int sprite_save(const char *out_filename, sprite_t *spr, uint32_t flags)
+{
+	const char *ext = strrchr(out_filename, '.');
+
+	if (ext && (0 == strcasecmp(ext, ".spx"))) {
+		return sprite_saveSPX(out_filename, spr);
+	}
+
+	return sprite_savePNG(out_filename, spr, flags);
+}
+
 void sprite_setPixelSafe(sprite_t *spr, int x, int y, int value)
 {
 	if (x >= spr->w)
@@ -510,27 +693,11 @@ int sprite_getPixel(const sprite_t *spr, int x, int y)
 
 int sprite_getPixels8x8(const sprite_t *spr, int x, int y, uint8_t *dst)
 {
-	int Y,X;
-	uint8_t *src;
-
-	if ( ((x + 8) <= spr->w) && ((y + 8) <= spr->h)) {
+	sprite_view_t view;
 
-		src = spr->pixels + y * spr->w + x;
-		for (Y=0; Y<8; Y++) {
-			memcpy(dst, src, 8);
-			dst += 8;
-			src += spr->w;
-		}
-		return 0;
-	}
+	sprite_getView(spr, NULL, &view);
 
-	for (Y=0; Y<8; Y++) {
-		for (X=0; X<8; X++) {
-			*dst = sprite_getPixelSafeExtend(spr, x + X, y + Y);
-			dst++;
-		}
-	}
-	return 0;
+	return sprite_viewGetPixels8x8(&view, x, y, dst);
 }
 
 int sprite_getPixelSafe(const sprite_t *spr, int x, int y)
@@ -564,32 +731,64 @@ int sprite_getPixelSafeExtend(const sprite_t *spr, int x, int y)
 
 void sprite_setPixelMaskSafe(sprite_t *spr, int x, int y, int value)
 {
+	if ((x < 0) || (y < 0))
+		return;
 	if (x >= spr->w)
 		return;
 	if (y >= spr->h)
 		return;
 
-	spr->mask[y * spr->w + x] = value;
+	sprite_setPixelMask(spr, x, y, value);
 }
 
 int sprite_getPixelMaskSafe(const sprite_t *spr, int x, int y)
 {
+	if ((x < 0) || (y < 0))
+		return 0;
 	if (x >= spr->w)
 		return 0;
 	if (y >= spr->h)
 		return 0;
 
-	return spr->mask[y * spr->w + x];
+	return sprite_getPixelMask(spr, x, y);
 }
 
+// Any non-zero value marks the pixel as transparent
 void sprite_setPixelMask(sprite_t *spr, int x, int y, int value)
 {
-	spr->mask[y * spr->w + x] = value;
+	uint32_t *word;
+
+	if (!spr->mask) {
+		if (!value) {
+			return; // no mask means nothing is masked
+		}
+		spr->mask = calloc(SPRITE_MASK_PITCH(spr->w) * spr->h, sizeof(uint32_t));
+		if (!spr->mask) {
+			perror("Could not allocate mask");
+			return;
+		}
+	}
+
+	word = spr->mask + y * SPRITE_MASK_PITCH(spr->w) + (x >> 5);
+	if (value) {
+		*word |= 1u << (x & 31);
+	} else {
+		*word &= ~(1u << (x & 31));
+	}
 }
 
+// Returns 0xff for masked pixels, 0 otherwise
 int sprite_getPixelMask(const sprite_t *spr, int x, int y)
 {
-	return spr->mask[y * spr->w + x];
+	if (!spr->mask) {
+		return 0;
+	}
+
+	if (spr->mask[y * SPRITE_MASK_PITCH(spr->w) + (x >> 5)] & (1u << (x & 31))) {
+		return 0xff;
+	}
+
+	return 0;
 }
 
 int sprite_pixelIsOpaque(const sprite_t *spr, int x, int y)
@@ -603,16 +802,49 @@ int sprite_pixelIsOpaque(const sprite_t *spr, int x, int y)
 
 int sprite_copyPalette(const sprite_t *spr_src, sprite_t *spr_dst)
 {
-	memcpy(&spr_dst->palette, &spr_src->palette, sizeof(palette_t));
+	sprite_applyPalette(spr_dst, spr_src->palette);
 	return 0;
 }
 
 /**
  * Change the sprite palette without touching the pixels.
+ *
+ * Heap palettes (refcount > 0) are shared, others are copied.
  */
 void sprite_applyPalette(sprite_t *sprite, const palette_t *newpal)
 {
-	memcpy(&sprite->palette, newpal, sizeof(palette_t));
+	palette_t *pal;
+
+	if (newpal == sprite->palette)
+		return;
+
+	pal = palette_ref(newpal);
+	if (!pal)
+		return;
+
+	palette_unref(sprite->palette);
+	sprite->palette = pal;
+}
+
+/**
+ * Get a palette that can be modified without affecting other sprites.
+ *
+ * The palette is copied first if it is shared.
+ */
+palette_t *sprite_editPalette(sprite_t *sprite)
+{
+	palette_t *pal;
+
+	if (sprite->palette->refcount > 1) {
+		pal = palette_new();
+		if (!pal)
+			return NULL;
+		palette_copy(pal, sprite->palette);
+		palette_unref(sprite->palette);
+		sprite->palette = pal;
+	}
+
+	return sprite->palette;
 }
 
 /**
@@ -622,73 +854,71 @@ void sprite_applyPalette(sprite_t *sprite, const palette_t *newpal)
  */
 int sprite_remapPalette(sprite_t *sprite, const palette_t *dstpal)
 {
-	int y, x;
 	palremap_lut_t remap_lut;
 
-	if (palette_generateRemap(&sprite->palette, dstpal, &remap_lut) < 0) {
+	if (palette_generateRemap(sprite->palette, dstpal, &remap_lut) < 0) {
 		return -1;
 	}
 
 	sprite_applyPalette(sprite, dstpal);
-
-	for (y=0; y<sprite->h; y++) {
-		for (x=0; x<sprite->w; x++) {
-			int c;
-			c = sprite_getPixel(sprite, x, y);
-			sprite_setPixel(sprite, x, y, remap_lut.lut[c]);
-		}
-	}
+	sprite_remapPixels(sprite, &remap_lut);
 
 	return 0;
 }
 
+/**
+ * Replace each pixel value by its entry in the lookup table. The palette is left as is.
+ */
+void sprite_remapPixels(sprite_t *sprite, const palremap_lut_t *remap_lut)
+{
+	int i;
+
+	for (i=0; i<sprite->w * sprite->h; i++) {
+		sprite->pixels[i] = remap_lut->lut[sprite->pixels[i]];
+	}
+}
+
 sprite_t *sprite_packPixels(const sprite_t *spr, int bits_per_pixel)
 {
 	sprite_t *packedSprite;
-	int source_pixels[8];
-	int source_mask[8];
+	uint8_t *row;
 	int pixels_per_byte = 8/bits_per_pixel;
 	int buf_w = spr->w / pixels_per_byte;
-	uint8_t pixmask = 0xff >> (8-bits_per_pixel);
-	int x,y,i;
-	uint8_t pack, packed_mask;
+	int x,y;
 
 	printf("Input width: %d, packed output width: %d\n", spr->w, buf_w);
 	printf("Bits per pixel: %d\n", bits_per_pixel);
 	printf("Pixels per byte: %d\n", pixels_per_byte);
 
 	// Pack the the sprite pixels
-	packedSprite = allocSprite(buf_w, spr->h, spr->palette.count, 0);
+	packedSprite = allocSprite(buf_w, spr->h, spr->palette->count, 0);
 	if (!packedSprite)
 		return NULL;
 
+	row = malloc(spr->w);
+	if (!row) {
+		perror("Could not allocate row buffer");
+		freeSprite(packedSprite);
+		return NULL;
+	}
+
 	for (y=0; y<spr->h; y++) {
-		for (x=0; x<spr->w; x+=pixels_per_byte) {
-			// Get source pixels to pack
-			for (i=0; i<pixels_per_byte; i++) {
-				source_pixels[i] = sprite_getPixel(spr, x+i, y);
-				source_mask[i] = sprite_getPixelMask(spr, x+i, y);
-			}
+		memcpy(row, spr->pixels + y * spr->w, spr->w);
 
-			// Pack them in one byte
-			for (pack=0,packed_mask=0,i=0; i<pixels_per_byte; i++) {
-				pack <<= bits_per_pixel;
-				pack |= source_pixels[i] & pixmask;
-				packed_mask <<= bits_per_pixel;
-				packed_mask |= source_mask[i] & pixmask;
+		// pre-apply mask (so tranparent pixels are zero. Assumed later.
+		if (spr->mask) {
+			for (x=0; x<spr->w; x++) {
+				if (sprite_getPixelMask(spr, x, y)) {
+					row[x] = 0;
+				}
 			}
-
-			// write to output
-			sprite_setPixel(packedSprite, x/pixels_per_byte, y, pack);
-			sprite_setPixelMask(packedSprite, x/pixels_per_byte, y, packed_mask);
 		}
-	}
 
-	// pre-apply mask to all pixels (so tranparent pixles are zero. Assumed later.
-	for (i=0; i<packedSprite->w * packedSprite->h; i++) {
-		packedSprite->pixels[i] = packedSprite->pixels[i] & (packedSprite->mask[i] ^ 0xff);
+		pixconv_pack(packedSprite->pixels + y * buf_w, row, buf_w * pixels_per_byte, bits_per_pixel);
 	}
 
+	free(row);
+
 	sprite_copyPalette(spr, packedSprite);
 
 	return packedSprite;
@@ -708,84 +938,11 @@ void sprite_getFullRect(const sprite_t *sprite, spriterect_t *dst)
 // NULL src means full surface
 int sprite_copyRect(const sprite_t *src, const spriterect_t *src_rect, sprite_t *dst, const spriterect_t *dst_rect)
 {
-	int x,y,w,h,src_x,src_y,dst_x,dst_y;
-	uint8_t pixel;
-
-	if (src_rect) {
-		src_x = src_rect->x;
-		src_y = src_rect->y;
-		w = src_rect->w;
-		h = src_rect->h;
-	} else {
-		src_x = 0;
-		src_y = 0;
-		w = src->w;
-		h = src->h;
-	}
-
-	if (dst_rect) {
-		dst_x = dst_rect->x;
-		dst_y = dst_rect->y;
-	} else {
-		dst_x = 0;
-		dst_y = 0;
-	}
-
-//	printf("Before clipping %d,%d -> %d,%d [%d x %d]\n", src_x, src_y, dst_x, dst_y, w, h);
-
-	// Validate/trim the destination
-	if (dst_x + w > dst->w) { w -= (dst_x + w)-dst->w; }
-	if (dst_y + h > dst->h) { h -= (dst_y + h)-dst->h; }
-	if (dst_x < 0) { w += dst_x; src_x += -dst_x; dst_x = 0; }
-	if (dst_y < 0) { h += dst_y; src_y += -dst_y; dst_y = 0; }
-	if ((w <= 0) || (h <= 0)) { return -1; }
-
-	if (src_x + w > src->w) { w -= (src_x + w)-src->w; }
-	if (src_y + h > src->h) { h -= (src_y + h)-src->h; }
-	if (src_x < 0) { w += src_x; dst_x += -src_x; src_x = 0; }
-	if (src_y < 0) { h += src_y; dst_y += -src_y; src_y = 0; }
-	if ((w <= 0) || (h <= 0)) { return -1; }
-
-//	printf("After clipping %d,%d -> %d,%d [%d x %d]\n", src_x, src_y, dst_x, dst_y, w, h);
-
-//	printf("Copyrect loop: %d x %d\n", w,h);
-
-	// Note: This really is not optimised!
+	sprite_view_t view;
 
-	if (src->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR)
-	{
-		// Blitting with a transparent color source
-		for (y=0; y<h; y++) {
-			for (x=0; x<w; x++) {
-				pixel = sprite_getPixel(src, x + src_x, y + src_y);
-				if (pixel == src->transparent_color)
-					continue;
-				sprite_setPixel(dst, x + dst_x, y + dst_y, pixel);
-			}
-		}
-	}
-	else if (src->flags & SPRITE_FLAG_OPAQUE)
-	{
-		// Blitting from fully opaque sprite
-		for (y=0; y<h; y++) {
-			for (x=0; x<w; x++) {
-				pixel = sprite_getPixel(src, x + src_x, y + src_y);
-				sprite_setPixel(dst, x + dst_x, y + dst_y, pixel);
-			}
-		}
-	} else {
-		// Blitting using mask
-		for (y=0; y<h; y++) {
-			for (x=0; x<w; x++) {
-				if (!sprite_getPixelMask(src, x + src_x, y + src_y)) {
-					pixel = sprite_getPixel(src, x + src_x, y + src_y);
-					sprite_setPixel(dst, x + dst_x, y + dst_y, pixel);
-				}
-			}
-		}
-	}
+	sprite_getView(src, NULL, &view);
 
-	return 0;
+	return sprite_copyRectFromView(&view, src_rect, dst, dst_rect);
 }
 
 void sprite_fill(struct sprite *spr, int color)
@@ -795,14 +952,17 @@ void sprite_fill(struct sprite *spr, int color)
 
 int sprite_fillRect(struct sprite *spr, int x, int y, int w, int h, int color)
 {
-	int X,Y;
+	int Y;
 
-	// lazy low performance implementation
-	for (Y=0; Y<h; Y++)
-	{
-		for (X=0; X<w; X++) {
-			sprite_setPixelSafe(spr, x+X, y+Y, color);
-		}
+	// Clip to the sprite area
+	if (x < 0) { w += x; x = 0; }
+	if (y < 0) { h += y; y = 0; }
+	if (x + w > spr->w) { w = spr->w - x; }
+	if (y + h > spr->h) { h = spr->h - y; }
+	if ((w <= 0) || (h <= 0)) { return 0; }
+
+	for (Y=0; Y<h; Y++) {
+		blit_rowFill(spr->pixels + (y + Y) * spr->w + x, color, w);
 	}
 
 	return 0;
@@ -873,3 +1033,198 @@ int sprite_panX(struct sprite *spr, int pan)
 	return 0;
 }
 
+
+int sprite_getView(const sprite_t *spr, const spriterect_t *rect, sprite_view_t *view)
+{
+	int x = 0, y = 0, w = spr->w, h = spr->h;
+
+	if (rect) {
+		x = rect->x;
+		y = rect->y;
+		w = rect->w;
+		h = rect->h;
+
+		if (x < 0) { w += x; x = 0; }
+		if (y < 0) { h += y; y = 0; }
+		if (x + w > spr->w) { w = spr->w - x; }
+		if (y + h > spr->h) { h = spr->h - y; }
+		if (w < 0) { w = 0; }
+		if (h < 0) { h = 0; }
+	}
+
+	memset(view, 0, sizeof(sprite_view_t));
+	view->pixels = spr->pixels + y * spr->w + x;
+	view->mask = spr->mask ? spr->mask + y * SPRITE_MASK_PITCH(spr->w) : NULL;
+	view->mask_pitch = SPRITE_MASK_PITCH(spr->w);
+	view->mask_x = x;
+	view->pitch = spr->w;
+	view->w = w;
+	view->h = h;
+	view->palette = spr->palette;
+	view->transparent_color = spr->transparent_color;
+	view->flags = spr->flags;
+
+	if ((w == 0) || (h == 0)) {
+		return -1;
+	}
+
+	return 0;
+}
+
+void sprite_getWrappedView(const sprite_t *spr, int x, int y, int w, int h, sprite_view_t *view)
+{
+	sprite_getView(spr, NULL, view);
+
+	view->w = w;
+	view->h = h;
+	view->wrap_w = spr->w;
+	view->wrap_h = spr->h;
+	view->wrap_x = x % spr->w;
+	view->wrap_y = y % spr->h;
+	if (view->wrap_x < 0) { view->wrap_x += spr->w; }
+	if (view->wrap_y < 0) { view->wrap_y += spr->h; }
+}
+
+// Convert view coordinates to coordinates relative to view->pixels (only
+// different for wrapped views). x and y must not be negative.
+static inline void view_position(const sprite_view_t *view, int *x, int *y)
+{
+	if (view->wrap_w) {
+		*x = (view->wrap_x + *x) % view->wrap_w;
+		*y = (view->wrap_y + *y) % view->wrap_h;
+	}
+}
+
+// Position of view pixel x,y relative to view->pixels.
+static inline int view_offset(const sprite_view_t *view, int x, int y)
+{
+	view_position(view, &x, &y);
+	return y * view->pitch + x;
+}
+
+// Number of contiguous pixels starting at column x, up to count.
+static inline int view_runLength(const sprite_view_t *view, int x, int count)
+{
+	int avail;
+
+	if (view->wrap_w) {
+		avail = view->wrap_w - (view->wrap_x + x) % view->wrap_w;
+		if (avail < count) {
+			return avail;
+		}
+	}
+	return count;
+}
+
+int sprite_viewGetPixel(const sprite_view_t *view, int x, int y)
+{
+	return view->pixels[view_offset(view, x, y)];
+}
+
+int sprite_viewGetPixelSafeExtend(const sprite_view_t *view, int x, int y)
+{
+	if (x < 0)
+		x = 0;
+	if (y < 0)
+		y = 0;
+	if (x >= view->w)
+		x = view->w-1;
+	if (y >= view->h)
+		y = view->h-1;
+
+	return view->pixels[view_offset(view, x, y)];
+}
+
+int sprite_viewGetPixels8x8(const sprite_view_t *view, int x, int y, uint8_t *dst)
+{
+	int Y,X;
+
+	if ( (x >= 0) && (y >= 0) && ((x + 8) <= view->w) && ((y + 8) <= view->h) &&
+			(view_runLength(view, x, 8) == 8)) {
+
+		for (Y=0; Y<8; Y++) {
+			memcpy(dst, view->pixels + view_offset(view, x, y + Y), 8);
+			dst += 8;
+		}
+		return 0;
+	}
+
+	for (Y=0; Y<8; Y++) {
+		for (X=0; X<8; X++) {
+			*dst = sprite_viewGetPixelSafeExtend(view, x + X, y + Y);
+			dst++;
+		}
+	}
+	return 0;
+}
+
+// NULL src_rect means the full view
+int sprite_copyRectFromView(const sprite_view_t *src, const spriterect_t *src_rect, sprite_t *dst, const spriterect_t *dst_rect)
+{
+	int y,x,w,h,n,px,py,src_x,src_y,dst_x,dst_y;
+	const uint8_t *srcpix;
+	uint8_t *dstrow;
+
+	if (src_rect) {
+		src_x = src_rect->x;
+		src_y = src_rect->y;
+		w = src_rect->w;
+		h = src_rect->h;
+	} else {
+		src_x = 0;
+		src_y = 0;
+		w = src->w;
+		h = src->h;
+	}
+
+	if (dst_rect) {
+		dst_x = dst_rect->x;
+		dst_y = dst_rect->y;
+	} else {
+		dst_x = 0;
+		dst_y = 0;
+	}
+
+//	printf("Before clipping %d,%d -> %d,%d [%d x %d]\n", src_x, src_y, dst_x, dst_y, w, h);
+
+	// Validate/trim the destination
+	if (dst_x + w > dst->w) { w -= (dst_x + w)-dst->w; }
+	if (dst_y + h > dst->h) { h -= (dst_y + h)-dst->h; }
+	if (dst_x < 0) { w += dst_x; src_x += -dst_x; dst_x = 0; }
+	if (dst_y < 0) { h += dst_y; src_y += -dst_y; dst_y = 0; }
+	if ((w <= 0) || (h <= 0)) { return -1; }
+
+	if (src_x + w > src->w) { w -= (src_x + w)-src->w; }
+	if (src_y + h > src->h) { h -= (src_y + h)-src->h; }
+	if (src_x < 0) { w += src_x; dst_x += -src_x; src_x = 0; }
+	if (src_y < 0) { h += src_y; dst_y += -src_y; src_y = 0; }
+	if ((w <= 0) || (h <= 0)) { return -1; }
+
+//	printf("After clipping %d,%d -> %d,%d [%d x %d]\n", src_x, src_y, dst_x, dst_y, w, h);
+
+	dstrow = dst->pixels + dst_y * dst->w + dst_x;
+
+	for (y=0; y<h; y++, dstrow += dst->w) {
+		// Rows of wrapped views may have to be copied in two parts
+		for (x=0; x<w; x+=n) {
+			n = view_runLength(src, src_x + x, w - x);
+			px = src_x + x;
+			py = src_y + y;
+			view_position(src, &px, &py);
+			srcpix = src->pixels + py * src->pitch + px;
+
+			if (src->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR) {
+				// Blitting with a transparent color source
+				blit_rowKeyed(dstrow + x, srcpix, n, src->transparent_color);
+			} else if ((src->flags & SPRITE_FLAG_OPAQUE) || !src->mask) {
+				// Blitting from fully opaque sprite (or nothing masked)
+				blit_rowOpaque(dstrow + x, srcpix, n);
+			} else {
+				// Blitting using mask
+				blit_rowMasked(dstrow + x, srcpix, src->mask + py * src->mask_pitch, src->mask_x + px, n);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -7,21 +7,55 @@
 #define SPRITE_FLAG_OPAQUE	1
 #define SPRITE_FLAG_USE_TRANSPARENT_COLOR	2
 
+#define SPRITE_STORAGE_HEAP		0
+#define SPRITE_STORAGE_ARENA	1 // struct and pixels belong to an arena
+#define SPRITE_STORAGE_MAPPED	2 // pixels (and mask) point into a mapped SPX file
+
 #include "palette.h"
+#include "arena.h"
+#include "pngopts.h"
+struct spx_map;
 typedef struct sprite {
 	uint16_t w, h;
 	uint8_t transparent_color;
-	palette_t palette;
+	palette_t *palette; // May be shared. Use sprite_editPalette() to modify.
 	uint8_t *pixels;
-	uint8_t *mask;
+	uint32_t *mask; // 1 bit per pixel (set = transparent). NULL until a pixel is masked.
 	uint8_t flags;
+	uint8_t storage; // SPRITE_STORAGE_*
+	struct spx_map *map; // SPRITE_STORAGE_MAPPED only
 } sprite_t;
 
+// Mask rows are padded to a whole number of 32-bit words. The first
+// pixel of a row is bit 0 of the first word.
+#define SPRITE_MASK_PITCH(w)	(((w) + 31) / 32)
+
 typedef struct spriterect {
 	int x,y,w,h;
 } spriterect_t;
 
+// A read-only window into the pixels of a sprite. Views own nothing and
+// are only valid as long as the sprite they were obtained from.
+typedef struct sprite_view {
+	const uint8_t *pixels; // first pixel of the window
+	const uint32_t *mask; // mask row of the window's first row (NULL if none)
+	int mask_pitch; // in 32-bit words
+	int mask_x; // bit index of the window's first column in each mask row
+	int pitch; // bytes from one row to the next
+	int w, h;
+	const palette_t *palette;
+	uint8_t transparent_color;
+	uint8_t flags;
+
+	// Wrapped views (wrap_w != 0) repeat the wrap_w x wrap_h surface starting
+	// at 'pixels' in both directions. The window origin is wrap_x, wrap_y.
+	int wrap_x, wrap_y, wrap_w, wrap_h;
+} sprite_view_t;
+
 sprite_t *allocSprite(uint16_t w, uint16_t h, uint16_t palsize, uint8_t flags);
+// Struct and pixels are taken from the arena and only released by arena_free.
+// freeSprite must still be called (or the palette and mask would leak).
+sprite_t *allocSpriteInArena(struct arena *arena, uint16_t w, uint16_t h, uint16_t palsize, uint8_t flags);
 sprite_t *duplicateSprite(const sprite_t *spr);
 void freeSprite(sprite_t *spr);
 
@@ -29,11 +63,22 @@ void freeSprite(sprite_t *spr);
 #define SPRITE_LOADFLAG_DROP_TRANSPARENT	1
 #define SPRITE_ACCEPT_RGB					2
 sprite_t *sprite_loadPNG(const char *in_filename, int n_expected_colors, uint32_t flags);
+// Uses g_png_saveopts
 int sprite_savePNG(const char *out_filename, sprite_t *spr, uint32_t flags);
+int sprite_savePNGOpts(const char *out_filename, sprite_t *spr, uint32_t flags, const png_saveopts_t *opts);
+// Save count sprites, encoding them in parallel on 'threads' threads (0 for
+// one per CPU). Returns -1 if any could not be written.
+int sprite_savePNGBatch(int count, const char * const *filenames, sprite_t * const *sprites, const png_saveopts_t *opts, int threads);
 
 sprite_t *sprite_loadGIF(const char *in_filename, int n_expected_colors, uint32_t flags);
 
+// The pixels of the returned sprite are mapped from the file (see spx.h)
+sprite_t *sprite_loadSPX(const char *in_filename, int n_expected_colors, uint32_t flags);
+int sprite_saveSPX(const char *out_filename, const sprite_t *spr);
+
 sprite_t *sprite_load(const char *in_filename, int n_expected_colors, uint32_t flags);
+// Saves in SPX format if the filename ends with .spx, otherwise PNG
+int sprite_save(const char *out_filename, sprite_t *spr, uint32_t flags);
 
 void printSprite(sprite_t *spr);
 int sprite_setPixelsStrip(struct sprite *spr, int x, int y, uint8_t *data, int count);
@@ -56,7 +101,9 @@ int sprite_pixelIsOpaque(const sprite_t *spr, int x, int y);
 
 void sprite_applyPalette(sprite_t *sprite, const palette_t *newpal);
 int sprite_copyPalette(const sprite_t *spr_src, sprite_t *spr_dst);
+palette_t *sprite_editPalette(sprite_t *sprite);
 int sprite_remapPalette(sprite_t *sprite, const palette_t *dstpal);
+void sprite_remapPixels(sprite_t *sprite, const palremap_lut_t *remap_lut);
 sprite_t *sprite_packPixels(const sprite_t *spr, int bits_per_pixel);
 
 void sprite_getFullRect(const sprite_t *src, spriterect_t *dst);
@@ -64,4 +111,14 @@ int sprite_copyRect(const sprite_t *src, const spriterect_t *src_rect, sprite_t
 
 int sprite_panX(struct sprite *spr, int pan);
 
+// rect NULL means full surface. Returns -1 if the clipped rectangle is empty.
+int sprite_getView(const sprite_t *spr, const spriterect_t *rect, sprite_view_t *view);
+// Window of w x h pixels whose top-left corner is at x,y, wrapping around the sprite edges.
+void sprite_getWrappedView(const sprite_t *spr, int x, int y, int w, int h, sprite_view_t *view);
+
+int sprite_viewGetPixel(const sprite_view_t *view, int x, int y);
+int sprite_viewGetPixelSafeExtend(const sprite_view_t *view, int x, int y);
+int sprite_viewGetPixels8x8(const sprite_view_t *view, int x, int y, uint8_t *dst);
+int sprite_copyRectFromView(const sprite_view_t *src, const spriterect_t *src_rect, sprite_t *dst, const spriterect_t *dst_rect);
+
 #endif // _sprite_h__
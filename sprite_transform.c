@@ -1,181 +1,806 @@
+#include <stdio.h>
 #include <math.h>
+#include <string.h>
+#include <stdlib.h>
+#include <pthread.h>
 #include "sprite_transform.h"
 
-void sprite_scaleNearWH(const sprite_t *src, sprite_t *dst, int w, int h)
+// Source coordinate for each destination coordinate
+struct neartable {
+	int src_size, dst_size;
+	double factor;
+	int alloc;
+	int *map;
+};
+
+struct neartables {
+	struct neartable x, y;
+};
+
+// Animations scale many frames of the same size: keep the last tables.
+// Per thread, so concurrent scaling needs no locking. They are freed when
+// the thread exits.
+static pthread_key_t near_key;
+static pthread_once_t near_key_once = PTHREAD_ONCE_INIT;
+
+static void freeNearTables(void *arg)
 {
-	int x,y;
-	uint8_t pixel;
-	double factor_x, factor_y;
+	struct neartables *t = arg;
 
-	factor_x = w / (double)src->w;
-	factor_y = h / (double)src->h;
+	free(t->x.map);
+	free(t->y.map);
+	free(t);
+}
 
-	for (y=0; y<dst->h; y++) {
-		for (x=0; x<dst->w; x++) {
+static void createNearKey(void)
+{
+	pthread_key_create(&near_key, freeNearTables);
+}
 
-			pixel = sprite_getPixelSafeExtend(src, x/factor_x, y/factor_y);
+static struct neartables *getNearTables(void)
+{
+	struct neartables *t;
 
-			sprite_setPixelSafe(dst, x, y, pixel);
+	pthread_once(&near_key_once, createNearKey);
+
+	t = pthread_getspecific(near_key);
+	if (!t) {
+		t = calloc(1, sizeof(struct neartables));
+		if (!t) {
+			perror("calloc");
+			return NULL;
+		}
+		if (pthread_setspecific(near_key, t)) {
+			free(t);
+			return NULL;
 		}
 	}
 
+	return t;
 }
 
+static const int *nearTable(struct neartable *t, int src_size, int dst_size, double factor)
+{
+	double v;
+	int *map;
+	int i;
 
+	if (t->map && (t->src_size == src_size) && (t->dst_size == dst_size) && (t->factor == factor)) {
+		return t->map;
+	}
 
-void sprite_scaleNear(const sprite_t *src, sprite_t *dst, double factor)
+	if (t->alloc < dst_size) {
+		map = realloc(t->map, dst_size * sizeof(int));
+		if (!map) {
+			perror("realloc");
+			return NULL;
+		}
+		t->map = map;
+		t->alloc = dst_size;
+	}
+
+	// Same as sprite_getPixelSafeExtend(src, i / factor, ...)
+	for (i=0; i<dst_size; i++) {
+		v = i / factor;
+		t->map[i] = v >= src_size ? src_size - 1 : (int)v;
+	}
+
+	t->src_size = src_size;
+	t->dst_size = dst_size;
+	t->factor = factor;
+
+	return t->map;
+}
+
+static void scaleNearTables(const sprite_t *src, sprite_t *dst, double factor_x, double factor_y)
 {
+	struct neartables *tables;
+	const int *xmap, *ymap;
+	const uint8_t *srow;
+	uint8_t *drow;
 	int x,y;
-	uint8_t pixel;
+
+	tables = getNearTables();
+	if (!tables) {
+		return;
+	}
+
+	xmap = nearTable(&tables->x, src->w, dst->w, factor_x);
+	ymap = nearTable(&tables->y, src->h, dst->h, factor_y);
+	if (!xmap || !ymap) {
+		return;
+	}
 
 	for (y=0; y<dst->h; y++) {
+		drow = dst->pixels + y * dst->w;
+
+		// Duplicated rows
+		if (y > 0 && ymap[y] == ymap[y-1]) {
+			memcpy(drow, drow - dst->w, dst->w);
+			continue;
+		}
+
+		srow = src->pixels + ymap[y] * src->w;
 		for (x=0; x<dst->w; x++) {
+			drow[x] = srow[xmap[x]];
+		}
+	}
+}
+
+void sprite_scaleNearWH(const sprite_t *src, sprite_t *dst, int w, int h)
+{
+	scaleNearTables(src, dst, w / (double)src->w, h / (double)src->h);
+}
+
+void sprite_scaleNear(const sprite_t *src, sprite_t *dst, double factor)
+{
+	scaleNearTables(src, dst, factor, factor);
+}
+
+// First source pixel covered by each destination pixel, plus the end of the last one
+static int *areaBounds(int src_size, int dst_size)
+{
+	int *bounds;
+	int i;
+
+	bounds = malloc((dst_size + 1) * sizeof(int));
+	if (!bounds) {
+		perror("malloc");
+		return NULL;
+	}
 
-			pixel = sprite_getPixelSafeExtend(src, x/factor, y/factor);
+	for (i=0; i<=dst_size; i++) {
+		bounds[i] = (int64_t)i * src_size / dst_size;
+	}
+
+	return bounds;
+}
+
+int sprite_scaleArea(const sprite_t *src, sprite_t *dst, palblend_t *pb)
+{
+	const palent_t *colors = src->palette->colors;
+	const uint8_t *srow, *p;
+	uint8_t *drow;
+	int *xb, *yb;
+	int x, y, x0, x1, y0, y1, i, j, n;
+	int r, g, b;
+
+	xb = areaBounds(src->w, dst->w);
+	yb = areaBounds(src->h, dst->h);
+	if (!xb || !yb) {
+		free(xb);
+		free(yb);
+		return -1;
+	}
+
+	palblend_setPalette(pb, src->palette);
 
-			sprite_setPixelSafe(dst, x, y, pixel);
+	for (y=0; y<dst->h; y++) {
+		drow = dst->pixels + y * dst->w;
+		y0 = yb[y];
+		y1 = yb[y+1] > y0 ? yb[y+1] : y0 + 1; // upscaling: at least one pixel
+		srow = src->pixels + y0 * src->w;
+
+		for (x=0; x<dst->w; x++) {
+			x0 = xb[x];
+			x1 = xb[x+1] > x0 ? xb[x+1] : x0 + 1;
+			p = srow + x0;
+
+			// The usual small boxes go through the caches as is
+			if (y1 - y0 == 1) {
+				if (x1 - x0 == 1) {
+					drow[x] = palblend_mix2(pb, p[0], p[0]);
+					continue;
+				}
+				if (x1 - x0 == 2) {
+					drow[x] = palblend_mix2(pb, p[0], p[1]);
+					continue;
+				}
+			} else if (y1 - y0 == 2) {
+				if (x1 - x0 == 1) {
+					drow[x] = palblend_mix2(pb, p[0], p[src->w]);
+					continue;
+				}
+				if (x1 - x0 == 2) {
+					drow[x] = palblend_mix4(pb, p[0], p[1], p[src->w], p[src->w+1]);
+					continue;
+				}
+			}
+
+			r = g = b = 0;
+			for (j=y0; j<y1; j++, p += src->w) {
+				for (i=0; i<x1-x0; i++) {
+					r += colors[p[i]].r;
+					g += colors[p[i]].g;
+					b += colors[p[i]].b;
+				}
+			}
+			n = (x1 - x0) * (y1 - y0);
+			drow[x] = palblend_matchRGB(pb, (r + n/2) / n, (g + n/2) / n, (b + n/2) / n);
 		}
 	}
 
+	free(xb);
+	free(yb);
+
+	return 0;
 }
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+
+// a == b ? all ones : 0, for each byte
+#define V_EQ(a, b)			_mm_cmpeq_epi8(a, b)
+// mask ? a : b
+#define V_SEL(mask, a, b)	_mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b))
+#define V_LOAD(p)			_mm_loadu_si128((const __m128i*)(p))
+#define V_STORE(p, v)		_mm_storeu_si128((__m128i*)(p), v)
+#endif
+
 // From https://www.scale2x.it/algorithm
-void sprite_scale2x(const sprite_t *src, sprite_t *dst)
+static void scale2xPixel(const uint8_t *up, const uint8_t *cur, const uint8_t *down, int w, int x, uint8_t *dst0, uint8_t *dst1)
 {
-	int x,y;
-	uint8_t B,D,E,F,H,E0,E1,E2,E3;
+	uint8_t B,D,E,F,H;
+
+	B = up[x];
+	D = cur[x > 0 ? x-1 : 0];
+	E = cur[x];
+	F = cur[x < w-1 ? x+1 : x];
+	H = down[x];
+
+	if (B != H && D != F) {
+		dst0[x*2] = D == B ? D : E;
+		dst0[x*2+1] = B == F ? F : E;
+		dst1[x*2] = D == H ? D : E;
+		dst1[x*2+1] = H == F ? F : E;
+	} else {
+		dst0[x*2] = E;
+		dst0[x*2+1] = E;
+		dst1[x*2] = E;
+		dst1[x*2+1] = E;
+	}
+}
 
-	for (y=0; y<src->h; y++) {
-		for (x=0; x<src->w; x++) {
-
-			B = sprite_getPixelSafeExtend(src, x, y-1);
-			D = sprite_getPixelSafeExtend(src, x-1, y);
-			E = sprite_getPixelSafeExtend(src, x, y);
-			F = sprite_getPixelSafeExtend(src, x+1, y);
-			H = sprite_getPixelSafeExtend(src, x, y+1);
-
-			if (B != H && D != F) {
-				E0 = D == B ? D : E;
-				E1 = B == F ? F : E;
-				E2 = D == H ? D : E;
-				E3 = H == F ? F : E;
-			} else {
-				E0 = E;
-				E1 = E;
-				E2 = E;
-				E3 = E;
-			}
+// One source row to two destination rows of w*2 pixels. up and down are
+// the neighbour rows (the same as cur at the top and bottom edges).
+static void scale2xRow(const uint8_t *up, const uint8_t *cur, const uint8_t *down, int w, uint8_t *dst0, uint8_t *dst1)
+{
+	int x = 0;
+
+	scale2xPixel(up, cur, down, w, x, dst0, dst1);
+	x++;
+
+#ifdef __SSE2__
+	// 16 pixels at a time, not touching the last pixel (right edge)
+	for (; x + 16 < w; x += 16) {
+		__m128i B = V_LOAD(up + x);
+		__m128i D = V_LOAD(cur + x - 1);
+		__m128i E = V_LOAD(cur + x);
+		__m128i F = V_LOAD(cur + x + 1);
+		__m128i H = V_LOAD(down + x);
+		__m128i ones = _mm_set1_epi8(-1);
+		// B != H && D != F
+		__m128i active = _mm_andnot_si128(_mm_or_si128(V_EQ(B, H), V_EQ(D, F)), ones);
+		__m128i E0 = V_SEL(_mm_and_si128(active, V_EQ(D, B)), D, E);
+		__m128i E1 = V_SEL(_mm_and_si128(active, V_EQ(B, F)), F, E);
+		__m128i E2 = V_SEL(_mm_and_si128(active, V_EQ(D, H)), D, E);
+		__m128i E3 = V_SEL(_mm_and_si128(active, V_EQ(H, F)), F, E);
+
+		V_STORE(dst0 + x*2, _mm_unpacklo_epi8(E0, E1));
+		V_STORE(dst0 + x*2 + 16, _mm_unpackhi_epi8(E0, E1));
+		V_STORE(dst1 + x*2, _mm_unpacklo_epi8(E2, E3));
+		V_STORE(dst1 + x*2 + 16, _mm_unpackhi_epi8(E2, E3));
+	}
+#endif
+
+	for (; x<w; x++) {
+		scale2xPixel(up, cur, down, w, x, dst0, dst1);
+	}
+}
 
-			sprite_setPixelSafe(dst, x * 2, y * 2, E0);
-			sprite_setPixelSafe(dst, x * 2 + 1, y * 2, E1);
-			sprite_setPixelSafe(dst, x * 2, y * 2 + 1, E2);
-			sprite_setPixelSafe(dst, x * 2 + 1, y * 2 + 1, E3);
+static void scale3xPixel(const uint8_t *up, const uint8_t *cur, const uint8_t *down, int w, int x, uint8_t *dst0, uint8_t *dst1, uint8_t *dst2)
+{
+	uint8_t A,B,C,D,E,F,G,H,I;
+	int xl = x > 0 ? x-1 : 0;
+	int xr = x < w-1 ? x+1 : x;
+
+	A = up[xl]; B = up[x]; C = up[xr];
+	D = cur[xl]; E = cur[x]; F = cur[xr];
+	G = down[xl]; H = down[x]; I = down[xr];
+
+	dst0 += x*3; dst1 += x*3; dst2 += x*3;
+
+	if (B != H && D != F) {
+		dst0[0] = D == B ? D : E;
+		dst0[1] = (D == B && E != C) || (B == F && E != A) ? B : E;
+		dst0[2] = B == F ? F : E;
+		dst1[0] = (D == B && E != G) || (D == H && E != A) ? D : E;
+		dst1[1] = E;
+		dst1[2] = (B == F && E != I) || (H == F && E != C) ? F : E;
+		dst2[0] = D == H ? D : E;
+		dst2[1] = (D == H && E != I) || (H == F && E != G) ? H : E;
+		dst2[2] = H == F ? F : E;
+	} else {
+		dst0[0] = dst0[1] = dst0[2] = E;
+		dst1[0] = dst1[1] = dst1[2] = E;
+		dst2[0] = dst2[1] = dst2[2] = E;
+	}
+}
+
+static void scale3xRow(const uint8_t *up, const uint8_t *cur, const uint8_t *down, int w, uint8_t *dst0, uint8_t *dst1, uint8_t *dst2)
+{
+	int x = 0;
+
+	scale3xPixel(up, cur, down, w, x, dst0, dst1, dst2);
+	x++;
+
+#ifdef __SSE2__
+	for (; x + 16 < w; x += 16) {
+		__m128i A = V_LOAD(up + x - 1), B = V_LOAD(up + x), C = V_LOAD(up + x + 1);
+		__m128i D = V_LOAD(cur + x - 1), E = V_LOAD(cur + x), F = V_LOAD(cur + x + 1);
+		__m128i G = V_LOAD(down + x - 1), H = V_LOAD(down + x), I = V_LOAD(down + x + 1);
+		__m128i ones = _mm_set1_epi8(-1);
+		__m128i active = _mm_andnot_si128(_mm_or_si128(V_EQ(B, H), V_EQ(D, F)), ones);
+		__m128i DB = _mm_and_si128(active, V_EQ(D, B));
+		__m128i BF = _mm_and_si128(active, V_EQ(B, F));
+		__m128i DH = _mm_and_si128(active, V_EQ(D, H));
+		__m128i HF = _mm_and_si128(active, V_EQ(H, F));
+		// E != X
+		__m128i nA = _mm_andnot_si128(V_EQ(E, A), ones);
+		__m128i nC = _mm_andnot_si128(V_EQ(E, C), ones);
+		__m128i nG = _mm_andnot_si128(V_EQ(E, G), ones);
+		__m128i nI = _mm_andnot_si128(V_EQ(E, I), ones);
+		uint8_t out[9][16];
+		int i;
+
+		V_STORE(out[0], V_SEL(DB, D, E));
+		V_STORE(out[1], V_SEL(_mm_or_si128(_mm_and_si128(DB, nC), _mm_and_si128(BF, nA)), B, E));
+		V_STORE(out[2], V_SEL(BF, F, E));
+		V_STORE(out[3], V_SEL(_mm_or_si128(_mm_and_si128(DB, nG), _mm_and_si128(DH, nA)), D, E));
+		V_STORE(out[4], E);
+		V_STORE(out[5], V_SEL(_mm_or_si128(_mm_and_si128(BF, nI), _mm_and_si128(HF, nC)), F, E));
+		V_STORE(out[6], V_SEL(DH, D, E));
+		V_STORE(out[7], V_SEL(_mm_or_si128(_mm_and_si128(DH, nI), _mm_and_si128(HF, nG)), H, E));
+		V_STORE(out[8], V_SEL(HF, F, E));
+
+		// SSE2 has no byte shuffle, interleave the results here.
+		for (i=0; i<16; i++) {
+			dst0[(x+i)*3] = out[0][i]; dst0[(x+i)*3+1] = out[1][i]; dst0[(x+i)*3+2] = out[2][i];
+			dst1[(x+i)*3] = out[3][i]; dst1[(x+i)*3+1] = out[4][i]; dst1[(x+i)*3+2] = out[5][i];
+			dst2[(x+i)*3] = out[6][i]; dst2[(x+i)*3+1] = out[7][i]; dst2[(x+i)*3+2] = out[8][i];
 		}
 	}
+#endif
+
+	for (; x<w; x++) {
+		scale3xPixel(up, cur, down, w, x, dst0, dst1, dst2);
+	}
 }
 
-void sprite_scale3x(const sprite_t *src, sprite_t *dst)
+/* Scale src by n (2 or 3) into dst, one source row at a time. When dst
+ * is not exactly n times larger, rows are built in a buffer and clipped
+ * to dst (as sprite_setPixelSafe would). */
+static void scaleNx(const sprite_t *src, sprite_t *dst, int n)
 {
-	int x,y;
-	uint8_t A,B,C,D,E,F,G,H,I,E0,E1,E2,E3,E4,E5,E6,E7,E8;
+	const uint8_t *up, *cur, *down;
+	uint8_t *rows[3];
+	uint8_t *buf = NULL;
+	int direct = (dst->w == src->w * n) && (dst->h >= src->h * n);
+	int y, i, dy, copy_w;
+
+	if (!direct) {
+		buf = malloc(src->w * n * n);
+		if (!buf) {
+			perror("malloc");
+			return;
+		}
+	}
+
+	copy_w = dst->w < src->w * n ? dst->w : src->w * n;
 
 	for (y=0; y<src->h; y++) {
-		for (x=0; x<src->w; x++) {
-
-			A = sprite_getPixelSafeExtend(src, x-1, y-1);
-			B = sprite_getPixelSafeExtend(src, x, y-1);
-			C = sprite_getPixelSafeExtend(src, x+1, y-1);
-
-			D = sprite_getPixelSafeExtend(src, x-1, y);
-			E = sprite_getPixelSafeExtend(src, x, y);
-			F = sprite_getPixelSafeExtend(src, x+1, y);
-
-			G = sprite_getPixelSafeExtend(src, x-1, y+1);
-			H = sprite_getPixelSafeExtend(src, x, y+1);
-			I = sprite_getPixelSafeExtend(src, x+1, y+1);
-
-			if (B != H && D != F) {
-				E0 = D == B ? D : E;
-				E1 = (D == B && E != C) || (B == F && E != A) ? B : E;
-				E2 = B == F ? F : E;
-				E3 = (D == B && E != G) || (D == H && E != A) ? D : E;
-				E4 = E;
-				E5 = (B == F && E != I) || (H == F && E != C) ? F : E;
-				E6 = D == H ? D : E;
-				E7 = (D == H && E != I) || (H == F && E != G) ? H : E;
-				E8 = H == F ? F : E;
-			} else {
-				E0 = E;
-				E1 = E;
-				E2 = E;
-				E3 = E;
-				E4 = E;
-				E5 = E;
-				E6 = E;
-				E7 = E;
-				E8 = E;
+		cur = src->pixels + y * src->w;
+		up = y > 0 ? cur - src->w : cur;
+		down = y < src->h - 1 ? cur + src->w : cur;
+
+		for (i=0; i<n; i++) {
+			rows[i] = direct ? dst->pixels + (y * n + i) * dst->w : buf + i * src->w * n;
+		}
+
+		if (n == 2) {
+			scale2xRow(up, cur, down, src->w, rows[0], rows[1]);
+		} else {
+			scale3xRow(up, cur, down, src->w, rows[0], rows[1], rows[2]);
+		}
+
+		if (!direct) {
+			for (i=0; i<n; i++) {
+				dy = y * n + i;
+				if (dy < dst->h) {
+					memcpy(dst->pixels + dy * dst->w, rows[i], copy_w);
+				}
 			}
+		}
+	}
+
+	free(buf);
+}
 
+void sprite_scale2x(const sprite_t *src, sprite_t *dst)
+{
+	scaleNx(src, dst, 2);
+}
+
+void sprite_scale3x(const sprite_t *src, sprite_t *dst)
+{
+	scaleNx(src, dst, 3);
+}
 
-			sprite_setPixelSafe(dst, x * 3, y * 3, E0);
-			sprite_setPixelSafe(dst, x * 3 + 1, y * 3, E1);
-			sprite_setPixelSafe(dst, x * 3 + 2, y * 3, E2);
+// Rows kept per stage. Producing the n rows of a source row must not
+// overwrite the 3 rows the next stage is reading: at least n+2.
+#define CHAIN_RING	8
+
+struct chainstage {
+	int n; // 2 or 3
+	int w, h; // size of the rows produced
+	int produced; // rows produced so far
+	uint8_t *ring;
+};
+
+struct chain {
+	const sprite_t *src;
+	struct chainstage stages[SCALE_CHAIN_MAX_STEPS];
+};
+
+// Row y (clamped) of the image after 'level' steps. Valid until the
+// stage produces CHAIN_RING more rows.
+static const uint8_t *chainRow(struct chain *c, int level, int y)
+{
+	struct chainstage *st;
+	const uint8_t *up, *cur, *down;
+	uint8_t *rows[3];
+	int sy, i, src_w;
+
+	if (level == 0) {
+		if (y < 0) { y = 0; }
+		if (y >= c->src->h) { y = c->src->h - 1; }
+		return c->src->pixels + y * c->src->w;
+	}
 
-			sprite_setPixelSafe(dst, x * 3, y * 3 + 1, E3);
-			sprite_setPixelSafe(dst, x * 3 + 1, y * 3 + 1, E4);
-			sprite_setPixelSafe(dst, x * 3 + 2, y * 3 + 1, E5);
+	st = &c->stages[level-1];
+	if (y < 0) { y = 0; }
+	if (y >= st->h) { y = st->h - 1; }
 
-			sprite_setPixelSafe(dst, x * 3, y * 3 + 2, E6);
-			sprite_setPixelSafe(dst, x * 3 + 1, y * 3 + 2, E7);
-			sprite_setPixelSafe(dst, x * 3 + 2, y * 3 + 2, E8);
+	src_w = st->w / st->n;
+	while (st->produced <= y) {
+		sy = st->produced / st->n;
+		up = chainRow(c, level-1, sy-1);
+		cur = chainRow(c, level-1, sy);
+		down = chainRow(c, level-1, sy+1);
 
+		for (i=0; i<st->n; i++) {
+			rows[i] = st->ring + ((st->produced + i) % CHAIN_RING) * st->w;
+		}
+		if (st->n == 2) {
+			scale2xRow(up, cur, down, src_w, rows[0], rows[1]);
+		} else {
+			scale3xRow(up, cur, down, src_w, rows[0], rows[1], rows[2]);
 		}
+		st->produced += st->n;
 	}
 
+	return st->ring + (y % CHAIN_RING) * st->w;
 }
 
-/* Mutiply column vector vect[2] by square matrix mat[2][2] and store the result in result[2]
- */
-static void applyMatrix(const double mat[2][2], const double vect[2], double result[2])
+int sprite_scaleChain(const sprite_t *src, sprite_t *dst, const int *steps, int num_steps)
+{
+	struct chain c = { .src = src };
+	int i, y, w, h, copy_w, ret = -1;
+
+	if (num_steps > SCALE_CHAIN_MAX_STEPS) {
+		fprintf(stderr, "Too many scaling steps\n");
+		return -1;
+	}
+
+	w = src->w;
+	h = src->h;
+	for (i=0; i<num_steps; i++) {
+		if ((steps[i] != 2) && (steps[i] != 3)) {
+			fprintf(stderr, "Unsupported scaling step %d\n", steps[i]);
+			goto done;
+		}
+		w *= steps[i];
+		h *= steps[i];
+		c.stages[i].n = steps[i];
+		c.stages[i].w = w;
+		c.stages[i].h = h;
+		c.stages[i].ring = malloc(CHAIN_RING * w);
+		if (!c.stages[i].ring) {
+			perror("malloc");
+			goto done;
+		}
+	}
+
+	copy_w = dst->w < w ? dst->w : w;
+	for (y=0; y<h && y<dst->h; y++) {
+		memcpy(dst->pixels + y * dst->w, chainRow(&c, num_steps, y), copy_w);
+	}
+	ret = 0;
+
+done:
+	for (i=0; i<num_steps; i++) {
+		free(c.stages[i].ring);
+	}
+
+	return ret;
+}
+
+// 32.32 fixed point. 16.16 is not enough for the large intermediate
+// images of the NICEnX algorithms: the error accumulated over a row must
+// stay well below a pixel.
+#define ROT_FRAC_BITS	32
+#define ROT_ONE			((int64_t)1 << ROT_FRAC_BITS)
+#define ROT_HALF		(ROT_ONE / 2)
+#define ROT_FIX(v)		((int64_t)llround((v) * ROT_ONE))
+
+static inline int rotRound(int64_t v)
+{
+	return (v + ROT_HALF) >> ROT_FRAC_BITS;
+}
+
+// Clamp [*x0,*x1] to where start + x * step rounds to a position in [0,size)
+static void rotClipSpan(int64_t start, int64_t step, int size, int *x0, int *x1)
+{
+	double lo, hi, t;
+	int p;
+
+	if (step == 0) {
+		p = rotRound(start);
+		if ((p < 0) || (p >= size)) {
+			*x1 = *x0 - 1;
+		}
+		return;
+	}
+
+	// Estimate, with a margin for rounding...
+	lo = (-0.5 - start / (double)ROT_ONE) / (step / (double)ROT_ONE);
+	hi = (size - 0.5 - start / (double)ROT_ONE) / (step / (double)ROT_ONE);
+	if (lo > hi) {
+		t = lo; lo = hi; hi = t;
+	}
+	if (lo - 1 > *x0) {
+		*x0 = lo - 1 > *x1 ? *x1 + 1 : (int)(lo - 1);
+	}
+	if (hi + 1 < *x1) {
+		*x1 = hi + 1 < *x0 ? *x0 - 1 : (int)(hi + 1);
+	}
+
+	// ... then narrow it using the exact same computation as the stepping.
+	while ((*x0 <= *x1) && ((p = rotRound(start + *x0 * step)) < 0 || p >= size)) {
+		(*x0)++;
+	}
+	while ((*x1 >= *x0) && ((p = rotRound(start + *x1 * step)) < 0 || p >= size)) {
+		(*x1)--;
+	}
+}
+
+struct rotation {
+	double c, s;
+	double xc, yc; // center of rotation
+	int64_t dx, dy; // source step for x+1
+};
+
+// For rotating an image of w x h pixels around its center
+static void rotInit(struct rotation *rot, int w, int h, double angle)
+{
+	double rads = angle * (M_PI * 2) / 360.0;
+
+	rot->c = cos(rads);
+	rot->s = sin(rads);
+	rot->xc = w / 2.0 - 0.5;
+	rot->yc = h / 2.0 - 0.5;
+	rot->dx = ROT_FIX(rot->c);
+	rot->dy = ROT_FIX(rot->s);
+}
+
+// Source position for x = 0
+static void rotRowStart(const struct rotation *rot, int y, int64_t *sx, int64_t *sy)
 {
-	result[0] = mat[0][0] * vect[0] + mat[0][1] * vect[1];
-	result[1] = mat[1][0] * vect[0] + mat[1][1] * vect[1];
+	*sx = ROT_FIX(-rot->xc * rot->c - (y - rot->yc) * rot->s + rot->xc);
+	*sy = ROT_FIX(-rot->xc * rot->s + (y - rot->yc) * rot->c + rot->yc);
 }
 
 void sprite_rotate(const sprite_t *src, sprite_t *dst, double angle)
 {
 	int x,y;
-	uint8_t pixel, mask;
-	double rads = angle * (M_PI * 2) / 360.0;
-	double xc, yc; // center of rotation
-	double matrix[2][2] = {
-		{ cos(rads), -sin(rads) },
-		{ sin(rads), cos(rads) },
-	};
-	double v[2];
-	double res[2];
-	int src_x, src_y;
+	struct rotation rot;
+	int64_t sx, sy;
+	int x0, x1, src_x, src_y;
+	uint8_t *row;
 
-	xc = src->w / 2.0 - 0.5;
-	yc = src->h / 2.0 - 0.5;
+	rotInit(&rot, src->w, src->h, angle);
+
+	// Every pixel is written, pixels outside the source are opaque.
+	if (dst->mask) {
+		memset(dst->mask, 0, SPRITE_MASK_PITCH(dst->w) * dst->h * sizeof(uint32_t));
+	}
 
 	for (y=0; y<dst->h; y++) {
+		rotRowStart(&rot, y, &sx, &sy);
+
+		x0 = 0;
+		x1 = dst->w - 1;
+		rotClipSpan(sx, rot.dx, src->w, &x0, &x1);
+		rotClipSpan(sy, rot.dy, src->h, &x0, &x1);
+
+		row = dst->pixels + y * dst->w;
+
+		for (x=x0; x<=x1; x++) {
+			src_x = rotRound(sx + x * rot.dx);
+			src_y = rotRound(sy + x * rot.dy);
+
+			row[x] = src->pixels[src_y * src->w + src_x];
+			if (src->mask && sprite_getPixelMask(src, src_x, src_y)) {
+				sprite_setPixelMask(dst, x, y, 1);
+			}
+		}
+
+		// Outside the source
+		if (x0 > x1) {
+			x0 = x1 = dst->w;
+		}
 		for (x=0; x<dst->w; x++) {
+			if (x == x0) {
+				x = x1;
+				continue;
+			}
+			row[x] = sprite_getPixelSafe(src, rotRound(sx + x * rot.dx), rotRound(sy + x * rot.dy));
+		}
+	}
+}
+
+struct upscale {
+	const sprite_t *src;
+	int num_steps;
+	const int *steps;
+	int w[ROTATE_MAX_UPSCALE_STEPS+1], h[ROTATE_MAX_UPSCALE_STEPS+1];
+};
+
+/* Pixel x,y of the source scaled up by the first 'level' steps, with
+ * edges extended at each step like sprite_getPixelSafeExtend. Only the
+ * Scale2x/Scale3x rule for the requested sub-pixel is evaluated. */
+static int upscaledPixel(const struct upscale *up, int level, int x, int y)
+{
+	int A,B,C,D,E,F,G,H,I;
+	int px, py;
+
+	if (level == 0) {
+		return sprite_getPixelSafeExtend(up->src, x, y);
+	}
+
+	if (x < 0) { x = 0; }
+	if (y < 0) { y = 0; }
+	if (x >= up->w[level]) { x = up->w[level] - 1; }
+	if (y >= up->h[level]) { y = up->h[level] - 1; }
+
+	level--;
+
+	if (up->steps[level] == 2) {
+		px = x >> 1;
+		py = y >> 1;
+
+		B = upscaledPixel(up, level, px, py-1);
+		D = upscaledPixel(up, level, px-1, py);
+		E = upscaledPixel(up, level, px, py);
+		F = upscaledPixel(up, level, px+1, py);
+		H = upscaledPixel(up, level, px, py+1);
+
+		if (B == H || D == F) {
+			return E;
+		}
+
+		switch (((y & 1) << 1) | (x & 1))
+		{
+			case 0: return D == B ? D : E;
+			case 1: return B == F ? F : E;
+			case 2: return D == H ? D : E;
+			default: return H == F ? F : E;
+		}
+	}
 
-			v[0] = x-xc;
-			v[1] = y-yc;
-			applyMatrix(matrix, v, res);
+	// Scale3x
+	px = x / 3;
+	py = y / 3;
 
-			src_x = round(res[0] + xc);
-			src_y = round(res[1] + yc);
+	B = upscaledPixel(up, level, px, py-1);
+	D = upscaledPixel(up, level, px-1, py);
+	E = upscaledPixel(up, level, px, py);
+	F = upscaledPixel(up, level, px+1, py);
+	H = upscaledPixel(up, level, px, py+1);
+
+	if (B == H || D == F) {
+		return E;
+	}
 
-			pixel = sprite_getPixelSafe(src, src_x, src_y);
-			mask = sprite_getPixelMaskSafe(src, src_x, src_y);
+	A = upscaledPixel(up, level, px-1, py-1);
+	C = upscaledPixel(up, level, px+1, py-1);
+	G = upscaledPixel(up, level, px-1, py+1);
+	I = upscaledPixel(up, level, px+1, py+1);
+
+	switch ((y % 3) * 3 + (x % 3))
+	{
+		case 0: return D == B ? D : E;
+		case 1: return (D == B && E != C) || (B == F && E != A) ? B : E;
+		case 2: return B == F ? F : E;
+		case 3: return (D == B && E != G) || (D == H && E != A) ? D : E;
+		case 4: return E;
+		case 5: return (B == F && E != I) || (H == F && E != C) ? F : E;
+		case 6: return D == H ? D : E;
+		case 7: return (D == H && E != I) || (H == F && E != G) ? H : E;
+		default: return H == F ? F : E;
+	}
+}
 
-			sprite_setPixelSafe(dst, x, y, pixel);
-			sprite_setPixelMaskSafe(dst, x, y, mask);
+int sprite_rotateUpscaled(const sprite_t *src, sprite_t *dst, double angle, const int *steps, int num_steps, double downscale)
+{
+	struct upscale up;
+	struct rotation rot;
+	int x, y, i, top_x, top_y, src_x, src_y, W, H;
+	int64_t sx, sy;
+
+	if (num_steps > ROTATE_MAX_UPSCALE_STEPS) {
+		fprintf(stderr, "Too many upscaling steps\n");
+		return -1;
+	}
+
+	up.src = src;
+	up.steps = steps;
+	up.num_steps = num_steps;
+	up.w[0] = src->w;
+	up.h[0] = src->h;
+	for (i=0; i<num_steps; i++) {
+		if ((steps[i] != 2) && (steps[i] != 3)) {
+			fprintf(stderr, "Unsupported upscaling step %d\n", steps[i]);
+			return -1;
 		}
+		up.w[i+1] = up.w[i] * steps[i];
+		up.h[i+1] = up.h[i] * steps[i];
 	}
+
+	// The upscaled image is rotated around its own center
+	W = up.w[num_steps];
+	H = up.h[num_steps];
+	rotInit(&rot, W, H, angle);
+
+	for (y=0; y<dst->h; y++) {
+		// Pixel of the rotated upscaled image kept by the downscale
+		top_y = y / downscale;
+		if (top_y >= H) {
+			top_y = H - 1;
+		}
+		rotRowStart(&rot, top_y, &sx, &sy);
+
+		for (x=0; x<dst->w; x++) {
+			top_x = x / downscale;
+			if (top_x >= W) {
+				top_x = W - 1;
+			}
+
+			src_x = rotRound(sx + top_x * rot.dx);
+			src_y = rotRound(sy + top_x * rot.dy);
+
+			if ((src_x < 0) || (src_y < 0) || (src_x >= W) || (src_y >= H)) {
+				if (src->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR) {
+					sprite_setPixel(dst, x, y, src->transparent_color);
+					continue;
+				}
+			}
+
+			sprite_setPixel(dst, x, y, upscaledPixel(&up, num_steps, src_x, src_y));
+		}
+	}
+
+	return 0;
 }
 
 
@@ -214,30 +839,27 @@ static int sprite_fixupBlackContour(sprite_t *spr, int black)
 	return 0;
 }
 
-static void setTransparentNbrsTo(sprite_t *spr, int x, int y, int black)
+// Bit x of dst (LSB first, like the mask) is set when row[x] == value.
+// Bits past w are cleared.
+static void rowBitsEqual(const uint8_t *row, int w, uint8_t value, uint32_t *dst)
 {
-	if (x > 0) {
-		if (!sprite_pixelIsOpaque(spr, x-1, y)) {
-			sprite_setPixel(spr, x-1, y, black);
-			sprite_setPixelMask(spr, x-1, y, 0xff);
-		}
-	}
-	if (x < spr->w-1) {
-		if (!sprite_pixelIsOpaque(spr, x+1, y)) {
-			sprite_setPixel(spr, x+1, y, black);
-			sprite_setPixelMask(spr, x+1, y, 0xff);
-		}
-	}
-	if (y > 0) {
-		if (!sprite_pixelIsOpaque(spr, x, y-1)) {
-			sprite_setPixel(spr, x, y-1, black);
-			sprite_setPixelMask(spr, x, y-1, 0xff);
+	int x = 0;
+
+	memset(dst, 0, SPRITE_MASK_PITCH(w) * sizeof(uint32_t));
+
+#ifdef __SSE2__
+	{
+		const __m128i v = _mm_set1_epi8(value);
+
+		for (; x + 16 <= w; x += 16) {
+			dst[x >> 5] |= (uint32_t)_mm_movemask_epi8(V_EQ(V_LOAD(row + x), v)) << (x & 16);
 		}
 	}
-	if (y < spr->h-1) {
-		if (!sprite_pixelIsOpaque(spr, x, y+1)) {
-			sprite_setPixel(spr, x, y+1, black);
-			sprite_setPixelMask(spr, x, y+1, 0xff);
+#endif
+
+	for (; x < w; x++) {
+		if (row[x] == value) {
+			dst[x >> 5] |= 1u << (x & 31);
 		}
 	}
 }
@@ -246,32 +868,119 @@ static void setTransparentNbrsTo(sprite_t *spr, int x, int y, int black)
  * Look at pixels that are opaque but not black. If
  * that pixel has a transparent neighbor, set it to black.
  *
+ * Works on whole rows of bits: the new contour is the set of opaque,
+ * non-black pixels grown by one pixel in each direction (shifted and ORed
+ * rows), minus the opaque pixels. Contour pixels are black so they do
+ * not grow further.
  */
 void sprite_autoBlackContour(sprite_t *spr)
 {
-	int x, y;
+	int pitch = SPRITE_MASK_PITCH(spr->w);
+	uint32_t lastmask = spr->w & 31 ? (1u << (spr->w & 31)) - 1 : 0xffffffff;
+	uint32_t *opaque, *edges, *tmp, *row, *up, *down, *mask;
+	uint32_t grown, bits;
+	uint8_t *pixels;
+	int x, y, i;
 	int black;
 
 	if (spr->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR) {
-		black = palette_findBestMatchExcluding(&spr->palette, 0, 0, 0, spr->transparent_color, COLORMATCH_METHOD_DEFAULT);
+		black = palette_findBestMatchExcluding(spr->palette, 0, 0, 0, spr->transparent_color, COLORMATCH_METHOD_DEFAULT);
 	} else {
-		black = palette_findBestMatch(&spr->palette, 0, 0, 0, COLORMATCH_METHOD_DEFAULT);
+		black = palette_findBestMatch(spr->palette, 0, 0, 0, COLORMATCH_METHOD_DEFAULT);
 	}
 
 	printf("Black index: %d\n", black);
 
+	if (!spr->w || !spr->h) {
+		return;
+	}
+
+	opaque = malloc(pitch * spr->h * sizeof(uint32_t));
+	edges = malloc(pitch * spr->h * sizeof(uint32_t));
+	tmp = malloc(pitch * sizeof(uint32_t));
+	if (!opaque || !edges || !tmp) {
+		perror("malloc");
+		goto done;
+	}
+
+	// Opaque pixels (see sprite_pixelIsOpaque), and among them, those
+	// around which a contour is drawn (not black).
 	for (y=0; y<spr->h; y++) {
-		for (x=0; x<spr->w; x++) {
-			if (!sprite_pixelIsOpaque(spr, x, y))
-				continue;
-			if (sprite_getPixel(spr, x, y) == black)
+		pixels = spr->pixels + y * spr->w;
+		row = opaque + y * pitch;
+
+		if (spr->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR) {
+			rowBitsEqual(pixels, spr->w, spr->transparent_color, row);
+			for (i=0; i<pitch; i++) {
+				row[i] = ~row[i];
+			}
+			row[pitch-1] &= lastmask;
+		} else if (spr->mask) {
+			memcpy(row, spr->mask + y * pitch, pitch * sizeof(uint32_t));
+			row[pitch-1] &= lastmask;
+		} else {
+			memset(row, 0, pitch * sizeof(uint32_t));
+		}
+
+		rowBitsEqual(pixels, spr->w, black, tmp);
+		for (i=0; i<pitch; i++) {
+			edges[y * pitch + i] = row[i] & ~tmp[i];
+		}
+	}
+
+	for (y=0; y<spr->h; y++) {
+		row = edges + y * pitch;
+		up = y > 0 ? row - pitch : NULL;
+		down = y < spr->h-1 ? row + pitch : NULL;
+		pixels = spr->pixels + y * spr->w;
+
+		for (i=0; i<pitch; i++) {
+			// Left and right neighbours, carrying bits across words
+			grown = row[i] | (row[i] << 1) | (row[i] >> 1);
+			if (i > 0) {
+				grown |= row[i-1] >> 31;
+			}
+			if (i < pitch-1) {
+				grown |= row[i+1] << 31;
+			}
+			if (up) {
+				grown |= up[i];
+			}
+			if (down) {
+				grown |= down[i];
+			}
+
+			bits = grown & ~opaque[y * pitch + i];
+			if (i == pitch-1) {
+				bits &= lastmask;
+			}
+			if (!bits) {
 				continue;
+			}
 
-			// Set non-opaque neighbors of this pixel to black.
-			setTransparentNbrsTo(spr, x, y, black);
+			if (!spr->mask) {
+				spr->mask = calloc(pitch * spr->h, sizeof(uint32_t));
+				if (!spr->mask) {
+					perror("Could not allocate mask");
+					goto done;
+				}
+			}
+			mask = spr->mask + y * pitch + i;
+			*mask |= bits;
+
+			while (bits) {
+				x = __builtin_ctz(bits);
+				pixels[i * 32 + x] = black;
+				bits &= bits - 1;
+			}
 		}
 	}
 
+done:
+	free(opaque);
+	free(edges);
+	free(tmp);
+
 	// the above can leave non-black pixels on the border. Handle
 	// this.
 	sprite_fixupBlackContour(spr, black);
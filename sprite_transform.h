@@ -2,14 +2,38 @@
 #define _sprite_transform_h__
 
 #include "sprite.h"
+#include "palblend.h"
 
 void sprite_scaleNearWH(const sprite_t *src, sprite_t *dst, int w, int h);
 void sprite_scaleNear(const sprite_t *src, sprite_t *dst, double factor);
+/* Area averaging: Each dst pixel is the palette entry closest to the average
+ * color of the src pixels it covers. Meant for downscaling (src pixels are
+ * repeated when upscaling). Mixes are cached in pb (see palblend.h), keep it
+ * across frames. The transparent color is averaged like the others. */
+int sprite_scaleArea(const sprite_t *src, sprite_t *dst, palblend_t *pb);
 void sprite_scale2x(const sprite_t *src, sprite_t *dst);
 void sprite_scale3x(const sprite_t *src, sprite_t *dst);
 
+/* Scale2x/Scale3x steps (2 or 3) applied one after the other, like
+ * scaling into intermediate images, but rows go through all steps
+ * as they are produced. Only a few rows per step are kept in memory. */
+#define SCALE_CHAIN_MAX_STEPS	4
+int sprite_scaleChain(const sprite_t *src, sprite_t *dst, const int *steps, int num_steps);
+
 void sprite_rotate(const sprite_t *src, sprite_t *dst, double angle);
 
+/* Same result as scaling src up with Scale2x/Scale3x (steps are 2 or 3,
+ * applied in order), rotating with sprite_rotate and then scaling down to
+ * dst with sprite_scaleNear(..., downscale). But only the upscaled pixels
+ * which survive the downscale are computed, so the large intermediate
+ * images are never built. dst pixels are written, its mask is untouched.
+ *
+ * With no steps, src is used as is. It can be an image scaled up once
+ * and shared by many calls (the result is the same).
+ */
+#define ROTATE_MAX_UPSCALE_STEPS	4
+int sprite_rotateUpscaled(const sprite_t *src, sprite_t *dst, double angle, const int *steps, int num_steps, double downscale);
+
 void sprite_autoBlackContour(sprite_t *spr);
 
 #endif
@@ -0,0 +1,605 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "spx.h"
+
+#define SPX_MAGIC	"SPX1"
+
+struct spx_map {
+	uint8_t *base;
+	size_t size;
+	int refcount; // spx_file plus each sprite using it
+};
+
+struct spx_frame {
+	uint32_t palette;
+	uint8_t flags;
+	uint8_t transparent_color;
+	uint64_t pixels_offset;
+	uint64_t mask_offset;
+};
+
+struct spx_writer {
+	FILE *fptr;
+	int w, h;
+	int delay;
+	uint64_t offset; // current write position
+
+	int num_frames, alloc_frames;
+	struct spx_frame *frames;
+
+	int num_palettes, alloc_palettes;
+	palette_t **palettes;
+};
+
+static uint16_t getLE16(const uint8_t *buf, int *off)
+{
+	uint16_t v = buf[*off] | (buf[*off + 1] << 8);
+	*off += 2;
+	return v;
+}
+
+static uint32_t getLE32(const uint8_t *buf, int *off)
+{
+	uint32_t v = buf[*off] | (buf[*off + 1] << 8) | (buf[*off + 2] << 16) | ((uint32_t)buf[*off + 3] << 24);
+	*off += 4;
+	return v;
+}
+
+static uint64_t getLE64(const uint8_t *buf, int *off)
+{
+	uint64_t v = getLE32(buf, off);
+	return v | ((uint64_t)getLE32(buf, off) << 32);
+}
+
+static void putLE16(uint8_t *buf, int *off, uint16_t val)
+{
+	buf[(*off)++] = val;
+	buf[(*off)++] = val >> 8;
+}
+
+static void putLE32(uint8_t *buf, int *off, uint32_t val)
+{
+	putLE16(buf, off, val);
+	putLE16(buf, off, val >> 16);
+}
+
+static void putLE64(uint8_t *buf, int *off, uint64_t val)
+{
+	putLE32(buf, off, val);
+	putLE32(buf, off, val >> 32);
+}
+
+static int hostIsLittleEndian(void)
+{
+	uint16_t v = 1;
+	return *(uint8_t*)&v;
+}
+
+static int maskSize(int w, int h)
+{
+	return SPRITE_MASK_PITCH(w) * h * sizeof(uint32_t);
+}
+
+/**** Reading ****/
+
+int isSpxFile(const char *filename)
+{
+	FILE *fptr;
+	char magic[4];
+	int res = 0;
+
+	fptr = fopen(filename, "rb");
+	if (!fptr) {
+		return 0;
+	}
+
+	if (1 == fread(magic, 4, 1, fptr)) {
+		res = !memcmp(magic, SPX_MAGIC, 4);
+	}
+
+	fclose(fptr);
+
+	return res;
+}
+
+void spx_unrefMap(struct spx_map *map)
+{
+	if (map && --map->refcount == 0) {
+		munmap(map->base, map->size);
+		free(map);
+	}
+}
+
+int spx_mapContains(const struct spx_map *map, const void *ptr)
+{
+	const uint8_t *p = ptr;
+
+	return map && (p >= map->base) && (p < map->base + map->size);
+}
+
+static struct spx_map *mapFile(const char *filename)
+{
+	struct spx_map *map;
+	struct stat st;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		perror(filename);
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0) {
+		perror("fstat");
+		close(fd);
+		return NULL;
+	}
+
+	if (st.st_size < SPX_HEADER_SIZE) {
+		fprintf(stderr, "%s: File too short\n", filename);
+		close(fd);
+		return NULL;
+	}
+
+	map = calloc(1, sizeof(struct spx_map));
+	if (!map) {
+		perror("calloc");
+		close(fd);
+		return NULL;
+	}
+
+	// Private writable mapping: Tools may modify the pixels of loaded
+	// sprites, the changes never reach the file.
+	map->size = st.st_size;
+	map->base = mmap(NULL, map->size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map->base == MAP_FAILED) {
+		perror("mmap");
+		free(map);
+		return NULL;
+	}
+
+	map->refcount = 1;
+
+	return map;
+}
+
+// Check that size bytes at offset are within the file
+static int inMap(const struct spx_map *map, uint64_t offset, uint64_t size)
+{
+	return (offset <= map->size) && (size <= map->size - offset);
+}
+
+spx_file_t *spx_open(const char *filename)
+{
+	spx_file_t *spx;
+	const uint8_t *hdr;
+	int off = 4;
+
+	spx = calloc(1, sizeof(spx_file_t));
+	if (!spx) {
+		perror("calloc");
+		return NULL;
+	}
+
+	spx->map = mapFile(filename);
+	if (!spx->map) {
+		free(spx);
+		return NULL;
+	}
+
+	hdr = spx->map->base;
+	if (memcmp(hdr, SPX_MAGIC, 4)) {
+		fprintf(stderr, "%s: Not an SPX file\n", filename);
+		goto error;
+	}
+
+	spx->w = getLE16(hdr, &off);
+	spx->h = getLE16(hdr, &off);
+	spx->num_frames = getLE32(hdr, &off);
+	spx->num_palettes = getLE32(hdr, &off);
+	spx->delay = getLE32(hdr, &off);
+	off += 4; // reserved
+	spx->palettes_offset = getLE64(hdr, &off);
+	spx->frames_offset = getLE64(hdr, &off);
+
+	if (!inMap(spx->map, spx->palettes_offset, (uint64_t)spx->num_palettes * SPX_PALETTE_SIZE) ||
+		!inMap(spx->map, spx->frames_offset, (uint64_t)spx->num_frames * SPX_FRAME_SIZE) ||
+		spx->num_frames < 0 || spx->num_palettes < 0)
+	{
+		fprintf(stderr, "%s: Truncated or corrupted SPX file\n", filename);
+		goto error;
+	}
+
+	spx->palettes = calloc(spx->num_palettes + 1, sizeof(palette_t*));
+	if (!spx->palettes) {
+		perror("calloc");
+		goto error;
+	}
+
+	return spx;
+
+error:
+	spx_close(spx);
+	return NULL;
+}
+
+void spx_close(spx_file_t *spx)
+{
+	int i;
+
+	if (spx) {
+		if (spx->palettes) {
+			for (i=0; i<spx->num_palettes; i++) {
+				palette_unref(spx->palettes[i]);
+			}
+			free(spx->palettes);
+		}
+		spx_unrefMap(spx->map);
+		free(spx);
+	}
+}
+
+static palette_t *getPalette(spx_file_t *spx, uint32_t index)
+{
+	const uint8_t *src;
+	palette_t *pal;
+	int i, off = 0;
+
+	if (index >= spx->num_palettes) {
+		fprintf(stderr, "Invalid palette index %u\n", index);
+		return NULL;
+	}
+
+	if (!spx->palettes[index]) {
+		pal = palette_new();
+		if (!pal) {
+			return NULL;
+		}
+
+		src = spx->map->base + spx->palettes_offset + index * SPX_PALETTE_SIZE;
+		pal->count = getLE16(src, &off);
+		off += 2;
+		if (pal->count > 256) {
+			pal->count = 256;
+		}
+		for (i=0; i<256; i++) {
+			pal->colors[i].r = src[off++];
+			pal->colors[i].g = src[off++];
+			pal->colors[i].b = src[off++];
+			off++;
+		}
+
+		spx->palettes[index] = pal;
+	}
+
+	return palette_ref(spx->palettes[index]);
+}
+
+sprite_t *spx_getFrame(spx_file_t *spx, int frame)
+{
+	const uint8_t *entry;
+	struct spx_frame f;
+	sprite_t *spr;
+	int off = 0, mask_size;
+	uint32_t *mask;
+	int i;
+
+	if ((frame < 0) || (frame >= spx->num_frames)) {
+		fprintf(stderr, "Invalid frame %d\n", frame);
+		return NULL;
+	}
+
+	entry = spx->map->base + spx->frames_offset + frame * SPX_FRAME_SIZE;
+
+	f.palette = getLE32(entry, &off);
+	f.flags = entry[off++];
+	f.transparent_color = entry[off++];
+	off += 2; // reserved
+	f.pixels_offset = getLE64(entry, &off);
+	f.mask_offset = getLE64(entry, &off);
+
+	mask_size = maskSize(spx->w, spx->h);
+	if (!inMap(spx->map, f.pixels_offset, (uint64_t)spx->w * spx->h) ||
+		(f.mask_offset && !inMap(spx->map, f.mask_offset, mask_size)) ||
+		(f.mask_offset & 3))
+	{
+		fprintf(stderr, "Corrupted SPX frame %d\n", frame);
+		return NULL;
+	}
+
+	spr = calloc(1, sizeof(sprite_t));
+	if (!spr) {
+		perror("calloc");
+		return NULL;
+	}
+
+	spr->palette = getPalette(spx, f.palette);
+	if (!spr->palette) {
+		free(spr);
+		return NULL;
+	}
+
+	spr->w = spx->w;
+	spr->h = spx->h;
+	spr->flags = f.flags;
+	spr->transparent_color = f.transparent_color;
+	spr->storage = SPRITE_STORAGE_MAPPED;
+	spr->map = spx->map;
+	spr->map->refcount++;
+	spr->pixels = spx->map->base + f.pixels_offset;
+
+	if (f.mask_offset) {
+		mask = (uint32_t*)(spx->map->base + f.mask_offset);
+		if (!hostIsLittleEndian()) {
+			// Stored as little endian words. Make a native copy.
+			spr->mask = malloc(mask_size);
+			if (!spr->mask) {
+				perror("malloc");
+				freeSprite(spr);
+				return NULL;
+			}
+			for (i=0; i<mask_size/4; i++) {
+				off = i * 4;
+				spr->mask[i] = getLE32((const uint8_t*)mask, &off);
+			}
+		} else {
+			spr->mask = mask;
+		}
+	}
+
+	return spr;
+}
+
+/**** Writing ****/
+
+spx_writer_t *spx_create(const char *filename, int w, int h)
+{
+	spx_writer_t *wr;
+	uint8_t hdr[SPX_HEADER_SIZE] = { };
+
+	wr = calloc(1, sizeof(spx_writer_t));
+	if (!wr) {
+		perror("calloc");
+		return NULL;
+	}
+
+	wr->fptr = fopen(filename, "wb");
+	if (!wr->fptr) {
+		perror(filename);
+		free(wr);
+		return NULL;
+	}
+
+	wr->w = w;
+	wr->h = h;
+
+	// Placeholder, completed by spx_finish
+	if (1 != fwrite(hdr, SPX_HEADER_SIZE, 1, wr->fptr)) {
+		perror("fwrite");
+		fclose(wr->fptr);
+		free(wr);
+		return NULL;
+	}
+	wr->offset = SPX_HEADER_SIZE;
+
+	return wr;
+}
+
+void spx_setDelay(spx_writer_t *wr, int delay)
+{
+	wr->delay = delay;
+}
+
+// Write a plane at the next 16 byte boundary. Returns its offset, or 0 on error.
+static uint64_t writePlane(spx_writer_t *wr, const void *data, int size)
+{
+	static const uint8_t zeros[16];
+	int pad = (16 - (wr->offset & 15)) & 15;
+	uint64_t plane_offset;
+
+	if (pad && (1 != fwrite(zeros, pad, 1, wr->fptr))) {
+		perror("fwrite");
+		return 0;
+	}
+	wr->offset += pad;
+	plane_offset = wr->offset;
+
+	if (size && (1 != fwrite(data, size, 1, wr->fptr))) {
+		perror("fwrite");
+		return 0;
+	}
+	wr->offset += size;
+
+	return plane_offset;
+}
+
+static uint64_t writeMask(spx_writer_t *wr, const uint32_t *mask)
+{
+	int size = maskSize(wr->w, wr->h);
+	uint8_t *buf;
+	uint64_t res;
+	int i, off = 0;
+
+	if (hostIsLittleEndian()) {
+		return writePlane(wr, mask, size);
+	}
+
+	buf = malloc(size);
+	if (!buf) {
+		perror("malloc");
+		return 0;
+	}
+	for (i=0; i<size/4; i++) {
+		putLE32(buf, &off, mask[i]);
+	}
+	res = writePlane(wr, buf, size);
+	free(buf);
+
+	return res;
+}
+
+// Consecutive frames normally use the same palette. Only compare
+// with the last one.
+static int addPalette(spx_writer_t *wr, const palette_t *pal)
+{
+	palette_t **tmp;
+	palette_t *last;
+
+	if (wr->num_palettes) {
+		last = wr->palettes[wr->num_palettes - 1];
+		if ((last == pal) || palettes_match(last, pal)) {
+			return wr->num_palettes - 1;
+		}
+	}
+
+	if (wr->num_palettes >= wr->alloc_palettes) {
+		wr->alloc_palettes += 16;
+		tmp = realloc(wr->palettes, sizeof(palette_t*) * wr->alloc_palettes);
+		if (!tmp) {
+			perror("realloc");
+			return -1;
+		}
+		wr->palettes = tmp;
+	}
+
+	wr->palettes[wr->num_palettes] = palette_ref(pal);
+	if (!wr->palettes[wr->num_palettes]) {
+		return -1;
+	}
+
+	return wr->num_palettes++;
+}
+
+int spx_appendFrame(spx_writer_t *wr, const sprite_t *frame)
+{
+	struct spx_frame *f, *tmp;
+	int pal;
+
+	if ((frame->w != wr->w) || (frame->h != wr->h)) {
+		fprintf(stderr, "SPX frame size mismatch (%d x %d, expected %d x %d)\n", frame->w, frame->h, wr->w, wr->h);
+		return -1;
+	}
+
+	if (wr->num_frames >= wr->alloc_frames) {
+		wr->alloc_frames += 64;
+		tmp = realloc(wr->frames, sizeof(struct spx_frame) * wr->alloc_frames);
+		if (!tmp) {
+			perror("realloc");
+			return -1;
+		}
+		wr->frames = tmp;
+	}
+
+	pal = addPalette(wr, frame->palette);
+	if (pal < 0) {
+		return -1;
+	}
+
+	f = &wr->frames[wr->num_frames];
+	f->palette = pal;
+	f->flags = frame->flags;
+	f->transparent_color = frame->transparent_color;
+	f->mask_offset = 0;
+
+	f->pixels_offset = writePlane(wr, frame->pixels, wr->w * wr->h);
+	if (!f->pixels_offset) {
+		return -1;
+	}
+
+	if (frame->mask) {
+		f->mask_offset = writeMask(wr, frame->mask);
+		if (!f->mask_offset) {
+			return -1;
+		}
+	}
+
+	wr->num_frames++;
+
+	return 0;
+}
+
+int spx_finish(spx_writer_t *wr)
+{
+	uint8_t buf[SPX_PALETTE_SIZE];
+	uint64_t palettes_offset, frames_offset;
+	const palette_t *pal;
+	int i, j, off, res = -1;
+
+	palettes_offset = writePlane(wr, NULL, 0);
+	if (!palettes_offset) {
+		goto done;
+	}
+
+	for (i=0; i<wr->num_palettes; i++) {
+		pal = wr->palettes[i];
+		off = 0;
+		putLE16(buf, &off, pal->count);
+		putLE16(buf, &off, 0);
+		for (j=0; j<256; j++) {
+			buf[off++] = pal->colors[j].r;
+			buf[off++] = pal->colors[j].g;
+			buf[off++] = pal->colors[j].b;
+			buf[off++] = 0;
+		}
+		if (1 != fwrite(buf, SPX_PALETTE_SIZE, 1, wr->fptr)) {
+			perror("fwrite");
+			goto done;
+		}
+		wr->offset += SPX_PALETTE_SIZE;
+	}
+
+	frames_offset = wr->offset;
+	for (i=0; i<wr->num_frames; i++) {
+		off = 0;
+		putLE32(buf, &off, wr->frames[i].palette);
+		buf[off++] = wr->frames[i].flags;
+		buf[off++] = wr->frames[i].transparent_color;
+		putLE16(buf, &off, 0);
+		putLE64(buf, &off, wr->frames[i].pixels_offset);
+		putLE64(buf, &off, wr->frames[i].mask_offset);
+		if (1 != fwrite(buf, SPX_FRAME_SIZE, 1, wr->fptr)) {
+			perror("fwrite");
+			goto done;
+		}
+	}
+
+	off = 0;
+	memcpy(buf, SPX_MAGIC, 4);
+	off += 4;
+	putLE16(buf, &off, wr->w);
+	putLE16(buf, &off, wr->h);
+	putLE32(buf, &off, wr->num_frames);
+	putLE32(buf, &off, wr->num_palettes);
+	putLE32(buf, &off, wr->delay);
+	putLE32(buf, &off, 0);
+	putLE64(buf, &off, palettes_offset);
+	putLE64(buf, &off, frames_offset);
+
+	if (fseek(wr->fptr, 0, SEEK_SET) || (1 != fwrite(buf, SPX_HEADER_SIZE, 1, wr->fptr))) {
+		perror("Could not write SPX header");
+		goto done;
+	}
+
+	res = 0;
+
+done:
+	if (fclose(wr->fptr)) {
+		perror("fclose");
+		res = -1;
+	}
+	for (i=0; i<wr->num_palettes; i++) {
+		palette_unref(wr->palettes[i]);
+	}
+	free(wr->palettes);
+	free(wr->frames);
+	free(wr);
+
+	return res;
+}
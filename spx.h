@@ -0,0 +1,80 @@
+#ifndef _spx_h__
+#define _spx_h__
+
+#include <stdint.h>
+#include "sprite.h"
+
+/* SPX : Uncompressed sprite / animation container
+ *
+ * Meant for passing images between tools without paying for PNG or FLIC
+ * compression at every step. Files are mapped in memory and the pixels
+ * (and mask) of the loaded sprites point directly into the mapping.
+ *
+ * Layout (all values little endian):
+ *
+ *   Header       SPX_HEADER_SIZE bytes
+ *   Planes       For each frame, w*h pixel bytes followed by an optional
+ *                mask (SPRITE_MASK_PITCH(w) 32-bit words per row). Each
+ *                plane starts on a 16 byte boundary.
+ *   Palettes     num_palettes x SPX_PALETTE_SIZE bytes
+ *   Frame table  num_frames x SPX_FRAME_SIZE bytes
+ *
+ * Header:
+ *   0  magic "SPX1"
+ *   4  u16 width
+ *   6  u16 height
+ *   8  u32 number of frames
+ *   12 u32 number of palettes
+ *   16 u32 delay between frames (ms)
+ *   20 u32 reserved
+ *   24 u64 palettes offset
+ *   32 u64 frame table offset
+ *
+ * Palette: u16 color count, u16 reserved, then 256 x (r, g, b, 0)
+ *
+ * Frame:
+ *   0  u32 palette index
+ *   4  u8 sprite flags (SPRITE_FLAG_*)
+ *   5  u8 transparent color
+ *   6  u16 reserved
+ *   8  u64 pixels offset
+ *   16 u64 mask offset (0 if no mask)
+ */
+
+#define SPX_HEADER_SIZE		40
+#define SPX_PALETTE_SIZE	(4 + 256 * 4)
+#define SPX_FRAME_SIZE		24
+
+struct spx_map;
+
+typedef struct spx_file {
+	struct spx_map *map;
+	int w, h;
+	int num_frames;
+	int delay;
+	int num_palettes;
+	uint64_t palettes_offset, frames_offset;
+	palette_t **palettes; // loaded on first use, shared by frames
+} spx_file_t;
+
+int isSpxFile(const char *filename);
+
+spx_file_t *spx_open(const char *filename);
+void spx_close(spx_file_t *spx);
+// The returned sprite uses the mapping and stays valid after spx_close.
+sprite_t *spx_getFrame(spx_file_t *spx, int frame);
+
+// For freeSprite
+void spx_unrefMap(struct spx_map *map);
+int spx_mapContains(const struct spx_map *map, const void *ptr);
+
+
+typedef struct spx_writer spx_writer_t;
+
+spx_writer_t *spx_create(const char *filename, int w, int h);
+void spx_setDelay(spx_writer_t *wr, int delay);
+int spx_appendFrame(spx_writer_t *wr, const sprite_t *frame);
+// Write the palettes and frame table, then close the file.
+int spx_finish(spx_writer_t *wr);
+
+#endif // _spx_h__
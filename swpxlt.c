@@ -12,8 +12,6 @@
 
 int performRotateOperation(const sprite_t *spr_orig, sprite_t *spr_dst, int algo, double angle)
 {
-	sprite_t *tmp1, *tmp2;
-
 	switch(algo)
 	{
 		case ROT_ALGO_NOP:
@@ -25,67 +23,21 @@ int performRotateOperation(const sprite_t *spr_orig, sprite_t *spr_dst, int algo
 			return 0;
 
 		case ROT_ALGO_NICE2X:
-			tmp1 = createScaledSprite(spr_orig, SCALE_ALGO_2X, 2.0);
-			tmp2 = createRotatedSprite(tmp1, ROT_ALGO_NEAR, angle);
-			freeSprite(tmp1);
-			sprite_scaleNear(tmp2, spr_dst, 0.5);
-			freeSprite(tmp2);
-			return 0;
+			return sprite_rotateUpscaled(spr_orig, spr_dst, angle, (const int[]){ 2 }, 1, 0.5);
 
 		case ROT_ALGO_NICE3X:
-			tmp1 = createScaledSprite(spr_orig, SCALE_ALGO_2X, 3.0);
-			tmp2 = createRotatedSprite(tmp1, ROT_ALGO_NEAR, angle);
-			freeSprite(tmp1);
-			sprite_scaleNear(tmp2, spr_dst, 0.3333334);
-			freeSprite(tmp2);
-			return 0;
+			return sprite_rotateUpscaled(spr_orig, spr_dst, angle, (const int[]){ 3 }, 1, 0.3333334);
 
 		case ROT_ALGO_NICE4X:
-			tmp1 = createScaledSprite(spr_orig, SCALE_ALGO_2X, 4.0);
-			tmp2 = createRotatedSprite(tmp1, ROT_ALGO_NEAR, angle);
-			freeSprite(tmp1);
-			sprite_scaleNear(tmp2, spr_dst, 0.25);
-			freeSprite(tmp2);
-			return 0;
+			return sprite_rotateUpscaled(spr_orig, spr_dst, angle, (const int[]){ 2, 2 }, 2, 0.25);
 
 		case ROT_ALGO_NICE6X:
-			// Scale 3x
-			tmp1 = createScaledSprite(spr_orig, SCALE_ALGO_2X, 3.0);
-
-			// Scale 2x
-			tmp2 = createScaledSprite(tmp1, SCALE_ALGO_2X, 2.0);
-			freeSprite(tmp1);
-
-			// Rotate
-			tmp1 = createRotatedSprite(tmp2, ROT_ALGO_NEAR, angle);
-			freeSprite(tmp2);
-
-			// Scale down 1/8
-			sprite_scaleNear(tmp1, spr_dst, 0.166667);
-			freeSprite(tmp1);
-
-			return 0;
-
+			// Scale 3x, scale 2x, rotate, scale down 1/6
+			return sprite_rotateUpscaled(spr_orig, spr_dst, angle, (const int[]){ 3, 2 }, 2, 0.166667);
 
 		case ROT_ALGO_NICE8X:
-			// Scale 4x
-			tmp1 = createScaledSprite(spr_orig, SCALE_ALGO_2X, 4.0);
-
-			// Scale 2x
-			tmp2 = createScaledSprite(tmp1, SCALE_ALGO_2X, 2.0);
-			freeSprite(tmp1);
-
-			// Rotate
-			tmp1 = createRotatedSprite(tmp2, ROT_ALGO_NEAR, angle);
-			freeSprite(tmp2);
-
-			// Scale down 1/8
-			sprite_scaleNear(tmp1, spr_dst, 0.125);
-			freeSprite(tmp1);
-
-			return 0;
-
-
+			// Scale 4x, scale 2x, rotate, scale down 1/8
+			return sprite_rotateUpscaled(spr_orig, spr_dst, angle, (const int[]){ 2, 2, 2 }, 3, 0.125);
 	}
 
 	return -1;
@@ -94,8 +46,6 @@ int performRotateOperation(const sprite_t *spr_orig, sprite_t *spr_dst, int algo
 
 int performScaleOperation(const sprite_t *spr_orig, sprite_t *spr_dst, int algo, double factor)
 {
-	sprite_t *tmp;
-
 	switch(algo)
 	{
 		case SCALE_ALGO_NOP:
@@ -112,12 +62,11 @@ int performScaleOperation(const sprite_t *spr_orig, sprite_t *spr_dst, int algo,
 			} else if (factor == 3.0) {
 				sprite_scale3x(spr_orig, spr_dst);
 			} else if (factor == 4.0) {
-				tmp = duplicateSprite(spr_dst);
-				if (!tmp)
-					return -1;
-
-				sprite_scale2x(spr_orig, tmp);
-				sprite_scale2x(tmp, spr_dst);
+				return sprite_scaleChain(spr_orig, spr_dst, (const int[]){ 2, 2 }, 2);
+			} else if (factor == 6.0) {
+				return sprite_scaleChain(spr_orig, spr_dst, (const int[]){ 3, 2 }, 2);
+			} else if (factor == 8.0) {
+				return sprite_scaleChain(spr_orig, spr_dst, (const int[]){ 2, 2, 2 }, 3);
 			} else {
 				fprintf(stderr, "Error: Scale2x does not support factor %.2f\n", factor);
 				return -1;
@@ -135,7 +84,7 @@ sprite_t *createScaledSprite(const sprite_t *spr_orig, int algo, double factor)
 
 	s = allocSprite(spr_orig->w * factor,
 						spr_orig->h * factor,
-						spr_orig->palette.count, 0);
+						spr_orig->palette->count, 0);
 	if (!s)
 		return NULL;
 
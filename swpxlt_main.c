@@ -5,6 +5,7 @@
 #include "globals.h"
 
 #include "swpxlt.h"
+#include "threadpool.h"
 
 int g_verbose = 0;
 
@@ -85,6 +86,10 @@ void printHelp(void)
 	printf(" -R algo		   Rotation algorithm to use (defualt: %s)\n", getAlgoName(rot_algos, DEFAULT_ROT_ALGO));
 	printf(" -r angle          Rotate by angle (degrees)\n");
 	printf(" -p x              Pan image by X\n");
+	printf(" -M manifest       Batch mode: Run each line of the manifest as a separate job.\n");
+	printf("                   Lines contain the options above. Jobs start from the working\n");
+	printf("                   buffer and settings (-S, -R, -T) of the command line.\n");
+	printf(" -j threads        Number of threads for -M jobs (default: one per CPU)\n");
 	printf("\n\n");
 
 	printf("Available scaling altorithms:\n");
@@ -95,164 +100,581 @@ void printHelp(void)
 	listAlgos(rot_algos);
 }
 
+/* The options are first parsed into a list of operations, which is then
+ * run. In batch mode, the manifest lines are parsed in the main thread
+ * (getopt is not thread safe) and run by worker threads. */
+enum {
+	OP_LOAD,
+	OP_SAVE,
+	OP_SCALE,
+	OP_ROTATE,
+	OP_PAN,
+};
 
-int main(int argc, char **argv)
+struct op {
+	int type;
+	int algo; // scale/rotation algorithm, transparent color for OP_LOAD (-1 if none)
+	double value;
+	const char *filename;
+};
+
+struct program {
+	int num_ops, alloc_ops;
+	struct op *ops;
+	int line; // in the manifest
+	char *args; // manifest line (filenames point inside)
+};
+
+// Options which apply to later operations
+struct settings {
+	int scale_algo;
+	int rot_algo;
+	int transparent_color; // -1 if not forced
+};
+
+// Inputs of batch jobs, loaded once
+struct input {
+	const char *filename;
+	sprite_t *image;
+};
+
+struct job {
+	const struct program *prog;
+	const sprite_t *initial;
+	const struct input *inputs;
+	int num_inputs;
+	int result;
+};
+
+static int addOp(struct program *prog, int type, int algo, double value, const char *filename)
 {
-	int opt, scale_algo = DEFAULT_SCALE_ALGO, rot_algo = DEFAULT_ROT_ALGO;
-	int retcode = 0;
+	struct op *ops;
+
+	if (prog->num_ops >= prog->alloc_ops) {
+		ops = realloc(prog->ops, (prog->alloc_ops + 16) * sizeof(struct op));
+		if (!ops) {
+			perror("realloc");
+			return -1;
+		}
+		prog->ops = ops;
+		prog->alloc_ops += 16;
+	}
+
+	prog->ops[prog->num_ops].type = type;
+	prog->ops[prog->num_ops].algo = algo;
+	prog->ops[prog->num_ops].value = value;
+	prog->ops[prog->num_ops].filename = filename;
+	prog->num_ops++;
+
+	return 0;
+}
+
+/* Parse options into prog. Batch options (-M, -j) are only accepted if
+ * manifest and threads are not NULL. Returns 1 if the program should exit
+ * without error (eg: -h), -1 on error. */
+static int parseProgram(int argc, char **argv, struct program *prog, struct settings *set, const char **manifest, int *threads)
+{
+	int opt, value;
+	double d;
 	char *e;
-	double scale_factor = 1.0;
-	double rotate_angle = 0;
-	int force_transparent_color = 0;
-	int transparent_color = 0;
-	sprite_t *working_image = NULL, *tmp_image = NULL;
-	int panx = 0;
-
-	while ((opt = getopt(argc, argv, "hvi:o:S:s:R:r:T:p:")) != -1) {
+
+	// (glibc) Restart scanning, possibly with a different argv
+	optind = 0;
+
+	while ((opt = getopt(argc, argv, manifest ? "hvi:o:S:s:R:r:T:p:M:j:" : "i:o:S:s:R:r:T:p:")) != -1) {
 		switch (opt) {
 			case '?': return -1;
-			case 'h': printHelp(); return 0;
+			case 'h': printHelp(); return 1;
 			case 'v': g_verbose = 1; break;
 
 			case 'p':
-					panx = strtol(optarg, &e, 0);
+					value = strtol(optarg, &e, 0);
 					if (e == optarg) {
 						fprintf(stderr, "Invalid pan value\n");
-						retcode = 1;
-						goto error;
+						return -1;
 					}
-					if (!working_image) {
-						fprintf(stderr, "Error: No image loaded.\n");
-						retcode = 1;
-						goto error;
+					if (addOp(prog, OP_PAN, 0, value, NULL)) {
+						return -1;
 					}
-					sprite_panX(working_image, panx);
 					break;
 
 			case 'T':
-					transparent_color = strtol(optarg, &e, 0);
-					if ((e == optarg) || (transparent_color<0) || (transparent_color>255) ) {
+					value = strtol(optarg, &e, 0);
+					if ((e == optarg) || (value<0) || (value>255) ) {
 						fprintf(stderr, "Invalid color specified\n");
-						retcode = 1;
-						goto error;
+						return -1;
 					}
-					force_transparent_color = 1;
+					set->transparent_color = value;
 					break;
 
 			case 'i': // Load an input image
-					if (working_image) {
-						fprintf(stderr, "Warning: Replacing working image by %s", optarg);
-						freeSprite(working_image);
-					}
-					working_image = sprite_loadPNG(optarg, 0, 0);
-					if (!working_image) {
-						retcode = 1;
-						goto error;
-					}
-
-					if (force_transparent_color) {
-						if (working_image->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR) {
-							if (working_image->transparent_color != transparent_color) {
-								fprintf(stderr, "Warning: File-defined transparent color (%d) overridden from command line (-C %d)\n",
-									working_image->transparent_color, transparent_color);
-							}
-						}
-						working_image->transparent_color = transparent_color;
-						working_image->flags |= SPRITE_FLAG_USE_TRANSPARENT_COLOR;
-					}
-
-					if (g_verbose) {
-						printf("Loaded image %s (%d x %d), flags 0x%02x - t %d\n",
-							optarg,
-							working_image->w,
-							working_image->h,
-							working_image->flags,
-							working_image->transparent_color);
+					if (addOp(prog, OP_LOAD, set->transparent_color, 0, optarg)) {
+						return -1;
 					}
 					break;
 
 			case 'o': // Write current buffer to file
-					sprite_savePNG(optarg, working_image, 0);
-
-					if (g_verbose) {
-						printf("Write image %s (%d x %d), flags 0x%02x - t %d\n",
-							optarg,
-							working_image->w,
-							working_image->h,
-							working_image->flags,
-							working_image->transparent_color);
+					if (addOp(prog, OP_SAVE, 0, 0, optarg)) {
+						return -1;
 					}
 					break;
 
 			case 'S':
-				scale_algo = parseAlgoName(scale_algos, optarg);
-				if (scale_algo < 0) {
+				set->scale_algo = parseAlgoName(scale_algos, optarg);
+				if (set->scale_algo < 0) {
 					fprintf(stderr, "Unknown scale algo: %s\n", optarg);
-					retcode = 1;
-					goto error;
+					return -1;
 				}
 				break;
 
 			case 's': // Scale working image
-				if (!working_image) {
-					fprintf(stderr, "Error: No image loaded.\n");
-					retcode = 1;
-					goto error;
-				}
-				scale_factor = strtod(optarg, &e);
+				d = strtod(optarg, &e);
 				if (e == optarg) {
 					perror(optarg);
-					retcode = 1;
-					goto error;
+					return -1;
 				}
-				tmp_image = createScaledSprite(working_image, scale_algo, scale_factor);
-				if (!tmp_image) {
-					retcode = 1;
-					goto error;
+				if (addOp(prog, OP_SCALE, set->scale_algo, d, NULL)) {
+					return -1;
 				}
-				freeSprite(working_image);
-				working_image = tmp_image;
-
 				break;
 
 			case 'R':
-				rot_algo = parseAlgoName(rot_algos, optarg);
-				if (scale_algo < 0) {
+				set->rot_algo = parseAlgoName(rot_algos, optarg);
+				if (set->rot_algo < 0) {
 					fprintf(stderr, "Unknown rotation algo: %s\n", optarg);
-					retcode = 1;
-					goto error;
+					return -1;
 				}
 				break;
 
 			case 'r': // Rotate working image
+				d = strtod(optarg, &e);
+				if (e == optarg) {
+					perror(optarg);
+					return -1;
+				}
+				if (addOp(prog, OP_ROTATE, set->rot_algo, d, NULL)) {
+					return -1;
+				}
+				break;
+
+			case 'M':
+				*manifest = optarg;
+				break;
+
+			case 'j':
+				*threads = strtol(optarg, &e, 0);
+				if ((e == optarg) || (*threads < 0)) {
+					fprintf(stderr, "Invalid thread count\n");
+					return -1;
+				}
+				break;
+		}
+	}
+
+	if (optind < argc) {
+		fprintf(stderr, "Unexpected argument: %s\n", argv[optind]);
+		return -1;
+	}
+
+	return 0;
+}
+
+// Images of -i options, preloaded in batch mode (NULL otherwise)
+static sprite_t *loadInput(const struct op *op, const struct input *inputs, int num_inputs)
+{
+	int i;
+
+	for (i=0; i<num_inputs; i++) {
+		if (0 == strcmp(inputs[i].filename, op->filename)) {
+			return inputs[i].image ? duplicateSprite(inputs[i].image) : NULL;
+		}
+	}
+
+	return sprite_load(op->filename, 0, 0);
+}
+
+/* Run the operations, starting with a copy of initial (may be NULL). The
+ * resulting working image is returned in *result (if not NULL) */
+static int runProgram(const struct program *prog, const sprite_t *initial, const struct input *inputs, int num_inputs, sprite_t **result)
+{
+	sprite_t *working_image = NULL, *tmp_image;
+	const struct op *op;
+	int i, retcode = 0;
+
+	if (initial) {
+		working_image = duplicateSprite(initial);
+		if (!working_image) {
+			return 1;
+		}
+	}
+
+	for (i=0; i<prog->num_ops; i++) {
+		op = &prog->ops[i];
+
+		if ((op->type != OP_LOAD) && !working_image) {
+			fprintf(stderr, "Error: No image loaded.\n");
+			retcode = 1;
+			goto error;
+		}
+
+		switch (op->type)
+		{
+			case OP_LOAD:
+				if (working_image) {
+					// Jobs replacing the batch image are expected
+					if (i > 0 || !initial) {
+						fprintf(stderr, "Warning: Replacing working image by %s", op->filename);
+					}
+					freeSprite(working_image);
+				}
+				working_image = loadInput(op, inputs, num_inputs);
 				if (!working_image) {
-					fprintf(stderr, "Error: No image loaded.\n");
 					retcode = 1;
 					goto error;
 				}
 
-				rotate_angle = strtod(optarg, &e);
-				if (e == optarg) {
-					perror(optarg);
+				if (op->algo >= 0) {
+					if (working_image->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR) {
+						if (working_image->transparent_color != op->algo) {
+							fprintf(stderr, "Warning: File-defined transparent color (%d) overridden from command line (-C %d)\n",
+								working_image->transparent_color, op->algo);
+						}
+					}
+					working_image->transparent_color = op->algo;
+					working_image->flags |= SPRITE_FLAG_USE_TRANSPARENT_COLOR;
+				}
+
+				if (g_verbose) {
+					printf("Loaded image %s (%d x %d), flags 0x%02x - t %d\n",
+						op->filename,
+						working_image->w,
+						working_image->h,
+						working_image->flags,
+						working_image->transparent_color);
+				}
+				break;
+
+			case OP_SAVE:
+				if (sprite_save(op->filename, working_image, 0)) {
 					retcode = 1;
 					goto error;
 				}
 
-				tmp_image = createRotatedSprite(working_image, rot_algo, rotate_angle);
+				if (g_verbose) {
+					printf("Write image %s (%d x %d), flags 0x%02x - t %d\n",
+						op->filename,
+						working_image->w,
+						working_image->h,
+						working_image->flags,
+						working_image->transparent_color);
+				}
+				break;
+
+			case OP_PAN:
+				sprite_panX(working_image, op->value);
+				break;
+
+			case OP_SCALE:
+				tmp_image = createScaledSprite(working_image, op->algo, op->value);
 				if (!tmp_image) {
 					retcode = 1;
 					goto error;
 				}
 				freeSprite(working_image);
 				working_image = tmp_image;
+				break;
 
+			case OP_ROTATE:
+				tmp_image = createRotatedSprite(working_image, op->algo, op->value);
+				if (!tmp_image) {
+					retcode = 1;
+					goto error;
+				}
+				freeSprite(working_image);
+				working_image = tmp_image;
 				break;
+		}
+	}
+
+	if (result) {
+		*result = working_image;
+		return 0;
+	}
+
+error:
+	if (working_image) {
+		freeSprite(working_image);
+	}
+
+	return retcode;
+}
+
+// Split a manifest line in arguments. Double quotes group words.
+static int splitLine(char *line, char **argv, int max_args)
+{
+	int argc = 1;
+	char *p = line;
+
+	argv[0] = "swpxlt";
+
+	while (*p) {
+		while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') {
+			p++;
+		}
+		if (!*p) {
+			break;
+		}
+		if (argc >= max_args - 1) {
+			return -1;
+		}
+		if (*p == '"') {
+			p++;
+			argv[argc++] = p;
+			while (*p && *p != '"') {
+				p++;
+			}
+		} else {
+			argv[argc++] = p;
+			while (*p && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') {
+				p++;
+			}
+		}
+		if (*p) {
+			*p = 0;
+			p++;
+		}
+	}
+	argv[argc] = NULL;
+
+	return argc;
+}
+
+static void freePrograms(struct program *progs, int count)
+{
+	int i;
+
+	for (i=0; i<count; i++) {
+		free(progs[i].ops);
+		free(progs[i].args);
+	}
+	free(progs);
+}
+
+// Returns the number of programs loaded in *progs, or -1 on error.
+static int loadManifest(const char *filename, const struct settings *initial_settings, struct program **progs)
+{
+	FILE *fptr;
+	char linebuf[4096];
+	char *line;
+	char *argv[256];
+	int argc, count = 0, alloc = 0, linenum = 0;
+	struct program *p;
+	struct settings set;
+
+	*progs = NULL;
+
+	fptr = fopen(filename, "r");
+	if (!fptr) {
+		perror(filename);
+		return -1;
+	}
+
+	while (fgets(linebuf, sizeof(linebuf), fptr)) {
+		linenum++;
+
+		// Arguments point inside the line, keep it.
+		line = strdup(linebuf);
+		if (!line) {
+			perror("strdup");
+			goto error;
+		}
+
+		argc = splitLine(line, argv, 256);
+		if (argc < 0) {
+			fprintf(stderr, "%s:%d: Too many arguments\n", filename, linenum);
+			free(line);
+			goto error;
+		}
+		if ((argc < 2) || (argv[1][0] == '#')) {
+			free(line);
+			continue;
+		}
 
+		if (count >= alloc) {
+			p = realloc(*progs, (alloc + 64) * sizeof(struct program));
+			if (!p) {
+				perror("realloc");
+				free(line);
+				goto error;
+			}
+			*progs = p;
+			alloc += 64;
+		}
+		p = &(*progs)[count];
+		memset(p, 0, sizeof(struct program));
+		p->line = linenum;
+		p->args = line;
+		count++;
+
+		set = *initial_settings;
+		if (parseProgram(argc, argv, p, &set, NULL, NULL)) {
+			fprintf(stderr, "%s:%d: Invalid job\n", filename, linenum);
+			goto error;
 		}
 	}
 
-	retcode = 0;
+	fclose(fptr);
+
+	return count;
+
 error:
+	fclose(fptr);
+	freePrograms(*progs, count);
+	*progs = NULL;
+	return -1;
+}
+
+static void loadInputJob(void *arg)
+{
+	struct input *input = arg;
+
+	input->image = sprite_load(input->filename, 0, 0);
+}
+
+static void runJob(void *arg)
+{
+	struct job *job = arg;
+
+	job->result = runProgram(job->prog, job->initial, job->inputs, job->num_inputs, NULL);
+}
+
+static int runBatch(const struct program *progs, int count, const sprite_t *initial, int threads)
+{
+	struct threadpool *pool;
+	struct input *inputs = NULL;
+	struct job *jobs;
+	int num_inputs = 0;
+	int i, j, k, retcode = 0;
+
+	jobs = calloc(count, sizeof(struct job));
+	if (!jobs) {
+		perror("calloc");
+		return 1;
+	}
+
+	// Each file loaded by the jobs is decoded once.
+	for (i=0; i<count; i++) {
+		for (j=0; j<progs[i].num_ops; j++) {
+			if (progs[i].ops[j].type != OP_LOAD) {
+				continue;
+			}
+			for (k=0; k<num_inputs; k++) {
+				if (0 == strcmp(inputs[k].filename, progs[i].ops[j].filename)) {
+					break;
+				}
+			}
+			if (k < num_inputs) {
+				continue;
+			}
+			if (!(num_inputs & 63)) {
+				struct input *tmp = realloc(inputs, (num_inputs + 64) * sizeof(struct input));
+				if (!tmp) {
+					perror("realloc");
+					free(inputs);
+					free(jobs);
+					return 1;
+				}
+				inputs = tmp;
+			}
+			inputs[num_inputs].filename = progs[i].ops[j].filename;
+			inputs[num_inputs].image = NULL;
+			num_inputs++;
+		}
+	}
+
+	pool = threadpool_create(threads);
+	if (!pool) {
+		free(inputs);
+		free(jobs);
+		return 1;
+	}
+
+	for (i=0; i<num_inputs; i++) {
+		if (threadpool_add(pool, loadInputJob, &inputs[i])) {
+			loadInputJob(&inputs[i]);
+		}
+	}
+	threadpool_wait(pool);
+
+	// The inputs are now only read, jobs work on copies.
+	for (i=0; i<count; i++) {
+		jobs[i].prog = &progs[i];
+		jobs[i].initial = initial;
+		jobs[i].inputs = inputs;
+		jobs[i].num_inputs = num_inputs;
+		if (threadpool_add(pool, runJob, &jobs[i])) {
+			runJob(&jobs[i]);
+		}
+	}
+
+	threadpool_free(pool);
+
+	for (i=0; i<count; i++) {
+		if (jobs[i].result) {
+			fprintf(stderr, "Job on line %d failed\n", progs[i].line);
+			retcode = 1;
+		}
+	}
+
+	for (i=0; i<num_inputs; i++) {
+		if (inputs[i].image) {
+			freeSprite(inputs[i].image);
+		}
+	}
+	free(inputs);
+	free(jobs);
+
+	return retcode;
+}
+
+int main(int argc, char **argv)
+{
+	int retcode = 0;
+	struct settings set = { DEFAULT_SCALE_ALGO, DEFAULT_ROT_ALGO, -1 };
+	struct program prog = { };
+	struct program *jobs = NULL;
+	const char *manifest = NULL;
+	sprite_t *working_image = NULL;
+	int threads = 0;
+	int i, count;
+
+	i = parseProgram(argc, argv, &prog, &set, &manifest, &threads);
+	if (i) {
+		free(prog.ops);
+		return i < 0 ? -1 : 0;
+	}
+
+	if (!manifest) {
+		retcode = runProgram(&prog, NULL, NULL, 0, NULL);
+		free(prog.ops);
+		return retcode;
+	}
+
+	// The command line prepares the working image for the jobs
+	if (runProgram(&prog, NULL, NULL, 0, &working_image)) {
+		free(prog.ops);
+		return 1;
+	}
+
+	count = loadManifest(manifest, &set, &jobs);
+	if (count < 0) {
+		retcode = 1;
+	} else {
+		retcode = runBatch(jobs, count, working_image, threads);
+	}
+
+	freePrograms(jobs, count);
+	free(prog.ops);
 
 	if (working_image) {
 		freeSprite(working_image);
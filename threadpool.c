@@ -0,0 +1,154 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "threadpool.h"
+
+struct threadpool_job {
+	void (*func)(void *arg);
+	void *arg;
+	struct threadpool_job *next;
+};
+
+int threadpool_numCPUs(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	return n < 1 ? 1 : n;
+}
+
+static void *worker(void *arg)
+{
+	struct threadpool *pool = arg;
+	struct threadpool_job *job;
+
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->head && !pool->quit) {
+			pthread_cond_wait(&pool->job_added, &pool->lock);
+		}
+		if (!pool->head) {
+			break; // quit, and nothing left to do
+		}
+
+		job = pool->head;
+		pool->head = job->next;
+		if (!pool->head) {
+			pool->tail = NULL;
+		}
+
+		pthread_mutex_unlock(&pool->lock);
+		job->func(job->arg);
+		free(job);
+		pthread_mutex_lock(&pool->lock);
+
+		pool->pending--;
+		if (pool->pending == 0) {
+			pthread_cond_broadcast(&pool->job_done);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return NULL;
+}
+
+struct threadpool *threadpool_create(int num_threads)
+{
+	struct threadpool *pool;
+	int i;
+
+	if (num_threads <= 0) {
+		num_threads = threadpool_numCPUs();
+	}
+
+	pool = calloc(1, sizeof(struct threadpool));
+	if (!pool) {
+		perror("calloc");
+		return NULL;
+	}
+
+	pool->threads = calloc(num_threads, sizeof(pthread_t));
+	if (!pool->threads) {
+		perror("calloc");
+		free(pool);
+		return NULL;
+	}
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->job_added, NULL);
+	pthread_cond_init(&pool->job_done, NULL);
+
+	for (i=0; i<num_threads; i++) {
+		if (pthread_create(&pool->threads[i], NULL, worker, pool)) {
+			fprintf(stderr, "Could not create worker thread\n");
+			break;
+		}
+		pool->num_threads++;
+	}
+
+	if (pool->num_threads == 0) {
+		threadpool_free(pool);
+		return NULL;
+	}
+
+	return pool;
+}
+
+void threadpool_free(struct threadpool *pool)
+{
+	int i;
+
+	if (!pool) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	pool->quit = 1;
+	pthread_cond_broadcast(&pool->job_added);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i=0; i<pool->num_threads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+
+	pthread_cond_destroy(&pool->job_done);
+	pthread_cond_destroy(&pool->job_added);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+	free(pool);
+}
+
+int threadpool_add(struct threadpool *pool, void (*func)(void *arg), void *arg)
+{
+	struct threadpool_job *job;
+
+	job = malloc(sizeof(struct threadpool_job));
+	if (!job) {
+		perror("malloc");
+		return -1;
+	}
+	job->func = func;
+	job->arg = arg;
+	job->next = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail) {
+		pool->tail->next = job;
+	} else {
+		pool->head = job;
+	}
+	pool->tail = job;
+	pool->pending++;
+	pthread_cond_signal(&pool->job_added);
+	pthread_mutex_unlock(&pool->lock);
+
+	return 0;
+}
+
+void threadpool_wait(struct threadpool *pool)
+{
+	pthread_mutex_lock(&pool->lock);
+	while (pool->pending) {
+		pthread_cond_wait(&pool->job_done, &pool->lock);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
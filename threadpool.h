@@ -0,0 +1,38 @@
+#ifndef _threadpool_h__
+#define _threadpool_h__
+
+#include <pthread.h>
+
+/* Fixed size pool of worker threads
+ *
+ * Jobs are run in the order they were added, but may complete in any order.
+ * Jobs must not touch shared state (or must do their own locking). In
+ * particular, g_verbose output from concurrent jobs may be interleaved.
+ */
+
+struct threadpool_job;
+
+struct threadpool {
+	int num_threads;
+	pthread_t *threads;
+	pthread_mutex_t lock;
+	pthread_cond_t job_added;
+	pthread_cond_t job_done;
+
+	struct threadpool_job *head, *tail;
+	int pending; // queued or running
+	int quit;
+};
+
+// 0 threads means one per CPU
+struct threadpool *threadpool_create(int num_threads);
+// Waits for all jobs to complete, then stops the workers.
+void threadpool_free(struct threadpool *pool);
+
+int threadpool_add(struct threadpool *pool, void (*func)(void *arg), void *arg);
+// Wait until all jobs added so far are done.
+void threadpool_wait(struct threadpool *pool);
+
+int threadpool_numCPUs(void);
+
+#endif // _threadpool_h__
@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdlib.h>
 #include "tilecatalog.h"
+#include "pixconv.h"
 
 
 tilecatalog_t *tilecat_new(void)
@@ -120,10 +121,19 @@ static int tilecat_isInCatalogFlags(tilecatalog_t *tc, uint8_t *image_8bpp, uint
 
 
 int tilecat_isTileInCatalog(tilecatalog_t *tc, sprite_t *img, int x, int y, uint32_t *tid, uint8_t *flags)
+{
+	sprite_view_t view;
+
+	sprite_getView(img, NULL, &view);
+
+	return tilecat_isViewTileInCatalog(tc, &view, x, y, tid, flags);
+}
+
+int tilecat_isViewTileInCatalog(tilecatalog_t *tc, const sprite_view_t *img, int x, int y, uint32_t *tid, uint8_t *flags)
 {
 	uint8_t image_8bpp[64];
 
-	sprite_getPixels8x8(img, x, y, image_8bpp);
+	sprite_viewGetPixels8x8(img, x, y, image_8bpp);
 
 	if (tilecat_isInCatalogFlags(tc, image_8bpp, tid, flags)) {
 		return 1;
@@ -171,14 +181,31 @@ static int tilecat_addTile(tilecatalog_t *tc, uint8_t *image_8bpp, uint32_t *tid
 	return 0;
 }
 
+static int tilecat_add8bpp(tilecatalog_t *tc, uint8_t *image_8bpp, uint32_t *id, uint8_t *flags);
+
 int tilecat_addFromSprite(tilecatalog_t *tc, sprite_t *src, int x, int y, uint32_t *id, uint8_t *flags)
+{
+	sprite_view_t view;
+
+	sprite_getView(src, NULL, &view);
+
+	return tilecat_addFromView(tc, &view, x, y, id, flags);
+}
+
+int tilecat_addFromView(tilecatalog_t *tc, const sprite_view_t *src, int x, int y, uint32_t *id, uint8_t *flags)
 {
 	uint8_t image_8bpp[64];
-	uint32_t tid;
-	uint8_t tflags;
 
 	//  Get 8x8 area
-	sprite_getPixels8x8(src, x, y, image_8bpp);
+	sprite_viewGetPixels8x8(src, x, y, image_8bpp);
+
+	return tilecat_add8bpp(tc, image_8bpp, id, flags);
+}
+
+static int tilecat_add8bpp(tilecatalog_t *tc, uint8_t *image_8bpp, uint32_t *id, uint8_t *flags)
+{
+	uint32_t tid;
+	uint8_t tflags;
 
 	if (tilecat_isInCatalogFlags(tc, image_8bpp, &tid, &tflags)) {
 //		printf("Already cataloged, ID is %u\n", tid);
@@ -215,6 +242,15 @@ int tilecat_addFromSprite(tilecatalog_t *tc, sprite_t *src, int x, int y, uint32
 }
 
 int tilecat_addAllFromSprite(tilecatalog_t *tc, sprite_t *src, tilemap_t *tm)
+{
+	sprite_view_t view;
+
+	sprite_getView(src, NULL, &view);
+
+	return tilecat_addAllFromView(tc, &view, tm);
+}
+
+int tilecat_addAllFromView(tilecatalog_t *tc, const sprite_view_t *src, tilemap_t *tm)
 {
 	int x,y;
 	uint32_t tid;
@@ -222,7 +258,7 @@ int tilecat_addAllFromSprite(tilecatalog_t *tc, sprite_t *src, tilemap_t *tm)
 
 	for (y=0; y<src->h; y+=8) {
 		for (x=0; x<src->w; x+=8) {
-			if (tilecat_addFromSprite(tc, src, x, y, &tid, &flags)) {
+			if (tilecat_addFromView(tc, src, x, y, &tid, &flags)) {
 				return -1;
 			}
 			if (tm) {
@@ -234,6 +270,27 @@ int tilecat_addAllFromSprite(tilecatalog_t *tc, sprite_t *src, tilemap_t *tm)
 	return 0;
 }
 
+int tilecat_addAllFromTiledMap(tilecatalog_t *tc, const tiledmap_t *src, tilemap_t *tm)
+{
+	int x,y;
+	uint32_t tid;
+	uint8_t flags;
+
+	// Blocks are tiles, no need to gather pixels.
+	for (y=0; y<src->blocks_h; y++) {
+		for (x=0; x<src->blocks_w; x++) {
+			if (tilecat_add8bpp(tc, tiledmap_getBlock(src, x, y), &tid, &flags)) {
+				return -1;
+			}
+			if (tm) {
+				tilemap_setTileID(tm, x, y, tid, flags);
+			}
+		}
+	}
+
+	return 0;
+}
+
 void tilecat_printInfo(tilecatalog_t *tc)
 {
 	uint32_t i;
@@ -399,27 +456,6 @@ void tilecat_mixTiles(tilecatalog_t *tc, uint32_t tile1, uint32_t tile2)
 	}
 }
 
-static void convert8bppTo2bppPlanar(const uint8_t src[64], uint8_t dst[32])
-{
-	int row, col;
-	uint8_t ob = 0, bit;
-	int i;
-
-	i = 0;
-	for (row = 0; row < 8; row++) {
-		for (bit = 1; bit <= 8; bit <<= 1) {
-			for (col = 0; col < 8; col++) {
-				ob <<= 1;
-				if (src[row*8+col] & bit) {
-					ob |= 1;
-				}
-			}
-			dst[i] = ob;
-			i++;
-		}
-	}
-}
-
 int tilecat_updateNative(tilecatalog_t *tc)
 {
 	uint32_t id;
@@ -427,7 +463,8 @@ int tilecat_updateNative(tilecatalog_t *tc)
 
 	tile = tc->tiles;
 	for (id = 0; id<tc->num_tiles; id++, tile++) {
-		convert8bppTo2bppPlanar(tile->image_8bpp, tile->native);
+		// 4 bitplanes, interleaved per row
+		pixconv_toPlanes(tile->native, tile->image_8bpp, 64, 4, 1, 4);
 	}
 
 	return 0;
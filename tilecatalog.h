@@ -4,6 +4,7 @@
 #include <stdint.h>
 #include "sprite.h"
 #include "tilemap.h"
+#include "tiledmap.h"
 
 typedef struct _tilemap tilemap_t;
 
@@ -35,14 +36,18 @@ void tilecat_clear(tilecatalog_t *tc, int freemem);
 // flags : Flip x/y flags (when found in catalog but flipped) (can be NULL)
 //
 int tilecat_addFromSprite(tilecatalog_t *tc, sprite_t *src, int x, int y, uint32_t *id, uint8_t *flags);
+int tilecat_addFromView(tilecatalog_t *tc, const sprite_view_t *src, int x, int y, uint32_t *id, uint8_t *flags);
 
 // check if the 8x8 area of img (origin given in pixel) matches a tile
 // already in catalog. catalog id returned in tid, flip flags in flags.
 // returns true/false
 int tilecat_isTileInCatalog(tilecatalog_t *tc, sprite_t *img, int x, int y, uint32_t *tid, uint8_t *flags);
+int tilecat_isViewTileInCatalog(tilecatalog_t *tc, const sprite_view_t *img, int x, int y, uint32_t *tid, uint8_t *flags);
 
 // tm can be NULL
 int tilecat_addAllFromSprite(tilecatalog_t *tc, sprite_t *src, tilemap_t *tm);
+int tilecat_addAllFromView(tilecatalog_t *tc, const sprite_view_t *src, tilemap_t *tm);
+int tilecat_addAllFromTiledMap(tilecatalog_t *tc, const tiledmap_t *src, tilemap_t *tm);
 
 void tilecat_printInfo(tilecatalog_t *tc);
 int tilecat_toPNG(tilecatalog_t *tc, palette_t *palette, const char *savecat_filename);
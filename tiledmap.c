@@ -0,0 +1,420 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <png.h>
+#include "tiledmap.h"
+#include "sprite.h"
+#include "pngopts.h"
+#include "globals.h"
+
+static int openBackingFile(const char *filename)
+{
+	char tmpname[512];
+	const char *dir;
+	int fd;
+
+	if (filename) {
+		fd = open(filename, O_RDWR | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0) {
+			perror(filename);
+		}
+		return fd;
+	}
+
+	dir = getenv("TMPDIR");
+	if (!dir) {
+		dir = "/tmp";
+	}
+	snprintf(tmpname, sizeof(tmpname), "%s/tiledmapXXXXXX", dir);
+
+	fd = mkstemp(tmpname);
+	if (fd < 0) {
+		perror(tmpname);
+		return -1;
+	}
+	// Goes away when closed
+	unlink(tmpname);
+
+	return fd;
+}
+
+tiledmap_t *tiledmap_create(int w, int h, const char *backing_filename)
+{
+	tiledmap_t *tm;
+
+	if ((w < 1) || (h < 1)) {
+		fprintf(stderr, "Invalid map size %d x %d\n", w, h);
+		return NULL;
+	}
+
+	tm = calloc(1, sizeof(tiledmap_t));
+	if (!tm) {
+		perror("calloc");
+		return NULL;
+	}
+
+	tm->w = w;
+	tm->h = h;
+	tm->blocks_w = (w + 7) / 8;
+	tm->blocks_h = (h + 7) / 8;
+	tm->size = (size_t)tm->blocks_w * tm->blocks_h * 64;
+	tm->blocks = MAP_FAILED;
+	tm->fd = -1;
+
+	tm->palette = palette_new();
+	if (!tm->palette) {
+		goto error;
+	}
+
+	tm->fd = openBackingFile(backing_filename);
+	if (tm->fd < 0) {
+		goto error;
+	}
+
+	if (ftruncate(tm->fd, tm->size)) {
+		perror("Could not size map backing file");
+		goto error;
+	}
+
+	tm->blocks = mmap(NULL, tm->size, PROT_READ | PROT_WRITE, MAP_SHARED, tm->fd, 0);
+	if (tm->blocks == MAP_FAILED) {
+		perror("mmap");
+		goto error;
+	}
+
+	return tm;
+
+error:
+	tiledmap_free(tm);
+	return NULL;
+}
+
+void tiledmap_free(tiledmap_t *tm)
+{
+	if (tm) {
+		if (tm->blocks != MAP_FAILED) {
+			munmap(tm->blocks, tm->size);
+		}
+		if (tm->fd >= 0) {
+			close(tm->fd);
+		}
+		palette_unref(tm->palette);
+		free(tm);
+	}
+}
+
+int tiledmap_getPixel(const tiledmap_t *tm, int x, int y)
+{
+	return *tiledmap_pixelPtr(tm, x, y);
+}
+
+void tiledmap_setPixel(tiledmap_t *tm, int x, int y, int value)
+{
+	*tiledmap_pixelPtr(tm, x, y) = value;
+}
+
+int tiledmap_getPixels8x8(const tiledmap_t *tm, int x, int y, uint8_t *dst)
+{
+	int X, Y, px, py;
+
+	if (!(x & 7) && !(y & 7) && (x >= 0) && (y >= 0) && (x < tm->w) && (y < tm->h)) {
+		memcpy(dst, tiledmap_getBlock(tm, x >> 3, y >> 3), 64);
+		return 0;
+	}
+
+	for (Y=0; Y<8; Y++) {
+		py = y + Y;
+		if (py < 0) { py = 0; }
+		if (py >= tm->h) { py = tm->h - 1; }
+		for (X=0; X<8; X++) {
+			px = x + X;
+			if (px < 0) { px = 0; }
+			if (px >= tm->w) { px = tm->w - 1; }
+			*dst = tiledmap_getPixel(tm, px, py);
+			dst++;
+		}
+	}
+
+	return 0;
+}
+
+void tiledmap_setRow(tiledmap_t *tm, int y, const uint8_t *src)
+{
+	uint8_t *dst;
+	int bx, n, r;
+
+	for (bx=0; bx<tm->blocks_w; bx++) {
+		dst = tiledmap_getBlock(tm, bx, y >> 3) + ((y & 7) << 3);
+		n = tm->w - bx * 8;
+		if (n >= 8) {
+			memcpy(dst, src + bx * 8, 8);
+		} else {
+			// right edge: repeat the last pixel
+			memcpy(dst, src + bx * 8, n);
+			memset(dst + n, src[tm->w - 1], 8 - n);
+		}
+
+		if (y == tm->h - 1) {
+			// bottom edge: repeat the last row
+			for (r=(y & 7) + 1; r<8; r++) {
+				memcpy(dst + (r - (y & 7)) * 8, dst, 8);
+			}
+		}
+	}
+}
+
+void tiledmap_getRow(const tiledmap_t *tm, int y, uint8_t *dst)
+{
+	const uint8_t *src;
+	int bx, n;
+
+	for (bx=0; bx<tm->blocks_w; bx++) {
+		src = tiledmap_getBlock(tm, bx, y >> 3) + ((y & 7) << 3);
+		n = tm->w - bx * 8;
+		memcpy(dst + bx * 8, src, n < 8 ? n : 8);
+	}
+}
+
+static void remapRow(uint8_t *row, int w, const uint8_t *lut)
+{
+	int i;
+
+	for (i=0; i<w; i++) {
+		row[i] = lut[row[i]];
+	}
+}
+
+tiledmap_t *tiledmap_loadPNG(const char *in_filename, uint32_t flags)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_colorp palette;
+	png_bytep trans;
+	int num_palette, num_trans = 0;
+	int w, h, depth, color, passes, pass, y, i;
+	int drops = 0;
+	uint8_t header[8];
+	uint8_t lut[256];
+	FILE *fptr_in;
+	tiledmap_t * volatile tm = NULL;
+	uint8_t * volatile row = NULL;
+
+	fptr_in = fopen(in_filename, "rb");
+	if (!fptr_in) {
+		perror(in_filename);
+		return NULL;
+	}
+
+	if ((8 != fread(header, 1, 8, fptr_in)) || png_sig_cmp(header, 0, 8)) {
+		fprintf(stderr, "%s: Not a PNG file\n", in_filename);
+		fclose(fptr_in);
+		return NULL;
+	}
+
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr) {
+		fclose(fptr_in);
+		return NULL;
+	}
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr) {
+		png_destroy_read_struct(&png_ptr, NULL, NULL);
+		fclose(fptr_in);
+		return NULL;
+	}
+
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		goto error;
+	}
+
+	png_init_io(png_ptr, fptr_in);
+	png_set_sig_bytes(png_ptr, 8);
+	png_read_info(png_ptr, info_ptr);
+
+	w = png_get_image_width(png_ptr, info_ptr);
+	h = png_get_image_height(png_ptr, info_ptr);
+	depth = png_get_bit_depth(png_ptr, info_ptr);
+	color = png_get_color_type(png_ptr, info_ptr);
+
+	if (g_verbose) {
+		printf("Image: %d x %d, ",w,h);
+		printf("Bit depth: %d, ", depth);
+		printf("Color type: %d\n", color);
+	}
+
+	if (color != PNG_COLOR_TYPE_PALETTE) {
+		fprintf(stderr, "Unsupported color type. File must use a palette.\n");
+		goto error;
+	}
+
+	if (!png_get_PLTE(png_ptr, info_ptr, &palette, &num_palette)) {
+		fprintf(stderr, "Error getting palette\n");
+		goto error;
+	}
+
+	png_set_packing(png_ptr);
+	passes = png_set_interlace_handling(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+
+	tm = tiledmap_create(w, h, NULL);
+	if (!tm) {
+		goto error;
+	}
+
+	row = malloc(w);
+	if (!row) {
+		perror("malloc");
+		goto error;
+	}
+
+	// freshly allocated, not shared yet
+	tm->palette->count = num_palette;
+	for (i=0; i<num_palette; i++) {
+		tm->palette->colors[i].r = palette[i].red;
+		tm->palette->colors[i].g = palette[i].green;
+		tm->palette->colors[i].b = palette[i].blue;
+	}
+
+	// Same interpretation of tRNS as sprite_loadPNG
+	png_get_tRNS(png_ptr, info_ptr, &trans, &num_trans, NULL);
+	if (num_trans > 0) {
+		if (flags & SPRITE_LOADFLAG_DROP_TRANSPARENT) {
+			for (i=0; i<num_trans; i++) {
+				if (trans[i] > 0) {
+					fprintf(stderr, "Error: Removing non-zero color not implemented\n");
+				} else {
+					drops++;
+				}
+			}
+			if (drops) {
+				memmove(tm->palette->colors, tm->palette->colors + drops, sizeof(palent_t) * (tm->palette->count - drops));
+				tm->palette->count -= drops;
+			}
+		} else {
+			if (num_trans > 2) {
+				fprintf(stderr, "Only one transparent color is supported\n");
+				goto error;
+			}
+			tm->transparent_color = trans[0];
+			tm->flags |= SPRITE_FLAG_USE_TRANSPARENT_COLOR;
+		}
+	}
+
+	for (i=0; i<256; i++) {
+		lut[i] = i > drops ? i - drops : 0;
+	}
+
+	for (pass=0; pass<passes; pass++) {
+		for (y=0; y<h; y++) {
+			if (pass > 0) {
+				// later passes fill in the rows of the previous ones
+				tiledmap_getRow(tm, y, row);
+			}
+			png_read_row(png_ptr, row, NULL);
+			if (drops && (passes == 1)) {
+				remapRow(row, w, lut);
+			}
+			tiledmap_setRow(tm, y, row);
+		}
+	}
+
+	if (drops && (passes > 1)) {
+		for (y=0; y<h; y++) {
+			tiledmap_getRow(tm, y, row);
+			remapRow(row, w, lut);
+			tiledmap_setRow(tm, y, row);
+		}
+	}
+
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	fclose(fptr_in);
+	free(row);
+
+	return tm;
+
+error:
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	fclose(fptr_in);
+	free(row);
+	tiledmap_free(tm);
+
+	return NULL;
+}
+
+int tiledmap_savePNG(const char *out_filename, const tiledmap_t *tm)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_color palette[256] = { };
+	uint8_t * volatile row = NULL;
+	FILE *fptr;
+	int y, i;
+
+	for (i=0; i<tm->palette->count; i++) {
+		palette[i].red = tm->palette->colors[i].r;
+		palette[i].green = tm->palette->colors[i].g;
+		palette[i].blue = tm->palette->colors[i].b;
+	}
+
+	fptr = fopen(out_filename, "wb");
+	if (!fptr) {
+		perror(out_filename);
+		return -1;
+	}
+
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (!png_ptr) {
+		fclose(fptr);
+		return -1;
+	}
+
+	info_ptr = png_create_info_struct(png_ptr);
+	if (!info_ptr) {
+		png_destroy_write_struct(&png_ptr, NULL);
+		fclose(fptr);
+		return -1;
+	}
+
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		fclose(fptr);
+		free(row);
+		return -1;
+	}
+
+	row = malloc(tm->w);
+	if (!row) {
+		perror("malloc");
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		fclose(fptr);
+		return -1;
+	}
+
+	png_init_io(png_ptr, fptr);
+	pngopts_apply(png_ptr, &g_png_saveopts);
+
+	png_set_IHDR(png_ptr, info_ptr, tm->w, tm->h, 8, PNG_COLOR_TYPE_PALETTE, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+	png_set_PLTE(png_ptr, info_ptr, palette, tm->palette->count);
+	if (tm->flags & SPRITE_FLAG_USE_TRANSPARENT_COLOR) {
+		png_byte trans = tm->transparent_color;
+		png_set_tRNS(png_ptr, info_ptr, &trans, 1, NULL);
+	}
+
+	png_write_info(png_ptr, info_ptr);
+
+	for (y=0; y<tm->h; y++) {
+		tiledmap_getRow(tm, y, row);
+		png_write_row(png_ptr, row);
+	}
+
+	png_write_end(png_ptr, NULL);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	fclose(fptr);
+	free(row);
+
+	return 0;
+}
@@ -0,0 +1,68 @@
+#ifndef _tiledmap_h__
+#define _tiledmap_h__
+
+#include <stdint.h>
+#include <stddef.h>
+#include "palette.h"
+
+/* Out-of-core indexed image for very large maps
+ *
+ * The pixels live in a file mapped in memory rather than on the heap, so
+ * images larger than the available memory can be processed. Only the pages
+ * in use need to be resident.
+ *
+ * Pixels are stored in 8x8 blocks of 64 consecutive bytes (blocks in
+ * row-major order), so reading a tile touches a single cache line instead
+ * of eight rows far apart. When the size is not a multiple of 8, the last
+ * column and row are repeated to fill the edge blocks (like
+ * sprite_getPixelSafeExtend).
+ *
+ * The backing file is created in $TMPDIR (or /tmp) and deleted right away,
+ * unless a filename is given.
+ */
+
+#define TILEDMAP_BLOCK_SIZE	8
+
+typedef struct tiledmap {
+	int w, h; // in pixels
+	int blocks_w, blocks_h;
+	palette_t *palette;
+	uint8_t transparent_color;
+	uint8_t flags; // SPRITE_FLAG_*
+
+	uint8_t *blocks; // mapped
+	size_t size;
+	int fd;
+} tiledmap_t;
+
+tiledmap_t *tiledmap_create(int w, int h, const char *backing_filename);
+void tiledmap_free(tiledmap_t *tm);
+
+// The 64 pixels of block bx,by (block coordinates)
+static inline uint8_t *tiledmap_getBlock(const tiledmap_t *tm, int bx, int by)
+{
+	return tm->blocks + ((size_t)by * tm->blocks_w + bx) * 64;
+}
+
+static inline uint8_t *tiledmap_pixelPtr(const tiledmap_t *tm, int x, int y)
+{
+	return tiledmap_getBlock(tm, x >> 3, y >> 3) + ((y & 7) << 3) + (x & 7);
+}
+
+int tiledmap_getPixel(const tiledmap_t *tm, int x, int y);
+void tiledmap_setPixel(tiledmap_t *tm, int x, int y, int value);
+
+// Same as sprite_getPixels8x8. A single copy when x and y are multiples of 8.
+int tiledmap_getPixels8x8(const tiledmap_t *tm, int x, int y, uint8_t *dst);
+
+// Store a row of w pixels (also fills the padding of edge blocks)
+void tiledmap_setRow(tiledmap_t *tm, int y, const uint8_t *src);
+void tiledmap_getRow(const tiledmap_t *tm, int y, uint8_t *dst);
+
+// Decodes one row at a time directly into the map.
+// Supports SPRITE_LOADFLAG_DROP_TRANSPARENT.
+tiledmap_t *tiledmap_loadPNG(const char *in_filename, uint32_t flags);
+// Uses g_png_saveopts
+int tiledmap_savePNG(const char *out_filename, const tiledmap_t *tm);
+
+#endif // _tiledmap_h__
@@ -1,5 +1,6 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "tilemap.h"
 
 tilemap_t *tilemap_allocate(int tiles_w, int tiles_h)
@@ -155,6 +156,15 @@ int tilemap_compare(tilemap_t *tm1, tilemap_t *tm2)
 // returns number unique missing tiles in cat that would need adding
 //
 int tilemap_populateFromCatalog(tilemap_t *tm, sprite_t *img, tilecatalog_t *cat)
+{
+	sprite_view_t view;
+
+	sprite_getView(img, NULL, &view);
+
+	return tilemap_populateFromCatalogView(tm, &view, cat);
+}
+
+int tilemap_populateFromCatalogView(tilemap_t *tm, const sprite_view_t *img, tilecatalog_t *cat)
 {
 	uint32_t id;
 	uint8_t flags;
@@ -170,10 +180,10 @@ int tilemap_populateFromCatalog(tilemap_t *tm, sprite_t *img, tilecatalog_t *cat
 
 	for (y=0; y<tm->h; y++) {
 		for (x=0; x<tm->w; x++) {
-			if (tilecat_isTileInCatalog(cat, img, x*8, y*8, &id, &flags)) {
+			if (tilecat_isViewTileInCatalog(cat, img, x*8, y*8, &id, &flags)) {
 				tilemap_setTileID(tm, x, y, id, flags);
 			} else {
-				tilecat_addFromSprite(addcat, img, x*8, y*8, &id, &flags);
+				tilecat_addFromView(addcat, img, x*8, y*8, &id, &flags);
 				tilemap_setTileID(tm, x, y, 0xFFFF, 0);
 			}
 		}
@@ -211,6 +221,37 @@ sprite_t *tilemap_toSprite(tilemap_t *tm, tilecatalog_t *cat, palette_t *pal)
 	return spr;
 }
 
+tiledmap_t *tilemap_toTiledMap(tilemap_t *tm, tilecatalog_t *cat, palette_t *pal)
+{
+	tiledmap_t *map;
+	sms_tile_t *t;
+	uint8_t *src;
+	int x,y;
+
+	map = tiledmap_create(tm->w * 8, tm->h * 8, NULL);
+	if (!map)
+		return NULL;
+
+	palette_copy(map->palette, pal);
+
+	for (y=0; y<tm->h; y++) {
+		for (x=0; x<tm->w; x++) {
+			t = &cat->tiles[tilemap_getTileID(tm, x, y)];
+			// the catalog already holds the flipped versions
+			switch (tilemap_getTileFlags(tm, x, y) & TILEMAP_FLIP_XY)
+			{
+				default: src = t->image_8bpp; break;
+				case TILEMAP_FLIP_X: src = t->image_8bpp_x; break;
+				case TILEMAP_FLIP_Y: src = t->image_8bpp_y; break;
+				case TILEMAP_FLIP_XY: src = t->image_8bpp_xy; break;
+			}
+			memcpy(tiledmap_getBlock(map, x, y), src, 64);
+		}
+	}
+
+	return map;
+}
+
 uint8_t tilemap_getUsedFlags(tilemap_t *tm)
 {
 	int i;
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "tilecatalog.h"
+#include "tiledmap.h"
 
 typedef struct _tilecatalog tilecatalog_t;
 
@@ -35,6 +36,8 @@ int getAllUsedTiles(tilemap_t *tm, struct tileUseEntry **dst);
 int tilemap_replaceID(tilemap_t *tm, int orig_id, int new_id, uint8_t new_flags);
 
 sprite_t *tilemap_toSprite(tilemap_t *tm, tilecatalog_t *cat, palette_t *pal);
+// Same, for maps too large for memory (see tiledmap.h)
+tiledmap_t *tilemap_toTiledMap(tilemap_t *tm, tilecatalog_t *cat, palette_t *pal);
 
 // Fill a tilemap with catalog tile IDs for image. Missing tiles are NOT
 // added to catalog, those are set to 0xFFFF.
@@ -43,6 +46,7 @@ sprite_t *tilemap_toSprite(tilemap_t *tm, tilecatalog_t *cat, palette_t *pal);
 // to the catalog.
 //
 int tilemap_populateFromCatalog(tilemap_t *tm, sprite_t *img, tilecatalog_t *cat);
+int tilemap_populateFromCatalogView(tilemap_t *tm, const sprite_view_t *img, tilecatalog_t *cat);
 
 uint8_t tilemap_getUsedFlags(tilemap_t *tm);
 int tilemap_countFlag(tilemap_t *tm, uint8_t flag);